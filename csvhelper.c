@@ -28,6 +28,8 @@ static int  maxline  = 0;     /* size of line[] and sline[] */
 static char **field  = NULL;  /* field pointers */
 static int  maxfield = 0;     /* size of field[] */
 static int  nfield   = 0;     /* number of fields in field[] */
+/* per thread, so that the jobs of a batch can read their files concurrently */
+#pragma omp threadprivate(line, sline, maxline, field, maxfield, nfield)
 
 static char fieldsep[] = ","; /* field separator chars */
 
@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <omp.h>
 #include "kmeans.h"
 
 static char* headers[3];
 static int dimensions;
+// of the job the thread is running: the jobs of a batch run side by side
+#pragma omp threadprivate(headers, dimensions)
 
 /**
  * Initializes the given array of points to act as initial centroid "representatives" of the
@@ -32,45 +35,114 @@ void initialize_centroids(struct point* dataset, struct point *centroids, int nu
 }
 
 /**
- * Assigns each point in the dataset to a cluster based on the distance from that cluster.
- *
- * The return value indicates how many points were assigned to a _different_ cluster
- * in this assignment process: this indicates how close the algorithm is to completion.
- * When the return value is zero, no points changed cluster so the clustering is complete.
- *
- * @param dataset set of all points with current cluster assignments
- * @param num_points number of points in the dataset
- * @param centroids array that holds the current centroids
- * @param num_clusters number of clusters - hence size of the centroids array
- * @return the number of points for which the cluster assignment was changed
+ * Label the input file with the centroids of a saved model instead of clustering it,
+ * reporting the throughput in the metrics.
  */
-extern int assign_clusters(struct point* dataset, int num_points, struct point *centroids, int num_clusters);
+static int predict(struct kmeans_config *config)
+{
+    struct kmeans_metrics metrics = new_metrics();
+    metrics.label = config->label;
+    metrics.omp_max_threads = omp_get_max_threads();
+    metrics.omp_schedule_kind = omp_schedule_kind(&metrics.omp_chunk_size);
+    predict_file(config, &metrics);
+
+    if (config->metrics_file) {
+        write_metrics_file(config->metrics_file, &metrics);
+    }
+    if (!config->silent) {
+        print_metrics_headers(stdout);
+        print_metrics(stdout, &metrics);
+    }
+    return 0;
+}
 
 /**
- * Calculates new centroids for the clusters of the given dataset by finding the
- * mean x and y coordinates of the current members of the cluster for each cluster.
- *
- * The centroids are set in the array passed in, which is expected to be pre-allocated
- * and contain the previous centroids: these are overwritten by the new values.
+ * Generate a synthetic dataset instead of clustering, reporting the throughput in the metrics.
+ */
+static int generate(struct kmeans_config *config)
+{
+    struct kmeans_metrics metrics = new_metrics();
+    metrics.label = config->label;
+    metrics.omp_max_threads = omp_get_max_threads();
+    metrics.omp_schedule_kind = omp_schedule_kind(&metrics.omp_chunk_size);
+    generate_file(config, &metrics);
+
+    if (config->metrics_file) {
+        write_metrics_file(config->metrics_file, &metrics);
+    }
+    if (!config->silent) {
+        print_metrics_headers(stdout);
+        print_metrics(stdout, &metrics);
+    }
+    return 0;
+}
+
+/**
+ * The points as they are clustered - the dataset itself, or an aggregated and/or reordered
+ * copy of it - with what it takes to get the clusters back to the dataset in file order.
+ */
+struct prepared_points {
+    struct point *points;
+    size_t num_points;
+    size_t *row_to_point; // --dedup: index of the aggregated point of each row of the dataset
+    size_t *order;        // --reorder: the permutation to undo
+    // the tree of splits of the engine: like the rest of its state, the hierarchy is kept by the
+    // thread that clustered, which with --pipeline is not always the one that saves it
+    struct cluster_hierarchy hierarchy;
+};
+
+/**
+ * Preprocess the dataset and cluster it: the clustering stage of main, or the --k-range sweep.
  *
- * @param dataset set of all points with current cluster assignments
+ * @param config run configuration
+ * @param dataset points in file order, with centroids already picked from them
  * @param num_points number of points in the dataset
- * @param centroids array to hold the centroids - already allocated
- * @param num_clusters number of clusters - hence size of the centroids array
+ * @param centroids initial centroids, overwritten with the final ones
+ * @param prepared set to the points that were clustered
+ * @param initial_centroids for --coreset-compare, set to a copy of the initial centroids
+ * @param metrics timings, settings and counters of the run are set here
+ * @return the number of points that changed cluster in the last iteration
  */
-extern void calculate_centroids(struct point* dataset, int num_points, struct point *centroids, int num_clusters);
-
-int main(int argc, char* argv [])
+static size_t cluster(struct kmeans_config *config, struct point *dataset, size_t num_points,
+                      struct point *centroids, struct prepared_points *prepared,
+                      struct point **initial_centroids, struct kmeans_metrics *metrics)
 {
-    struct kmeans_config config = parse_cli(argc, argv);
-
-    struct point *dataset = malloc(config.max_points * sizeof(struct point));
-    char* csv_file_name = valid_file('f', config.in_file);
-    int num_points = read_csv_file(csv_file_name, dataset, config.max_points, headers, &dimensions);
+    // optional preprocessing after the centroids are picked, so the clustering is the same
+    // as without it - only the order in which the points are processed changes, and with
+    // aggregation each distinct point is clustered once with the weight of all its rows
+    prepared->points = dataset;
+    prepared->num_points = num_points;
+    prepared->row_to_point = NULL;
+    prepared->order = NULL;
+    prepared->hierarchy = (struct cluster_hierarchy) {NULL, 0};
+    struct point *points = dataset;
+    size_t num_clustered = num_points;
+    if (config->dedup) {
+        double start_aggregate = omp_get_wtime();
+        points = aggregate_points(dataset, num_points, config->grid_cell, &num_clustered, &prepared->row_to_point);
+        metrics->aggregate_seconds = omp_get_wtime() - start_aggregate;
+        if (!config->quiet) {
+            printf("Aggregated %zu points into %zu weighted points\n", num_points, num_clustered);
+        }
+    }
+    if (config->reorder) {
+        double start_reorder = omp_get_wtime();
+        prepared->order = hilbert_reorder(points, num_clustered);
+        metrics->reorder_seconds = omp_get_wtime() - start_reorder;
+    }
+    prepared->points = points;
+    prepared->num_points = num_clustered;
+    metrics->label = config->label;
+    metrics->max_iterations = config->max_iterations;
+    metrics->num_points = num_points;
+    metrics->aggregated_points = config->dedup ? num_clustered : 0;
 
-    // K-Means Algo Step 1: initialize the centroids
-    struct point *centroids = malloc(config.num_clusters * sizeof(struct point));
-    initialize_centroids(dataset, centroids, config.num_clusters);
+    if (config->k_max > 0) {
+        // --k-range: every k is fitted on the points prepared above, and reported on its own
+        sweep_clusters(config, points, num_clustered, centroids, metrics);
+        workspace_free();
+        return 0;
+    }
 
     // we deliberately skip the centroid initialization phase in calculating the
     // total time as it is constant and never optimized
@@ -80,95 +152,340 @@ int main(int argc, char* argv [])
     print_headers(stdout, headers, dimensions);
     print_points(stdout, dataset, num_points);
     printf("\nCentroids:\n");
-    print_centroids(stdout, centroids, config.num_clusters);
+    print_centroids(stdout, centroids, config->num_clusters);
 #endif
-    int cluster_changes = num_points;
-    int iterations = 0;
+    metrics->num_clusters = config->num_clusters;
 
-    // set up a metrics struct to hold timing and other info for comparison
-    struct kmeans_metrics metrics = new_metrics();
-    metrics.label = config.label;
-    metrics.max_iterations = config.max_iterations;
-    metrics.num_clusters = config.num_clusters;
-    metrics.num_points = num_points;
-    metrics.omp_max_threads = omp_get_max_threads();
+    // for --coreset-compare: the full fit must start from the same centroids
+    if (config->coreset_size > 0 && config->coreset_compare) {
+        *initial_centroids = malloc(config->num_clusters * sizeof(struct point));
+        memcpy(*initial_centroids, centroids, config->num_clusters * sizeof(struct point));
+    }
+
+    // approximate fit: the centroids are fitted on a small weighted sample of the points
+    struct point *fitted = points;
+    size_t num_fitted = num_clustered;
+    if (config->coreset_size > 0 && config->coreset_size < num_clustered) {
+        double start_coreset = omp_get_wtime();
+        fitted = build_coreset(points, num_clustered, config->coreset_size, &num_fitted);
+        metrics->coreset_seconds = omp_get_wtime() - start_coreset;
+        metrics->coreset_points = num_fitted;
+        if (!config->quiet) {
+            printf("Fitting on a coreset of %zu points\n", num_fitted);
+        }
+    }
+
+    // tuned on the points actually fitted, before the metrics take the OpenMP settings,
+    // which may come from the tuning file
+    if (config->autotune) {
+        autotune_start(config, num_fitted, config->num_clusters);
+    }
+    metrics->omp_max_threads = omp_get_max_threads();
     // get kind: dynamic, static, auto.. and the chunk size
-    metrics.omp_schedule_kind = omp_schedule_kind(&metrics.omp_chunk_size);
+    metrics->omp_schedule_kind = omp_schedule_kind(&metrics->omp_chunk_size);
 
-    while (cluster_changes > 0 && iterations < config.max_iterations) {
-        // K-Means Algo Step 2: assign every point to a cluster (closest centroid)
-        double start_iteration = omp_get_wtime();
-        double start_assignment = start_iteration;
-        cluster_changes = assign_clusters(dataset, num_points, centroids, config.num_clusters);
-        double assignment_seconds = omp_get_wtime() - start_assignment;
+    // K-Means Algo Steps 2 and 3, repeated until the clusters are stable, without allocating
+    // anything once started: the engine gets all its scratch space from the workspace now
+    // (and with --checkpoint, the engine registers the state it keeps between iterations)
+    // (the thread may have run another job of a batch before, with counters of its own)
+    engine_stats = (struct engine_stats) {0};
+    checkpoint_start(config, fitted, num_fitted, config->num_clusters);
+    reserve_workspace(num_fitted, config->num_clusters);
+    if (!config->batch_job) {
+        // a batch reports each job as it finishes instead
+        progress_start(config, num_fitted);
+    }
+    long allocations_before_loop = workspace_allocations();
+    size_t cluster_changes = run_lloyd(fitted, num_fitted, centroids, config->num_clusters,
+                                       config->max_iterations, metrics);
+    metrics->loop_allocations = workspace_allocations() - allocations_before_loop;
+    progress_finish(fitted, num_fitted, centroids, config->num_clusters);
+    checkpoint_finish();
+    if (config->autotune) {
+        // in case the run converged before all candidates were tried
+        autotune_finish(metrics);
+    }
+    if (fitted != points) {
+        // a single assignment of all the points to the centroids fitted on the coreset
+        double start_assignment = omp_get_wtime();
+        assign_clusters(points, num_clustered, centroids, config->num_clusters);
+        metrics->assignment_seconds += omp_get_wtime() - start_assignment;
+        free(fitted);
+    }
+    // a resumed run counts the time before its checkpoint too
+    metrics->total_seconds = omp_get_wtime() - start_time + metrics->resumed_seconds;
+    metrics->engine = engine_stats;
+    prepared->hierarchy = cluster_hierarchy;
+    // the workspace of this thread, which may not be the thread the run goes on with
+    workspace_free();
+    return cluster_changes;
+}
 
-        metrics.assignment_seconds += assignment_seconds;
+/**
+ * Loads the input, clusters it, measures and writes out the result and tests it, with the
+ * time of each stage in the metrics along with the end to end time: a run of main, or one
+ * job of a --batch.
+ *
+ * With --pipeline, stages that don't depend on each other overlap, two at a time in a parallel
+ * sections construct: the warm start model is loaded while the input is parsed, the test file
+ * is loaded while the points are clustered, and the output file is written while the quality
+ * measures are computed. The clustering and the quality measures run their parallel regions
+ * nested inside their section, with all the threads. Without --pipeline the sections run one
+ * after the other, as plain sequential code.
+ *
+ * @param config run configuration
+ * @param metrics set to the metrics of the run
+ * @param start_seconds when the run started, for the end to end time
+ * @return the exit status
+ */
+static int run_job(struct kmeans_config *config, struct kmeans_metrics *metrics, double start_seconds)
+{
+    *metrics = new_metrics();
 
-#ifdef DEBUG
-        printf("\n%d clusters changed after assignment phase. New assignments:\n", cluster_changes);
-        print_points(stdout, dataset, num_points);
-        printf("Time taken: %.3f seconds total in assignment so far: %.3f seconds",
-               assignment_seconds, metrics.assignment_seconds);
-#endif
-        // K-Means Algo Step 3: calculate new centroids: one at the center of each cluster
-        double start_centroids = omp_get_wtime();
-        calculate_centroids(dataset, num_points, centroids, config.num_clusters);
-        double centroids_seconds = omp_get_wtime() - start_centroids;
-        metrics.centroids_seconds += centroids_seconds;
-
-#ifdef TRACE
-        printf("New centroids calculated New assignments:\n");
-        print_centroids(stdout, centroids, config.num_clusters);
-        printf("Time taken: %.3f seconds total in centroid calculation so far: %.3f seconds",
-               centroids_seconds, metrics.centroids_seconds);
-#endif
-#ifndef SKIP_MAX_ITERATION_CALC
-        // potentially costly calculation may skew stats, hence only in ifdef
-        double iteration_seconds = omp_get_wtime() - start_iteration;
-        if (iteration_seconds > metrics.max_iteration_seconds) {
-            metrics.max_iteration_seconds = iteration_seconds;
+    struct point *dataset;
+    char* csv_file_name = valid_file('f', config->in_file);
+    size_t num_points = 0;
+    struct point *centroids = NULL;
+    int model_clusters = 0;
+    // the headers of this thread, for the sections that may run on another
+    char **file_headers = headers;
+    int *file_dimensions = &dimensions;
+#pragma omp parallel sections num_threads(2) if(config->pipeline)
+    {
+#pragma omp section
+        {
+            double start_load = omp_get_wtime();
+            num_points = read_csv_file(csv_file_name, &dataset, config->max_points, file_headers, file_dimensions);
+            metrics->load_seconds = omp_get_wtime() - start_load;
         }
-#endif
-        iterations++;
+#pragma omp section
+        if (config->warm_start) {
+            // start from a previous fit, e.g. yesterday's run on the same area, which
+            // usually only needs a few iterations to converge again
+            centroids = load_model(config->warm_start, &model_clusters);
+        }
+    }
+
+    // --geo: cluster on a plane in km, but keep the degrees to report the points in
+    struct point *original = NULL;
+    struct geo_projection projection;
+    if (config->geo) {
+        double start_projection = omp_get_wtime();
+        original = malloc(num_points * sizeof(struct point));
+        memcpy(original, dataset, num_points * sizeof(struct point));
+        projection = geo_projection_around(dataset, num_points);
+        geo_project(&projection, dataset, num_points);
+        if (config->warm_start) {
+            geo_project(&projection, centroids, model_clusters);
+        }
+        metrics->projection_seconds = omp_get_wtime() - start_projection;
+        if (!config->quiet) {
+            printf("Projected to km around longitude %f, latitude %f\n", projection.lon0, projection.lat0);
+        }
+    }
+
+    // K-Means Algo Step 1: initialize the centroids
+    if (config->warm_start) {
+        if (model_clusters != config->num_clusters && !config->quiet) {
+            printf("Using the %d clusters of the warm start model\n", model_clusters);
+        }
+        config->num_clusters = model_clusters;
+    }
+    else {
+        centroids = malloc(config->num_clusters * sizeof(struct point));
+        initialize_centroids(dataset, centroids, config->num_clusters);
+    }
+
+    // the test file is read while the points are clustered: the test only needs to know how many
+    char *test_file_name = NULL;
+    if (config->test_file && config->k_max == 0) {
+        test_file_name = valid_file('t', config->test_file);
+        if (!config->quiet) {
+            printf("Comparing results against test file: %s\n", config->test_file);
+        }
+    }
+    struct point *testset = NULL;
+    size_t num_test_points = 0;
+    struct prepared_points prepared;
+    struct point *initial_centroids = NULL;
+    size_t cluster_changes = 0;
+#pragma omp parallel sections num_threads(2) if(config->pipeline)
+    {
+#pragma omp section
+        cluster_changes = cluster(config, dataset, num_points, centroids, &prepared, &initial_centroids, metrics);
+#pragma omp section
+        if (test_file_name) {
+            char* test_headers[3];
+            int test_dimensions;
+            double start_test_load = omp_get_wtime();
+            num_test_points = read_csv_file(test_file_name, &testset, num_points, test_headers, &test_dimensions);
+            metrics->test_load_seconds = omp_get_wtime() - start_test_load;
+        }
+    }
+    if (config->k_max > 0) {
+        return 0; // the sweep reported every k itself
     }
-    metrics.total_seconds = omp_get_wtime() - start_time;
-    metrics.used_iterations = iterations;
+    struct point *points = prepared.points;
+    size_t num_clustered = prepared.num_points;
 
-    if (!config.quiet) {
-        printf("\nEnded after %d iterations with %d changed clusters\n", iterations, cluster_changes);
+    metrics->inertia = inertia(points, num_clustered, centroids, config->num_clusters);
+    if (initial_centroids) {
+        // untimed full fit, only to see how much the coreset costs in quality
+        struct point *full = malloc(num_clustered * sizeof(struct point));
+        memcpy(full, points, num_clustered * sizeof(struct point));
+        for (size_t n = 0; n < num_clustered; ++n) {
+            full[n].cluster = -1;
+        }
+        struct kmeans_metrics full_metrics = new_metrics();
+        run_lloyd(full, num_clustered, initial_centroids, config->num_clusters, config->max_iterations, &full_metrics);
+        double full_inertia = inertia(full, num_clustered, initial_centroids, config->num_clusters);
+        metrics->inertia_gap = full_inertia > 0 ? metrics->inertia / full_inertia - 1.0 : 0.0;
+        if (!config->quiet) {
+            printf("Coreset inertia %f, full inertia %f: %.2f%% worse\n",
+                   metrics->inertia, full_inertia, 100.0 * metrics->inertia_gap);
+        }
+        free(full);
+        free(initial_centroids);
+        workspace_free(); // the full fit ran in the workspace of this thread
+    }
+
+    // everything from here on expects the points in file order
+    if (prepared.order) {
+        restore_order(points, num_clustered, prepared.order);
+        free(prepared.order);
+    }
+    if (prepared.row_to_point) {
+        double start_expand = omp_get_wtime();
+        expand_labels(dataset, num_points, points, prepared.row_to_point);
+        metrics->aggregate_seconds += omp_get_wtime() - start_expand;
+        free(prepared.row_to_point);
+    }
+
+    // the points are reported as they were read: in degrees with --geo
+    struct point *reported = dataset;
+    if (original) {
+#pragma omp parallel for schedule(static)
+        for (size_t n = 0; n < num_points; ++n) {
+            original[n].cluster = dataset[n].cluster;
+        }
+        reported = original;
+    }
+
+    if (config->save_model) {
+        if (!config->silent) {
+            printf("Saving model to %s\n", config->save_model);
+        }
+        struct point *model = centroids;
+        if (config->geo) {
+            model = malloc(config->num_clusters * sizeof(struct point));
+            memcpy(model, centroids, config->num_clusters * sizeof(struct point));
+            geo_unproject(&projection, model, config->num_clusters);
+        }
+        save_model(config->save_model, model, config->num_clusters, config->geo ? &projection : NULL);
+        if (model != centroids) {
+            free(model);
+        }
+    }
+    if (config->hierarchy_file) {
+        struct cluster_hierarchy *hierarchy = &prepared.hierarchy;
+        if (hierarchy->num_nodes > 0) {
+            if (!config->silent) {
+                printf("Saving the hierarchy of clusters to %s\n", config->hierarchy_file);
+            }
+            if (config->geo) {
+                // the sse of the nodes stays in km
+                for (int i = 0; i < hierarchy->num_nodes; ++i) {
+                    geo_unproject(&projection, &hierarchy->nodes[i].centroid, 1);
+                }
+            }
+            save_hierarchy(config->hierarchy_file, hierarchy);
+        }
+        else {
+            fprintf(stderr, "Warning: %s does not build a hierarchy of clusters, not writing %s\n",
+                    config->engine, config->hierarchy_file);
+        }
     }
 
     // output file is not always written: sometimes we only run for metrics and compare with test data
-    if (config.out_file) {
-        if (!config.silent) {
-            printf("Writing output to %s\n", config.out_file);
+    if (config->out_file && !config->silent) {
+        printf("Writing output to %s\n", config->out_file);
+    }
+#pragma omp parallel sections num_threads(2) if(config->pipeline)
+    {
+#pragma omp section
+        {
+            // the quality measures work on the points as clustered, aggregated or not
+            double start_quality = omp_get_wtime();
+            cluster_quality(points, num_clustered, centroids, config->num_clusters, metrics);
+            metrics->quality_seconds = omp_get_wtime() - start_quality;
+        }
+#pragma omp section
+        if (config->out_file) {
+            double start_output = omp_get_wtime();
+            write_csv_file(config->out_file, reported, num_points, file_headers, *file_dimensions);
+            metrics->output_seconds = omp_get_wtime() - start_output;
         }
-        write_csv_file(config.out_file, dataset, num_points, headers, dimensions);
+    }
+    if (points != dataset) {
+        free(points);
     }
 #ifdef DEBUG
-    write_csv(stdout, dataset, num_points, headers, dimensions);
+    write_csv(stdout, reported, num_points, headers, dimensions);
 #endif
 
-    if (config.test_file) {
-        char* test_file_name = valid_file('t', config.test_file);
-        if (!config.quiet) {
-            printf("Comparing results against test file: %s\n", config.test_file);
-        }
-        metrics.test_result = test_results(&config, test_file_name, dataset, num_points);
+    if (testset) {
+        metrics->test_result = test_results(config, testset, num_test_points, reported, num_points,
+                                            &metrics->adjusted_rand);
+        free(testset);
+    }
+    free(original);
+    metrics->peak_rss_kb = peak_rss_kb();
+
+    if (!config->quiet) {
+        printf("\nEnded after %d iterations with %zu changed clusters\n", metrics->used_iterations, cluster_changes);
+        printf("Inertia %f, Davies-Bouldin %f, sampled silhouette %f\n",
+               metrics->inertia, metrics->davies_bouldin, metrics->silhouette);
     }
 
-    if (config.metrics_file) {
+    metrics->wall_seconds = omp_get_wtime() - start_seconds;
+    if (!config->quiet) {
+        printf("Seconds: load %f, clustering %f, test load %f, quality %f, output %f, end to end %f\n",
+               metrics->load_seconds, metrics->total_seconds, metrics->test_load_seconds,
+               metrics->quality_seconds, metrics->output_seconds, metrics->wall_seconds);
+    }
+    if (config->metrics_file) {
         // metrics file may or may not already exist
-        if (!config.quiet) {
-            printf("Reporting metrics to: %s\n", config.metrics_file);
+        if (!config->quiet) {
+            printf("Reporting metrics to: %s\n", config->metrics_file);
         }
-        write_metrics_file(config.metrics_file, &metrics);
+        // the jobs of a batch share one metrics file
+#pragma omp critical(metrics_file)
+        write_metrics_file(config->metrics_file, metrics);
     }
 
-    if (!config.silent) {
+    if (!config->silent) {
         print_metrics_headers(stdout);
-        print_metrics(stdout, &metrics);
+        print_metrics(stdout, metrics);
     }
     return 0;
 }
 
+int main(int argc, char* argv [])
+{
+    double start_program = omp_get_wtime();
+    struct kmeans_config config = parse_cli(argc, argv);
+    if (config.predict_model) {
+        return predict(&config);
+    }
+    if (config.generate) {
+        return generate(&config);
+    }
+    if (config.pipeline && omp_get_max_active_levels() < 2) {
+        omp_set_max_active_levels(2);
+    }
+    if (config.batch_file) {
+        return run_batch(&config, run_job);
+    }
+    struct kmeans_metrics metrics;
+    return run_job(&config, &metrics, start_program);
+}
@@ -10,11 +10,12 @@
 
 #define NUM_CLUSTERS 15
 #define MAX_ITERATIONS 10000
-#define MAX_POINTS 5000
+#define INITIAL_POINTS 5000 // points the loader makes room for before it starts growing
 
 struct point {
     double x, y;
     int cluster;
+    double weight; // number of input rows the point stands for: 1 unless the points were aggregated
 };
 
 struct kmeans_config {
@@ -23,58 +24,269 @@ struct kmeans_config {
     char *test_file;
     char *metrics_file;
     char *label;
-    int max_points;
+    size_t max_points; // read at most this many points, 0 for all of them
     int num_clusters;
     int max_iterations;
     bool silent;
     bool quiet;
+    bool reorder; // sort the points along a Hilbert curve before clustering
+    char *save_model;    // write the final centroids to this model file
+    char *warm_start;    // start from the centroids in this model file instead of the first points
+    char *predict_model; // don't cluster: label the input with the centroids in this model file
+    bool dedup;          // cluster each distinct point once, weighted by the number of rows it has
+    double grid_cell;    // if > 0, snap the points to a grid of this cell size before dedup
+    size_t coreset_size;  // if > 0, fit the centroids on a weighted sample of about this many points
+    bool coreset_compare; // also run on all points to report how much worse the coreset fit is
+    bool autotune;        // try out thread counts and schedules in the first iterations, keep the fastest
+    char *tuning_file;    // settings found by --autotune are saved here and reused by later runs
+    char *engine;         // name the program was run as, which is the engine it was built with
+    int k_max;            // --k-range: fit every k from num_clusters up to this, 0 for a single k
+    char *hierarchy_file; // write the tree of cluster splits here, for engines that build one
+    bool pipeline;        // overlap loading, clustering and output on a second thread, see kmeans.c
+    char *generate;       // don't cluster: generate a dataset of this kind (blobs, uniform, gps) into -o
+    double noise;         // --generate: spread of the clusters as a fraction of the side of the area
+    unsigned long long seed; // --generate: seed of the random numbers, the same seed gives the same file
+    char *truth_file;     // --generate: write the points with the clusters they were drawn from here
+    char *checkpoint_file;     // save the state of the run here now and then, see kmeans_checkpoint.c
+    int checkpoint_iterations; // --checkpoint-every: iterations between checkpoints, 0 to go by seconds
+    double checkpoint_seconds; // --checkpoint-every: seconds between checkpoints, if not by iterations
+    bool resume;               // continue from the checkpoint file, if there is one, instead of starting over
+    char *progress_file;       // live progress snapshots go here (- or NULL for stderr), see kmeans_progress.c
+    double progress_seconds;   // --progress-every: seconds between snapshots, 0 for only on SIGUSR1
+    bool geo;                  // the points are longitude, latitude: cluster them projected to km, see kmeans_geo.c
+    char *batch_file;          // run every job in this manifest instead of a single input, see kmeans_batch.c
+    bool batch_job;            // this is one job of a batch, running alongside others
 };
 
 extern struct kmeans_config new_config();
 
+/**
+ * Counters kept by engines and execution modes that have more to report than the timings
+ * of the main loop. Engines update the global engine_stats, main copies them into the metrics.
+ * Like the hierarchy below, it is threadprivate: a thread running a job of a batch has its own,
+ * so engines must only touch it outside their parallel regions.
+ */
+struct engine_stats {
+    long work_blocks;         // blocks of points executed by the work-stealing scheduler
+    long work_steals;         // blocks (or ranges of blocks) run by a thread other than the one that made them
+    double block_seconds;     // total time spent inside blocks - compare with the phase timings for overhead
+    double max_block_seconds; // slowest single block: a large ratio to the average means uneven work
+    int block_grain;          // points per block the scheduler settled on after adapting
+    long full_recomputes;     // incremental engine: iterations that rebuilt the cluster sums from all points
+    double index_build_seconds; // grid engine: total time spent bucketing the centroids into the grid
+    double index_query_seconds; // grid engine: total time spent searching the grid for the nearest centroids
+    long distance_calculations; // grid engine: point to centroid distances calculated, compare with n * k * iterations
+};
+
+extern struct engine_stats engine_stats;
+#pragma omp threadprivate(engine_stats)
+
+/**
+ * Tree of cluster splits, built by the hierarchical engines (kmeans_bisect) and empty for the
+ * others. Node 0 is the root holding all points; every split turns a leaf into the parent of
+ * two new nodes. The clusters for a smaller k are the nodes made by the first k - 1 splits
+ * (or the root) that were not split themselves by then.
+ */
+struct hierarchy_node {
+    int parent;     // node that was split to make this one, -1 for the root
+    int created;    // number of the split that made this node, 0 for the root
+    int split;      // number of the split of this node, 0 if it is a leaf of the final tree
+    int cluster;    // final cluster of a leaf, -1 for the nodes that were split
+    double weight;  // total weight of the points in the node
+    double sse;     // weighted sum of squared distances of the points from the centroid
+    struct point centroid;
+};
+
+struct cluster_hierarchy {
+    struct hierarchy_node *nodes;
+    int num_nodes;
+};
+
+extern struct cluster_hierarchy cluster_hierarchy;
+#pragma omp threadprivate(cluster_hierarchy)
+
 struct kmeans_metrics {
     char *label; // label for metrics row from -l command line arg
     double assignment_seconds;    // total time spent assigning points to clusters in every iteration
     double centroids_seconds;     // total time spent calculating new centroids in every iteration
     double total_seconds;         // total time in seconds for the run
     double max_iteration_seconds; // time taken by the slowest iteration of the whole algo
+    double reorder_seconds;       // time spent sorting the points along a Hilbert curve (not in total_seconds)
+    double communication_seconds; // kmeans_mpi: total time spent combining the cluster sums across ranks
+    double aggregate_seconds;     // time spent collapsing duplicate points and expanding the labels (not in total_seconds)
+    double coreset_seconds;       // time spent sampling the coreset (in total_seconds)
+    double inertia;               // weighted sum of squared distances of all points from their centroids
+    double inertia_gap;           // --coreset-compare: relative inertia of the coreset fit over the full fit, minus 1
     int used_iterations; // number of actual iterations needed to complete clustering
     int test_result;     // 0 = not tested, 1 = passed, -1 = failed comparison with expected data
-    int num_points;      // number or points in the file limited to max from -n command line arg
+    size_t num_points;   // number or points in the file limited to max from -n command line arg
     int num_clusters;    // number of clusters from  -k command line arg
     int max_iterations;  // max iterations from -i command line arg
     int omp_max_threads; // OMP max threads, usually set by OMP_NUM_THREADS env var or an function call
+    int mpi_ranks;       // number of MPI processes for kmeans_mpi, 1 for the others
+    size_t aggregated_points; // weighted points actually clustered after --dedup or --grid, 0 without
+    size_t coreset_points;    // points in the coreset the centroids were fitted on, 0 without --coreset
+    int tuning_iterations; // --autotune: iterations spent trying out settings before keeping the fastest
+    long peak_rss_kb;        // most memory resident at any time during the run, in kilobytes
+    long loop_allocations;   // workspace buffers allocated during the iterations: should be 0
+    double min_cluster_size;   // total weight of the smallest cluster
+    double max_cluster_size;   // total weight of the largest cluster
+    double max_cluster_radius; // largest distance of a point from its centroid
+    double davies_bouldin;     // Davies-Bouldin index: lower is better, 0 for perfectly separated clusters
+    double silhouette;         // mean silhouette estimated on a sample of the points: -1 to 1, higher is better
+    double adjusted_rand;      // adjusted Rand index against the test file: 1 for the same clusters, nan if untested
+    double load_seconds;       // time spent reading the input file (not in total_seconds)
+    double test_load_seconds;  // time spent reading the test file (not in total_seconds)
+    double output_seconds;     // time spent writing the output file (not in total_seconds)
+    double quality_seconds;    // time spent on the quality measures (not in total_seconds)
+    double wall_seconds;       // end to end, from the start of the program until the metrics are written
+    int resumed_iterations;    // --resume: iterations done before the checkpoint the run resumed from (in used_iterations)
+    double resumed_seconds;    // --resume: clustering time before the checkpoint (in total_seconds)
+    long checkpoints;          // snapshots handed to the checkpoint writer
+    double checkpoint_seconds; // time the loop spent taking those snapshots (in total_seconds)
+    double projection_seconds; // --geo: time spent projecting the points to the plane (not in total_seconds)
     // Next 2 are OMP schedule kind (static, dynamic, auto) and chunk size, set by OMP_SCHEDULE var.
     // See: https://gcc.gnu.org/onlinedocs/libgomp/omp_005fget_005fschedule.html#omp_005fget_005fschedule
     int omp_schedule_kind;
     int omp_chunk_size;
+    struct engine_stats engine; // engine specific counters, zero for engines that don't keep them
 };
 
 extern struct kmeans_metrics new_metrics();
 extern const char *p_to_s(struct point *p);
 extern double euclidean_distance(struct point *p1, struct point *p2);
 extern void usage();
-extern void print_points(FILE *out, struct point *dataset, int num_points);
+extern void print_points(FILE *out, struct point *dataset, size_t num_points);
 extern void print_headers(FILE *out, char **headers, int dimensions);
 extern void print_metrics_headers(FILE *out);
-extern void print_centroids(FILE *out, struct point *centroids, int num_points);
+extern void print_centroids(FILE *out, struct point *centroids, int num_clusters);
 
 extern void print_metrics(FILE *out, struct kmeans_metrics *metrics);
-int read_csv_file(char* csv_file_name, struct point *dataset, int max_points, char *headers[], int *dimensions);
-extern int read_csv(FILE* csv_file, struct point *dataset, int max_points, char *headers[], int *dimensions);
-extern void write_csv_file(char *csv_file_name, struct point *dataset, int num_points, char *headers[], int dimensions);
-extern void write_csv(FILE *csv_file, struct point *dataset, int num_points, char *headers[], int dimensions);
+#define BINARY_POINTS_MAGIC "KMPOINTS" // first 8 bytes of a binary points file, see read_csv_file
+extern bool binary_file_name(char *file_name);
+extern size_t read_csv_file(char* csv_file_name, struct point **dataset, size_t max_points, char *headers[], int *dimensions);
+extern size_t read_csv(FILE* csv_file, struct point **dataset, size_t max_points, char *headers[], int *dimensions);
+extern void write_csv_file(char *csv_file_name, struct point *dataset, size_t num_points, char *headers[], int dimensions);
+extern void write_csv(FILE *csv_file, struct point *dataset, size_t num_points, char *headers[], int dimensions);
 
 extern void write_metrics_file(char *metrics_file_name, struct kmeans_metrics *metrics) ;
 
 extern char* valid_file(char opt, char *filename);
 extern int valid_count(char opt, char *arg);
+extern size_t valid_size(char opt, char *arg);
 extern void validate_config(struct kmeans_config config);
 
-extern int test_results(struct kmeans_config *config, char* test_file_name, struct point *dataset, int num_points);
+extern int test_results(struct kmeans_config *config, struct point *testset, size_t num_test_points,
+                        struct point *dataset, size_t num_points, double *adjusted_rand);
+extern int compare_results(struct kmeans_config *config, struct point *testset, size_t num_test_points,
+                           struct point *dataset, size_t num_points);
 
 extern struct kmeans_config parse_cli(int argc, char *argv[]);
 
+// K-Means engine: assign_clusters and calculate_centroids come from one of the *_impl.c files,
+// run_lloyd from kmeans_lloyd.c unless the engine drives the whole loop itself (kmeans_omp3_impl.c)
+extern size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters);
+extern void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters);
+extern size_t run_lloyd(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                        int max_iterations, struct kmeans_metrics *metrics);
+// every engine also sizes its workspace buffers for a run before the first iteration
+extern void reserve_workspace(size_t num_points, int num_clusters);
+
+// scratch buffers shared by the engine functions, sized once per run, see kmeans_workspace.c
+enum workspace_slot {
+    WORKSPACE_PARTIALS,  // cluster sums: one set, or one per thread or per block of points
+    WORKSPACE_SUMS,      // kmeans_incremental: the running cluster sums, kept between iterations
+    WORKSPACE_CHANGES,   // kmeans_incremental: the points that changed cluster
+    WORKSPACE_INDEX,     // kmeans_grid: the grid over the centroids
+    WORKSPACE_SCHEDULER, // kmeans_tasks: per thread statistics of the work-stealing scheduler
+    WORKSPACE_POINTS,    // kmeans_bisect: copy of the points, kept partitioned by cluster
+    WORKSPACE_ROWS,      // kmeans_bisect: the dataset index of each point in the copy
+    WORKSPACE_SLOTS
+};
+extern void *workspace_buffer(enum workspace_slot slot, size_t bytes);
+extern long workspace_allocations();
+extern void workspace_free();
+extern long peak_rss_kb();
+
+// geographic points: project longitude and latitude to a plane in kilometres, see kmeans_geo.c
+struct geo_projection {
+    double lon0, lat0;     // centre of the projection, in degrees
+    double km_per_degree_x; // of longitude, at the latitude of the centre
+    double km_per_degree_y; // of latitude
+};
+extern struct geo_projection geo_projection_at(double lon0, double lat0);
+extern struct geo_projection geo_projection_around(struct point *dataset, size_t num_points);
+extern void geo_project(struct geo_projection *projection, struct point *points, size_t num_points);
+extern void geo_project_xy(struct geo_projection *projection, const double *lon, const double *lat,
+                           double *x, double *y, int count);
+extern void geo_unproject(struct geo_projection *projection, struct point *points, size_t num_points);
+
+// fitted models: save, load and predict, see kmeans_model.c
+extern void save_model(char *model_file_name, struct point *centroids, int num_clusters,
+                       struct geo_projection *projection);
+extern struct point *load_model(char *model_file_name, int *num_clusters);
+extern bool load_model_projection(char *model_file_name, struct geo_projection *projection);
+extern void predict_file(struct kmeans_config *config, struct kmeans_metrics *metrics);
+
+// synthetic datasets, see kmeans_generate.c
+extern void generate_file(struct kmeans_config *config, struct kmeans_metrics *metrics);
+extern void generate_points(struct kmeans_config *config, struct point *points, size_t num_points);
+extern void save_hierarchy(char *hierarchy_file_name, struct cluster_hierarchy *hierarchy);
+
+// locality: reorder the dataset along a space-filling curve, see kmeans_reorder.c
+extern size_t *hilbert_reorder(struct point *dataset, size_t num_points);
+extern void restore_order(struct point *dataset, size_t num_points, size_t *order);
+
+// weighted points: collapse duplicate (or grid snapped) points, see kmeans_aggregate.c
+extern struct point *aggregate_points(struct point *dataset, size_t num_points, double grid_cell,
+                                      size_t *num_aggregated, size_t **row_to_point);
+extern void expand_labels(struct point *dataset, size_t num_points, struct point *aggregated, size_t *row_to_point);
+
+// coresets: fit on a small weighted sample of the points, see kmeans_coreset.c
+extern struct point *build_coreset(struct point *dataset, size_t num_points, size_t coreset_size, size_t *num_coreset);
+
+// clustering quality, see kmeans_quality.c
+extern double inertia(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters);
+extern void cluster_quality(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                            struct kmeans_metrics *metrics);
+extern double adjusted_rand_index(struct point *reference, struct point *dataset, size_t num_points);
+
+// choosing k: fit a range of k from one load of the data, see kmeans_sweep.c
+extern void sweep_clusters(struct kmeans_config *config, struct point *dataset, size_t num_points,
+                           struct point *initial_centroids, struct kmeans_metrics *base);
+extern void split_centroid(struct point *centroid, double weight, double sxx, double sxy, double syy,
+                           struct point halves[2]);
+
+// checkpoint and resume of the default loop, see kmeans_checkpoint.c
+extern void checkpoint_start(struct kmeans_config *config, struct point *dataset, size_t num_points, int num_clusters);
+extern void checkpoint_state(void *data, size_t bytes);
+extern int checkpoint_resume(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                             size_t *cluster_changes, struct kmeans_metrics *metrics);
+extern void checkpoint_iteration(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                                 int iterations, size_t cluster_changes, struct kmeans_metrics *metrics);
+extern void checkpoint_finish();
+
+// live progress on SIGUSR1 or an interval, see kmeans_progress.c
+extern void progress_start(struct kmeans_config *config, size_t num_points);
+extern void progress_iteration(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                               int iterations, size_t cluster_changes, struct kmeans_metrics *metrics);
+extern void progress_finish(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters);
+
+// many inputs clustered side by side in one process, see kmeans_batch.c
+typedef int (*batch_job_function)(struct kmeans_config *config, struct kmeans_metrics *metrics, double start_seconds);
+extern int run_batch(struct kmeans_config *config, batch_job_function run_job);
+
+// runtime tuning of threads and schedule, see kmeans_autotune.c
+extern void autotune_start(struct kmeans_config *config, size_t num_points, int num_clusters);
+extern bool autotune_active();
+extern void autotune_iteration(double seconds, struct kmeans_metrics *metrics);
+extern void autotune_finish(struct kmeans_metrics *metrics);
+
+// work-stealing execution of a loop over points in blocks, see kmeans_tasks.c
+typedef void (*block_function)(size_t begin, size_t end, void *context);
+extern void parallel_blocks(size_t num_points, block_function function, void *context);
+extern void reserve_parallel_blocks();
+
 extern void debug_assignment(struct point *p, int closest_cluster, struct point *centroid, double min_distance);
 
 // help with debugging OMP
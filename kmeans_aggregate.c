@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Weighted points: GPS traces have many rows with exactly the same coordinates (a device that
+ * stands still keeps reporting the same fix), so the rows are collapsed into one point per
+ * distinct coordinate, weighted by the number of rows it stands for, and only those are
+ * clustered. With a grid cell size the coordinates are first snapped to the grid, which also
+ * merges near-identical points at the cost of moving each point by up to half a cell.
+ *
+ * The distinct points are found with an open addressing hash table filled by all threads at
+ * once with compare-and-swap. Each slot ends up holding the lowest row index with its
+ * coordinates, so the aggregated points are in the order of their first row whatever the
+ * number of threads - and the clustering is the same as without aggregation, apart from
+ * rounding in the sums and the grid snapping.
+ */
+
+#define EMPTY_SLOT SIZE_MAX
+
+/**
+ * Hash of the bits of both coordinates (the finalizer of splitmix64)
+ */
+static inline uint64_t hash_key(uint64_t x_bits, uint64_t y_bits)
+{
+    uint64_t h = x_bits ^ (y_bits * 0x9e3779b97f4a7c15ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static inline uint64_t bits(double value)
+{
+    uint64_t result;
+    memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+/**
+ * Find the slot of the row's coordinates, inserting the row if they are not in the table yet.
+ * If the coordinates are there already the slot is lowered to this row if it comes first.
+ */
+static void insert_row(size_t *table, uint64_t mask, const uint64_t *key_x, const uint64_t *key_y, size_t row)
+{
+    uint64_t slot = hash_key(key_x[row], key_y[row]) & mask;
+    for (;;) {
+        size_t current = __atomic_load_n(&table[slot], __ATOMIC_ACQUIRE);
+        if (current == EMPTY_SLOT) {
+            if (__atomic_compare_exchange_n(&table[slot], &current, row, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return;
+            }
+            // lost the race: current now holds the winner, which may have the same coordinates
+        }
+        if (key_x[current] == key_x[row] && key_y[current] == key_y[row]) {
+            // a row index in a slot is only ever replaced by a lower one with the same coordinates
+            while (row < current
+                   && !__atomic_compare_exchange_n(&table[slot], &current, row, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            }
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+/**
+ * The first row with the same coordinates as the given row: only valid once every row is inserted
+ */
+static size_t first_row(const size_t *table, uint64_t mask, const uint64_t *key_x, const uint64_t *key_y, size_t row)
+{
+    uint64_t slot = hash_key(key_x[row], key_y[row]) & mask;
+    while (key_x[table[slot]] != key_x[row] || key_y[table[slot]] != key_y[row]) {
+        slot = (slot + 1) & mask;
+    }
+    return table[slot];
+}
+
+/**
+ * Collapse the points of the dataset with the same coordinates into single weighted points.
+ *
+ * @param dataset array of all points as read from the file, not changed
+ * @param num_points size of the array
+ * @param grid_cell if > 0, the coordinates are snapped to a grid with cells of this size first
+ * @param num_aggregated set to the number of distinct points
+ * @param row_to_point set to an allocated array with the index of the aggregated point for
+ *                     each row of the dataset, to be passed to expand_labels
+ * @return allocated array of the distinct points in the order of their first row
+ */
+struct point *aggregate_points(struct point *dataset, size_t num_points, double grid_cell,
+                               size_t *num_aggregated, size_t **row_to_point)
+{
+    // the table is at most half full so the probe sequences stay short
+    uint64_t table_size = 1;
+    while (table_size < 2 * (uint64_t)num_points) {
+        table_size *= 2;
+    }
+    uint64_t mask = table_size - 1;
+    size_t *table = malloc(table_size * sizeof(size_t));
+    uint64_t *key_x = malloc(num_points * sizeof(uint64_t));
+    uint64_t *key_y = malloc(num_points * sizeof(uint64_t));
+    size_t *first = malloc(num_points * sizeof(size_t));
+    size_t *position = malloc(num_points * sizeof(size_t));
+    size_t *thread_counts = malloc((omp_get_max_threads() + 1) * sizeof(size_t));
+    struct point *aggregated = NULL;
+    size_t count = 0;
+
+#pragma omp parallel
+    {
+#pragma omp for schedule(static)
+        for (uint64_t slot = 0; slot < table_size; ++slot) {
+            table[slot] = EMPTY_SLOT;
+        }
+#pragma omp for schedule(static)
+        for (size_t n = 0; n < num_points; ++n) {
+            double x = dataset[n].x;
+            double y = dataset[n].y;
+            if (grid_cell > 0) {
+                x = round(x / grid_cell) * grid_cell;
+                y = round(y / grid_cell) * grid_cell;
+            }
+            // adding zero turns -0.0 into 0.0 so both have the same bits
+            key_x[n] = bits(x + 0.0);
+            key_y[n] = bits(y + 0.0);
+        }
+#pragma omp for schedule(static)
+        for (size_t n = 0; n < num_points; ++n) {
+            insert_row(table, mask, key_x, key_y, n);
+        }
+
+        // number the first rows in row order: each thread counts its own static share of the
+        // rows, then numbers them from the total of the threads before it
+        int thread = omp_get_thread_num();
+        int team = omp_get_num_threads();
+        size_t begin = num_points * thread / team;
+        size_t end = num_points * (thread + 1) / team;
+        size_t thread_count = 0;
+        for (size_t n = begin; n < end; ++n) {
+            first[n] = first_row(table, mask, key_x, key_y, n);
+            thread_count += first[n] == n;
+        }
+        thread_counts[thread + 1] = thread_count;
+#pragma omp barrier
+#pragma omp single
+        {
+            thread_counts[0] = 0;
+            for (int t = 0; t < team; ++t) {
+                thread_counts[t + 1] += thread_counts[t];
+            }
+            count = thread_counts[team];
+            aggregated = malloc((count > 0 ? count : 1) * sizeof(struct point));
+        }
+        size_t next = thread_counts[thread];
+        for (size_t n = begin; n < end; ++n) {
+            if (first[n] == n) {
+                position[n] = next;
+                struct point *p = &aggregated[next++];
+                memcpy(&p->x, &key_x[n], sizeof(double));
+                memcpy(&p->y, &key_y[n], sizeof(double));
+                p->cluster = -1;
+                p->weight = 0.0;
+            }
+        }
+#pragma omp barrier
+        // the weights are sums of whole numbers, which are exact in any order
+#pragma omp for schedule(static)
+        for (size_t n = 0; n < num_points; ++n) {
+            size_t to = position[first[n]];
+            first[n] = to;
+#pragma omp atomic
+            aggregated[to].weight += dataset[n].weight;
+        }
+    }
+
+    free(table);
+    free(key_x);
+    free(key_y);
+    free(position);
+    free(thread_counts);
+    *num_aggregated = count;
+    *row_to_point = first;
+    return aggregated;
+}
+
+/**
+ * Give every row of the dataset the cluster of the aggregated point it was collapsed into.
+ *
+ * @param dataset array of all points as read from the file
+ * @param num_points size of the array
+ * @param aggregated clustered points returned by aggregate_points
+ * @param row_to_point row to point map returned by aggregate_points
+ */
+void expand_labels(struct point *dataset, size_t num_points, struct point *aggregated, size_t *row_to_point)
+{
+#pragma omp parallel for schedule(static)
+    for (size_t n = 0; n < num_points; ++n) {
+        dataset[n].cluster = aggregated[row_to_point[n]].cluster;
+    }
+}
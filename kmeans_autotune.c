@@ -0,0 +1,250 @@
+// for gethostname, which -std=c99 hides
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Runtime tuning of the OpenMP settings: instead of sweeping OMP_NUM_THREADS and OMP_SCHEDULE
+ * with scripts/multirun.sh, the first iterations of the run are each done with a different
+ * candidate number of threads and schedule (kind and chunk size), after which the fastest
+ * candidate is kept for the rest of the run.
+ *
+ * The two are tuned one after the other rather than every combination: first the number of
+ * threads (the max and every halving of it) with a static schedule, then a few schedules with
+ * the fastest number of threads. That keeps the tuning to a handful of iterations.
+ *
+ * The iterations run by the default loop in kmeans_lloyd.c are timed, so engines that run
+ * their own loop (kmeans_omp3) cannot be tuned, but they do use settings from the tuning file.
+ *
+ * With a tuning file the winner is appended to it as a line of
+ *     engine num_points num_clusters host threads schedule_kind chunk_size seconds_per_iteration
+ * and later runs with the same engine, dataset size, clusters and host use the last matching
+ * line straight away instead of tuning again.
+ */
+
+#define MAX_CANDIDATES 64
+// iterations timed per candidate: the fastest of them counts, so one slow outlier doesn't matter
+#define ITERATIONS_PER_CANDIDATE 2
+
+struct candidate {
+    int threads;
+    omp_sched_t kind;
+    int chunk_size;
+    double seconds; // fastest iteration with these settings
+};
+
+static struct {
+    bool active;
+    struct candidate candidates[MAX_CANDIDATES];
+    int num_candidates;
+    int current;
+    int iterations; // iterations timed so far, over all candidates
+    bool schedules_added; // the schedule candidates follow the thread candidates
+    char *tuning_file;
+    char *engine;
+    size_t num_points;
+    int num_clusters;
+    char host[256];
+} tuner;
+
+static const char *kind_name(omp_sched_t kind)
+{
+    switch (kind & ~omp_sched_monotonic) {
+        case omp_sched_static:
+            return "static";
+        case omp_sched_dynamic:
+            return "dynamic";
+        case omp_sched_guided:
+            return "guided";
+        default:
+            return "auto";
+    }
+}
+
+static void apply(struct candidate *candidate)
+{
+    omp_set_num_threads(candidate->threads);
+    omp_set_schedule(candidate->kind, candidate->chunk_size);
+}
+
+static void add_candidate(int threads, omp_sched_t kind, int chunk_size)
+{
+    if (tuner.num_candidates < MAX_CANDIDATES) {
+        struct candidate *candidate = &tuner.candidates[tuner.num_candidates++];
+        candidate->threads = threads;
+        candidate->kind = kind;
+        candidate->chunk_size = chunk_size;
+        candidate->seconds = -1;
+    }
+}
+
+/**
+ * Find the settings of an earlier run with the same engine, size and host in the tuning file
+ */
+static bool read_tuning_file(struct candidate *found)
+{
+    FILE *file = fopen(tuner.tuning_file, "r");
+    if (!file) {
+        return false; // no tuning done yet
+    }
+    char engine[256], host[256];
+    size_t num_points;
+    int num_clusters, kind;
+    struct candidate line;
+    bool matched = false;
+    while (fscanf(file, "%255s %zu %d %255s %d %d %d %lf", engine, &num_points, &num_clusters, host,
+                  &line.threads, &kind, &line.chunk_size, &line.seconds) == 8) {
+        if (strcmp(engine, tuner.engine) == 0 && num_points == tuner.num_points
+            && num_clusters == tuner.num_clusters && strcmp(host, tuner.host) == 0) {
+            line.kind = (omp_sched_t)kind;
+            *found = line; // keep going: the last line for the same run wins
+            matched = true;
+        }
+    }
+    fclose(file);
+    return matched;
+}
+
+static void write_tuning_file(struct candidate *best)
+{
+    FILE *file = fopen(tuner.tuning_file, "a");
+    if (!file) {
+        fprintf(stderr, "Warning: cannot write to the tuning file at %s\n", tuner.tuning_file);
+        return;
+    }
+    fprintf(file, "%s %zu %d %s %d %d %d %f\n", tuner.engine, tuner.num_points, tuner.num_clusters, tuner.host,
+            best->threads, (int)best->kind, best->chunk_size, best->seconds);
+    fclose(file);
+}
+
+/**
+ * Start tuning the OpenMP settings for a run, or apply the settings found by an earlier run
+ * in the tuning file. Must be called before the run, outside any parallel region.
+ *
+ * @param config run configuration: tuning_file is used if set, engine names the engine
+ * @param num_points number of points of the run, part of the key in the tuning file
+ * @param num_clusters number of clusters of the run, part of the key in the tuning file
+ */
+void autotune_start(struct kmeans_config *config, size_t num_points, int num_clusters)
+{
+    memset(&tuner, 0, sizeof(tuner));
+    tuner.tuning_file = config->tuning_file;
+    tuner.engine = config->engine;
+    tuner.num_points = num_points;
+    tuner.num_clusters = num_clusters;
+    if (gethostname(tuner.host, sizeof(tuner.host)) != 0 || tuner.host[0] == '\0') {
+        strcpy(tuner.host, "unknown");
+    }
+    tuner.host[sizeof(tuner.host) - 1] = '\0';
+
+    struct candidate cached;
+    if (tuner.tuning_file && read_tuning_file(&cached)) {
+        apply(&cached);
+        if (!config->quiet) {
+            printf("Autotune: using %d threads with schedule %s,%d from %s\n",
+                   cached.threads, kind_name(cached.kind), cached.chunk_size, tuner.tuning_file);
+        }
+        return;
+    }
+
+    // the max threads and every halving of it: the schedules are added once the threads are tuned
+    for (int threads = omp_get_max_threads(); threads >= 1; threads /= 2) {
+        add_candidate(threads, omp_sched_static, 0);
+    }
+    tuner.active = true;
+    apply(&tuner.candidates[0]);
+}
+
+static struct candidate *fastest_candidate()
+{
+    struct candidate *best = NULL;
+    for (int c = 0; c < tuner.num_candidates; ++c) {
+        if (tuner.candidates[c].seconds >= 0 && (!best || tuner.candidates[c].seconds < best->seconds)) {
+            best = &tuner.candidates[c];
+        }
+    }
+    return best;
+}
+
+/**
+ * Add the schedules to try with the fastest number of threads, the static schedule of the
+ * thread candidates aside
+ */
+static void add_schedule_candidates()
+{
+    int threads = fastest_candidate()->threads;
+    add_candidate(threads, omp_sched_static, 1024);
+    add_candidate(threads, omp_sched_dynamic, 256);
+    add_candidate(threads, omp_sched_dynamic, 4096);
+    add_candidate(threads, omp_sched_guided, 0);
+    tuner.schedules_added = true;
+}
+
+/**
+ * True while iterations are still being used to try out candidate settings
+ */
+bool autotune_active()
+{
+    return tuner.active;
+}
+
+/**
+ * Record the time of an iteration run with the current candidate settings and move on to the
+ * next candidate, or to the fastest one once they have all been tried. After the last thread
+ * candidate the schedule candidates are added for the fastest number of threads.
+ *
+ * @param seconds time taken by the iteration
+ * @param metrics the number of tuning iterations is counted here
+ */
+void autotune_iteration(double seconds, struct kmeans_metrics *metrics)
+{
+    if (!tuner.active) {
+        return;
+    }
+    struct candidate *current = &tuner.candidates[tuner.current];
+    if (current->seconds < 0 || seconds < current->seconds) {
+        current->seconds = seconds;
+    }
+    tuner.iterations++;
+    metrics->tuning_iterations = tuner.iterations;
+    if (tuner.iterations % ITERATIONS_PER_CANDIDATE != 0) {
+        return;
+    }
+    if (tuner.current + 1 == tuner.num_candidates && !tuner.schedules_added) {
+        add_schedule_candidates();
+    }
+    if (++tuner.current < tuner.num_candidates) {
+        apply(&tuner.candidates[tuner.current]);
+        return;
+    }
+    autotune_finish(metrics);
+}
+
+/**
+ * Lock in the fastest candidate tried, and save it to the tuning file if all were tried.
+ * Called by autotune_iteration after the last candidate, and after the run in case it
+ * converged before all the candidates were tried.
+ *
+ * @param metrics the chosen threads and schedule are set here
+ */
+void autotune_finish(struct kmeans_metrics *metrics)
+{
+    if (!tuner.active) {
+        return;
+    }
+    tuner.active = false;
+    struct candidate *best = fastest_candidate();
+    if (!best) {
+        return; // nothing was timed: keep the settings of the environment
+    }
+    apply(best);
+    metrics->omp_max_threads = omp_get_max_threads();
+    metrics->omp_schedule_kind = omp_schedule_kind(&metrics->omp_chunk_size);
+    if (tuner.current >= tuner.num_candidates && tuner.tuning_file) {
+        write_tuning_file(best);
+    }
+}
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+#include "csvhelper.h"
+#include "kmeans.h"
+
+/**
+ * Batch mode (--batch MANIFEST): cluster many inputs in one process. For thousands of small
+ * per-region files the cost of a process per file - starting it, parsing the command line,
+ * creating the OpenMP threads - is more than the clustering, and a few hundred points can't
+ * keep more than one core busy anyway.
+ *
+ * The manifest is a csv file with a job per line: input,output,k,test. Only the input is
+ * required: an empty output or test is not written or tested, and an empty k takes the -k of
+ * the batch. Lines starting with # and a header line starting with "input" are skipped. All
+ * other options (engine, -i, -n, --geo, --dedup, --warm-start, ...) apply to every job.
+ *
+ * Jobs run in one thread pool, by the size of their input:
+ *   - big ones (BATCH_SMALL_BYTES or more) first, one after the other, each with all threads
+ *   - then the small ones, a job per thread, largest first so the tail of the batch is short
+ * Each job gets the usual metrics row, labelled with its input, in the one -m metrics file.
+ *
+ * A thread running a job keeps all the state of its run to itself (the workspace, the engine
+ * counters, the csv reader...: everything is threadprivate), so jobs don't see each other.
+ */
+
+// inputs smaller than this are too small to share between threads: about 40,000 csv points
+#define BATCH_SMALL_BYTES (1 << 20)
+
+struct batch_job {
+    char *in_file;
+    char *out_file;  // NULL to not write one
+    int num_clusters;
+    char *test_file; // NULL to not test
+    long bytes;      // size of the input
+    int line;        // in the manifest, for messages
+};
+
+static char *copy_field(int n)
+{
+    char *field = csvfield(n);
+    if (!field || field[0] == '\0') {
+        return NULL;
+    }
+    char *copy = malloc(strlen(field) + 1);
+    strcpy(copy, field);
+    return copy;
+}
+
+static long file_bytes(char *file_name)
+{
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long bytes = ftell(file);
+    fclose(file);
+    return bytes;
+}
+
+/**
+ * Read the jobs of a manifest, checking that every input and test file is there before
+ * any job starts
+ *
+ * @param config batch configuration, for the default k
+ * @param num_jobs set to the number of jobs
+ * @return the jobs, allocated here
+ */
+static struct batch_job *read_manifest(struct kmeans_config *config, size_t *num_jobs)
+{
+    FILE *manifest = fopen(config->batch_file, "r");
+    if (!manifest) {
+        fprintf(stderr, "Error: cannot read the batch manifest at %s\n", config->batch_file);
+        exit(1);
+    }
+    size_t capacity = 64;
+    struct batch_job *jobs = malloc(capacity * sizeof(struct batch_job));
+    size_t count = 0;
+    int errors = 0;
+    int line = 0;
+    while (csvgetline(manifest) != NULL) {
+        line++;
+        char *first = csvfield(0);
+        if (!first || first[0] == '\0' || first[0] == '#' || (line == 1 && strcmp(first, "input") == 0)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            jobs = realloc(jobs, capacity * sizeof(struct batch_job));
+        }
+        struct batch_job *job = &jobs[count++];
+        job->line = line;
+        job->in_file = copy_field(0);
+        job->out_file = copy_field(1);
+        job->test_file = copy_field(3);
+        job->num_clusters = config->num_clusters;
+        char *k = csvfield(2);
+        if (k && k[0] != '\0') {
+            job->num_clusters = atoi(k);
+            if (job->num_clusters <= 0) {
+                fprintf(stderr, "Error: line %d of %s: k must be a counting number (got %s)\n",
+                        line, config->batch_file, k);
+                errors++;
+            }
+        }
+        job->bytes = file_bytes(job->in_file);
+        if (job->bytes < 0) {
+            fprintf(stderr, "Error: line %d of %s: cannot read the input file %s\n",
+                    line, config->batch_file, job->in_file);
+            errors++;
+        }
+        if (job->test_file && access(job->test_file, F_OK) == -1) {
+            fprintf(stderr, "Error: line %d of %s: cannot find the test file %s\n",
+                    line, config->batch_file, job->test_file);
+            errors++;
+        }
+    }
+    fclose(manifest);
+    if (errors > 0) {
+        exit(1);
+    }
+    if (count == 0) {
+        fprintf(stderr, "Error: no jobs in the batch manifest %s\n", config->batch_file);
+        exit(1);
+    }
+    *num_jobs = count;
+    return jobs;
+}
+
+static int by_size_descending(const void *a, const void *b)
+{
+    long bytes_a = ((const struct batch_job *)a)->bytes;
+    long bytes_b = ((const struct batch_job *)b)->bytes;
+    return (bytes_a < bytes_b) - (bytes_a > bytes_b);
+}
+
+/**
+ * Run a job with the options of the batch, and print a line about it
+ *
+ * @return 1 if its test failed, 0 otherwise
+ */
+static int run_one(struct kmeans_config *batch, struct batch_job *job, batch_job_function run_job)
+{
+    struct kmeans_config config = *batch;
+    config.batch_file = NULL;
+    config.batch_job = true;
+    config.in_file = job->in_file;
+    config.out_file = job->out_file;
+    config.test_file = job->test_file;
+    config.num_clusters = job->num_clusters;
+    config.label = job->in_file;
+    config.silent = true;
+    config.quiet = true;
+
+    struct kmeans_metrics metrics;
+    run_job(&config, &metrics, omp_get_wtime());
+    if (!batch->quiet) {
+        const char *test = metrics.test_result == 1 ? "passed" : metrics.test_result == -1 ? "FAILED!" : "untested";
+#pragma omp critical(batch_output)
+        printf("%-40s k %3d, %zu points, %d iterations, %d threads, clustering %f, end to end %f seconds, %s\n",
+               job->in_file, config.num_clusters, metrics.num_points, metrics.used_iterations,
+               metrics.omp_max_threads, metrics.total_seconds, metrics.wall_seconds, test);
+    }
+    return metrics.test_result == -1 ? 1 : 0;
+}
+
+/**
+ * Run every job of the batch manifest in the config, big inputs with all the threads and
+ * small ones concurrently, a thread each.
+ *
+ * @param config batch configuration: the manifest and the options for every job
+ * @param run_job runs a single job, as main does for a single input
+ * @return the exit status
+ */
+int run_batch(struct kmeans_config *config, batch_job_function run_job)
+{
+    double start_batch = omp_get_wtime();
+    size_t num_jobs;
+    struct batch_job *jobs = read_manifest(config, &num_jobs);
+    qsort(jobs, num_jobs, sizeof(struct batch_job), by_size_descending);
+    size_t num_big = 0;
+    while (num_big < num_jobs && jobs[num_big].bytes >= BATCH_SMALL_BYTES) {
+        num_big++;
+    }
+    int threads = omp_get_max_threads();
+    if (!config->quiet) {
+        printf("Batch of %zu jobs: %zu with all %d threads, %zu side by side\n",
+               num_jobs, num_big, threads, num_jobs - num_big);
+    }
+
+    int failed = 0;
+    for (size_t j = 0; j < num_big; ++j) {
+        failed += run_one(config, &jobs[j], run_job);
+    }
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:failed)
+    for (size_t j = num_big; j < num_jobs; ++j) {
+        // the parallel regions of the job get a team of one: this thread
+        omp_set_num_threads(1);
+        failed += run_one(config, &jobs[j], run_job);
+    }
+
+    if (!config->silent) {
+        printf("Ran %zu jobs in %f seconds, %d failed their tests\n", num_jobs, omp_get_wtime() - start_batch, failed);
+    }
+    for (size_t j = 0; j < num_jobs; ++j) {
+        free(jobs[j].in_file);
+        free(jobs[j].out_file);
+        free(jobs[j].test_file);
+    }
+    free(jobs);
+    return 0;
+}
@@ -0,0 +1,421 @@
+#include <float.h>
+#include <math.h>
+#include "kmeans.h"
+
+/**
+ * Bisecting (divisive hierarchical) k-means, for large k:
+ * - starts with all the points in one cluster and splits clusters in two, the ones with the
+ *   largest sum of squared distances from their centroid (SSE) first, until there are k
+ *   (in rounds of all the clusters close to the largest SSE, see SPLIT_FRACTION)
+ * - each split is a 2-means on the points of that cluster only, started from the centroid
+ *   moved both ways along the main axis of the cluster (split_centroid), so there is no
+ *   dependence on the initial centroids, which are not used
+ * - the points are copied once into the workspace and kept partitioned by cluster: every
+ *   cluster is a contiguous slice, and a split only reads and partitions its own slice
+ * - the splits of a round are independent: while there are fewer of them than threads each one
+ *   runs its loops over the points in parallel, after that each split is a task of its own
+ * - the tree of splits is kept in cluster_hierarchy, to be saved with --hierarchy
+ *
+ * There is no Lloyd refinement over all clusters at the end, so a point stays in the cluster it
+ * was split into even if the centroid of another cluster has ended up closer: the result does
+ * not match the flat engines, and is not compared with the KNIME test files.
+ */
+
+// a round splits every leaf with at least this fraction of the largest SSE, so the splits of
+// the round can run side by side. This is an approximation of splitting one leaf at a time by
+// largest SSE, not the same thing: a half can keep more than half the SSE of its parent (a
+// large cluster with a small outlying group), and then the greedy order would split that half
+// before some of the smaller leaves batched with its parent. The final k leaves, and so the
+// clusters, can differ from the greedy ones, usually only in which of two similar leaves is split.
+#define SPLIT_FRACTION 0.5
+
+/**
+ * A cluster of the current partition: a contiguous slice of the working copy of the points
+ */
+struct leaf {
+    size_t begin, end; // points[begin .. end - 1]
+    struct point centroid;
+    double weight;
+    double sxx, sxy, syy; // weighted sums of dx * dx, dx * dy and dy * dy from the centroid
+    int node;             // its node in cluster_hierarchy
+};
+
+struct split {
+    int leaf;
+    int iterations; // 2-means iterations used, 0 if the leaf cannot be split
+    struct leaf halves[2];
+};
+
+static inline double leaf_sse(struct leaf *leaf)
+{
+    return leaf->sxx + leaf->syy;
+}
+
+static size_t scratch_bytes(int num_clusters)
+{
+    return num_clusters * (sizeof(struct leaf) + sizeof(struct split));
+}
+
+/**
+ * Weighted sums of the squares and products of the distances of the points of each half from
+ * its centroid, with the points labelled 0 or 1 for their half in their cluster field
+ */
+static void half_moments(struct point *points, struct leaf halves[2], size_t begin, size_t end, bool parallel)
+{
+    double sxx0 = 0, sxy0 = 0, syy0 = 0, sxx1 = 0, sxy1 = 0, syy1 = 0;
+    double x0 = halves[0].centroid.x, y0 = halves[0].centroid.y;
+    double x1 = halves[1].centroid.x, y1 = halves[1].centroid.y;
+#pragma omp parallel for if(parallel) schedule(static) reduction(+:sxx0, sxy0, syy0, sxx1, sxy1, syy1)
+    for (size_t n = begin; n < end; ++n) {
+        struct point *p = &points[n];
+        if (p->cluster == 0) {
+            double dx = p->x - x0, dy = p->y - y0;
+            sxx0 += p->weight * dx * dx;
+            sxy0 += p->weight * dx * dy;
+            syy0 += p->weight * dy * dy;
+        }
+        else {
+            double dx = p->x - x1, dy = p->y - y1;
+            sxx1 += p->weight * dx * dx;
+            sxy1 += p->weight * dx * dy;
+            syy1 += p->weight * dy * dy;
+        }
+    }
+    halves[0].sxx = sxx0;
+    halves[0].sxy = sxy0;
+    halves[0].syy = syy0;
+    halves[1].sxx = sxx1;
+    halves[1].sxy = sxy1;
+    halves[1].syy = syy1;
+}
+
+/**
+ * Split a leaf in two with 2-means on its own points, then partition its slice so the points
+ * of the first half come before those of the second.
+ *
+ * @param points working copy of the points
+ * @param rows dataset index of each point in the working copy, moved along with the points
+ * @param leaf the cluster to split
+ * @param halves set to the two new clusters
+ * @param max_iterations most 2-means iterations to run
+ * @param parallel run the loops over the points with the whole team, or on this thread only
+ * @return the number of iterations used, 0 if the points of the leaf cannot be split
+ */
+static int bisect(struct point *points, size_t *rows, struct leaf *leaf, struct leaf halves[2],
+                  int max_iterations, bool parallel)
+{
+    size_t begin = leaf->begin, end = leaf->end;
+    struct point centres[2];
+    split_centroid(&leaf->centroid, leaf->weight, leaf->sxx, leaf->sxy, leaf->syy, centres);
+    double x0 = centres[0].x, y0 = centres[0].y;
+    double x1 = centres[1].x, y1 = centres[1].y;
+    double w0 = 0, w1 = 0;
+
+    int iterations = 0;
+    size_t changes;
+    do {
+        // the labels left by the split of the parent mean nothing here: count every point once
+        bool first = iterations == 0;
+        double sum_x0 = 0, sum_y0 = 0, sum_x1 = 0, sum_y1 = 0;
+        changes = 0;
+        w0 = 0;
+        w1 = 0;
+#pragma omp parallel for if(parallel) schedule(static) \
+        reduction(+:changes, w0, sum_x0, sum_y0, w1, sum_x1, sum_y1)
+        for (size_t n = begin; n < end; ++n) {
+            struct point *p = &points[n];
+            double d0 = (p->x - x0) * (p->x - x0) + (p->y - y0) * (p->y - y0);
+            double d1 = (p->x - x1) * (p->x - x1) + (p->y - y1) * (p->y - y1);
+            int half = d1 < d0;
+            if (p->cluster != half || first) {
+                p->cluster = half;
+                changes++;
+            }
+            if (half == 0) {
+                w0 += p->weight;
+                sum_x0 += p->weight * p->x;
+                sum_y0 += p->weight * p->y;
+            }
+            else {
+                w1 += p->weight;
+                sum_x1 += p->weight * p->x;
+                sum_y1 += p->weight * p->y;
+            }
+        }
+        iterations++;
+        if (w0 > 0) {
+            x0 = sum_x0 / w0;
+            y0 = sum_y0 / w0;
+        }
+        if (w1 > 0) {
+            x1 = sum_x1 / w1;
+            y1 = sum_y1 / w1;
+        }
+    } while (changes > 0 && iterations < max_iterations);
+    if (w0 <= 0 || w1 <= 0) {
+        return 0; // every point went the same way
+    }
+
+    // the first half to the front of the slice, the second to the back
+    size_t front = begin, back = end;
+    while (front < back) {
+        if (points[front].cluster == 0) {
+            front++;
+        }
+        else {
+            back--;
+            struct point swap_point = points[front];
+            points[front] = points[back];
+            points[back] = swap_point;
+            size_t swap_row = rows[front];
+            rows[front] = rows[back];
+            rows[back] = swap_row;
+        }
+    }
+
+    halves[0] = (struct leaf) { begin, front, centres[0], w0, 0, 0, 0, -1 };
+    halves[0].centroid.x = x0;
+    halves[0].centroid.y = y0;
+    halves[1] = (struct leaf) { front, end, centres[1], w1, 0, 0, 0, -1 };
+    halves[1].centroid.x = x1;
+    halves[1].centroid.y = y1;
+    half_moments(points, halves, begin, end, parallel);
+    return iterations;
+}
+
+/**
+ * Add a node for a leaf to the hierarchy
+ */
+static int add_node(struct leaf *leaf, int parent, int created)
+{
+    int node = cluster_hierarchy.num_nodes++;
+    cluster_hierarchy.nodes[node] = (struct hierarchy_node) {
+        parent, created, 0, -1, leaf->weight, leaf_sse(leaf), leaf->centroid
+    };
+    return node;
+}
+
+/**
+ * Assigns each point in the dataset to a cluster based on the distance from that cluster.
+ *
+ * Standalone version for callers outside the main loop: run_lloyd does not use it.
+ *
+ * @param dataset set of all points with current cluster assignments
+ * @param num_points number of points in the dataset
+ * @param centroids array that holds the current centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @return the number of points for which the cluster assignment was changed
+ */
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    size_t cluster_changes = 0;
+#pragma omp parallel for schedule(runtime) reduction(+:cluster_changes)
+    for (size_t n = 0; n < num_points; ++n) {
+        double min_distance = DBL_MAX;
+        int closest_cluster = -1;
+        for (int k = 0; k < num_clusters; ++k) {
+            double distance_from_centroid = euclidean_distance(&dataset[n], &centroids[k]);
+            if (distance_from_centroid < min_distance) {
+                min_distance = distance_from_centroid;
+                closest_cluster = k;
+            }
+        }
+        if (dataset[n].cluster != closest_cluster) {
+            dataset[n].cluster = closest_cluster;
+            cluster_changes++;
+        }
+    }
+    return cluster_changes;
+}
+
+/**
+ * Calculates new centroids for the clusters of the given dataset by finding the
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
+ *
+ * Standalone version for callers outside the main loop: run_lloyd does not use it.
+ *
+ * @param dataset set of all points with current cluster assigments
+ * @param num_points number of points in the dataset
+ * @param centroids array to hold the centroids - already allocated
+ * @param num_clusters number of clusters - hence size of the centroids array
+ */
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    double *sums = workspace_buffer(WORKSPACE_SUMS, 3 * num_clusters * sizeof(double));
+    for (int i = 0; i < 3 * num_clusters; ++i) {
+        sums[i] = 0.0;
+    }
+#pragma omp parallel for schedule(runtime) reduction(+:sums[:3 * num_clusters])
+    for (size_t n = 0; n < num_points; ++n) {
+        int k = dataset[n].cluster;
+        sums[k] += dataset[n].weight * dataset[n].x;
+        sums[num_clusters + k] += dataset[n].weight * dataset[n].y;
+        sums[2 * num_clusters + k] += dataset[n].weight;
+    }
+    for (int k = 0; k < num_clusters; ++k) {
+        centroids[k].x = sums[k] / sums[2 * num_clusters + k];
+        centroids[k].y = sums[num_clusters + k] / sums[2 * num_clusters + k];
+    }
+}
+
+/**
+ * Splits the dataset into num_clusters clusters by bisection, in rounds of independent splits.
+ *
+ * The initial centroids are not used. If the points cannot be split into that many clusters
+ * (fewer distinct points than clusters) the remaining centroids keep their initial values,
+ * with no points.
+ *
+ * @param dataset set of all points, cluster assignments are updated in place
+ * @param num_points number of points in the dataset
+ * @param centroids overwritten with the centroids of the clusters
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @param max_iterations most 2-means iterations for each split
+ * @param metrics time in the splits is counted as assignment, the rest of each round as centroids;
+ *                the used iterations are the 2-means iterations of all splits
+ * @return 0: the clusters are final
+ */
+size_t run_lloyd(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                 int max_iterations, struct kmeans_metrics *metrics)
+{
+    double start_root = omp_get_wtime();
+    struct point *points = workspace_buffer(WORKSPACE_POINTS, num_points * sizeof(struct point));
+    size_t *rows = workspace_buffer(WORKSPACE_ROWS, num_points * sizeof(size_t));
+    struct leaf *leaves = workspace_buffer(WORKSPACE_PARTIALS, scratch_bytes(num_clusters));
+    struct split *splits = (struct split *)&leaves[num_clusters];
+    free(cluster_hierarchy.nodes);
+    cluster_hierarchy.nodes = malloc((2 * num_clusters - 1) * sizeof(struct hierarchy_node));
+    cluster_hierarchy.num_nodes = 0;
+
+    // the root holds all the points
+    double weight = 0, sum_x = 0, sum_y = 0;
+#pragma omp parallel for schedule(static) reduction(+:weight, sum_x, sum_y)
+    for (size_t n = 0; n < num_points; ++n) {
+        points[n] = dataset[n];
+        rows[n] = n;
+        weight += points[n].weight;
+        sum_x += points[n].weight * points[n].x;
+        sum_y += points[n].weight * points[n].y;
+    }
+    struct leaf *root = &leaves[0];
+    *root = (struct leaf) { 0, num_points, dataset[0], weight, 0, 0, 0, -1 };
+    root->centroid.x = sum_x / weight;
+    root->centroid.y = sum_y / weight;
+    double sxx = 0, sxy = 0, syy = 0;
+#pragma omp parallel for schedule(static) reduction(+:sxx, sxy, syy)
+    for (size_t n = 0; n < num_points; ++n) {
+        double dx = points[n].x - root->centroid.x, dy = points[n].y - root->centroid.y;
+        sxx += points[n].weight * dx * dx;
+        sxy += points[n].weight * dx * dy;
+        syy += points[n].weight * dy * dy;
+    }
+    root->sxx = sxx;
+    root->sxy = sxy;
+    root->syy = syy;
+    root->node = add_node(root, -1, 0);
+    int num_leaves = 1;
+    int num_splits = 0;
+    int iterations = 0;
+    metrics->centroids_seconds += omp_get_wtime() - start_root;
+
+    while (num_leaves < num_clusters) {
+        double start_round = omp_get_wtime();
+        double max_sse = 0;
+        for (int l = 0; l < num_leaves; ++l) {
+            if (leaf_sse(&leaves[l]) > max_sse) {
+                max_sse = leaf_sse(&leaves[l]);
+            }
+        }
+        if (max_sse <= 0) {
+            break; // every point is on its centroid: nothing left to split
+        }
+        // the leaves to split this round, largest SSE first
+        int round_splits = 0;
+        for (int l = 0; l < num_leaves; ++l) {
+            double sse = leaf_sse(&leaves[l]);
+            if (sse > 0 && sse >= SPLIT_FRACTION * max_sse) {
+                int s = round_splits++;
+                while (s > 0 && leaf_sse(&leaves[splits[s - 1].leaf]) < sse) {
+                    splits[s].leaf = splits[s - 1].leaf;
+                    s--;
+                }
+                splits[s].leaf = l;
+            }
+        }
+        if (round_splits > num_clusters - num_leaves) {
+            round_splits = num_clusters - num_leaves;
+        }
+
+        if (round_splits < omp_get_max_threads()) {
+            for (int s = 0; s < round_splits; ++s) {
+                splits[s].iterations = bisect(points, rows, &leaves[splits[s].leaf], splits[s].halves,
+                                              max_iterations, true);
+            }
+        }
+        else {
+#pragma omp parallel
+#pragma omp single
+            for (int s = 0; s < round_splits; ++s) {
+#pragma omp task firstprivate(s)
+                splits[s].iterations = bisect(points, rows, &leaves[splits[s].leaf], splits[s].halves,
+                                              max_iterations, false);
+            }
+        }
+        double end_splits = omp_get_wtime();
+        metrics->assignment_seconds += end_splits - start_round;
+
+        // the first half takes the place of the leaf that was split, the second is a new leaf
+        for (int s = 0; s < round_splits; ++s) {
+            struct split *split = &splits[s];
+            struct leaf *leaf = &leaves[split->leaf];
+            if (split->iterations == 0) {
+                leaf->sxx = leaf->syy = 0; // its points are all the same: never try again
+                continue;
+            }
+            iterations += split->iterations;
+            num_splits++;
+            int parent = leaf->node;
+            cluster_hierarchy.nodes[parent].split = num_splits;
+            split->halves[0].node = add_node(&split->halves[0], parent, num_splits);
+            split->halves[1].node = add_node(&split->halves[1], parent, num_splits);
+            *leaf = split->halves[0];
+            leaves[num_leaves++] = split->halves[1];
+        }
+        double end_round = omp_get_wtime();
+        metrics->centroids_seconds += end_round - end_splits;
+#ifndef SKIP_MAX_ITERATION_CALC
+        if (end_round - start_round > metrics->max_iteration_seconds) {
+            metrics->max_iteration_seconds = end_round - start_round;
+        }
+#endif
+    }
+
+    // label the points in dataset order with the leaf of their slice
+    double start_labels = omp_get_wtime();
+    struct hierarchy_node *nodes = cluster_hierarchy.nodes; // the hierarchy is threadprivate
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int l = 0; l < num_leaves; ++l) {
+        for (size_t n = leaves[l].begin; n < leaves[l].end; ++n) {
+            dataset[rows[n]].cluster = l;
+        }
+        centroids[l] = leaves[l].centroid;
+        nodes[leaves[l].node].cluster = l;
+    }
+    metrics->centroids_seconds += omp_get_wtime() - start_labels;
+    metrics->used_iterations = iterations;
+    return 0;
+}
+
+/**
+ * Sizes the workspace for a run: the working copy of the points with their rows, and the
+ * leaves and splits of the rounds.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    workspace_buffer(WORKSPACE_POINTS, num_points * sizeof(struct point));
+    workspace_buffer(WORKSPACE_ROWS, num_points * sizeof(size_t));
+    workspace_buffer(WORKSPACE_PARTIALS, scratch_bytes(num_clusters));
+}
@@ -0,0 +1,420 @@
+// for fileno and fsync, which -std=c99 hides
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Checkpoints of long runs: with --checkpoint FILE the default loop in kmeans_lloyd.c hands a
+ * snapshot of the run to a writer thread every --checkpoint-every iterations (or seconds), and
+ * with --resume a run that was stopped (e.g. a preempted job on a node from reserve_node.sh)
+ * continues from the last snapshot in the file instead of from the first iteration.
+ *
+ * A snapshot holds the centroids, the cluster of every point, the iterations done, the
+ * changes of the last of them, the timings and engine_stats so far, and whatever state the
+ * engine carries from one iteration to the next and registered with checkpoint_state (the
+ * running sums of kmeans_incremental). That is everything the next iteration depends on, so a
+ * resumed run does the same iterations as one that was never stopped, bit for bit, as long as
+ * it runs the same engine with the same threads and schedule on the same points.
+ *
+ * The loop only copies the snapshot, in parallel, into a buffer allocated up front: the file is
+ * written by the writer thread while the loop goes on. If the last snapshot is still being
+ * written when the next one is due, the loop tries again after the next iteration rather than
+ * wait. Each snapshot goes to FILE.tmp first and is renamed over FILE once complete, so a run
+ * stopped while writing still leaves the previous checkpoint intact.
+ *
+ * Engines that run their own loop (kmeans_omp3, kmeans_bisect) take no checkpoints.
+ */
+
+#define CHECKPOINT_MAGIC "KMCHECK1"
+#define CHECKPOINT_ENGINE_NAME 32
+// pieces of engine state registered with checkpoint_state
+#define MAX_STATE_REGIONS 8
+
+struct checkpoint_header {
+    char magic[8];
+    char engine[CHECKPOINT_ENGINE_NAME]; // name of the engine that wrote it
+    uint64_t num_points;
+    uint64_t points_hash;     // of the coordinates and weights, to check a resume has the same points
+    uint64_t cluster_changes; // in the last iteration done
+    uint64_t state_bytes;     // of the engine state after the labels
+    int32_t num_clusters;
+    int32_t iterations;
+    int32_t tuning_iterations;
+    int32_t padding;
+    double elapsed_seconds;   // clustering time up to the snapshot, including that of earlier runs
+    double assignment_seconds;
+    double centroids_seconds;
+    double max_iteration_seconds;
+};
+
+struct state_region {
+    void *data;
+    size_t bytes;
+};
+
+static struct {
+    bool active;
+    bool attached; // the loop of the engine called in: it takes checkpoints
+    char *file_name;
+    char *temp_file_name;
+    char engine[CHECKPOINT_ENGINE_NAME];
+    bool resume;
+    bool quiet;
+    int every_iterations;
+    double every_seconds;
+    size_t num_points;
+    int num_clusters;
+    uint64_t points_hash;
+    struct state_region regions[MAX_STATE_REGIONS];
+    int num_regions;
+    double start_seconds;   // omp_get_wtime() when the run started
+    double resumed_seconds; // clustering time of the runs before this one
+    int last_iteration;     // of the last snapshot
+    double last_seconds;    // omp_get_wtime() of the last snapshot
+
+    // the snapshot handed to the writer thread, which owns it while busy
+    struct checkpoint_header header;
+    struct engine_stats engine_stats;
+    double *centroids; // x and y of each
+    int32_t *labels;
+    unsigned char *state;
+    size_t state_bytes;
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool busy; // a snapshot is waiting or being written
+    bool stop;
+} checkpointer = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+// splitmix64 finalizer, mixes every bit of x into every bit of the result
+static inline uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t double_bits(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+/**
+ * Hash of the coordinates and weights of the points in order: the same for the same points in
+ * the same order, whatever the number of threads
+ */
+static uint64_t hash_points(struct point *dataset, size_t num_points)
+{
+    uint64_t hash = 0;
+#pragma omp parallel for schedule(static) reduction(+:hash)
+    for (size_t n = 0; n < num_points; ++n) {
+        hash += mix(mix(mix(n ^ double_bits(dataset[n].x)) ^ double_bits(dataset[n].y)) ^ double_bits(dataset[n].weight));
+    }
+    return hash;
+}
+
+/**
+ * Write the snapshot to the temporary file and rename it over the checkpoint file
+ *
+ * @return false if any of it could not be written, leaving the last checkpoint file as it was
+ */
+static bool write_snapshot()
+{
+    FILE *file = fopen(checkpointer.temp_file_name, "wb");
+    if (!file) {
+        return false;
+    }
+    size_t num_points = checkpointer.header.num_points;
+    int num_clusters = checkpointer.header.num_clusters;
+    bool written = fwrite(&checkpointer.header, sizeof(checkpointer.header), 1, file) == 1
+            && fwrite(&checkpointer.engine_stats, sizeof(checkpointer.engine_stats), 1, file) == 1
+            && fwrite(checkpointer.centroids, 2 * sizeof(double), num_clusters, file) == (size_t)num_clusters
+            && fwrite(checkpointer.labels, sizeof(int32_t), num_points, file) == num_points
+            && fwrite(checkpointer.state, 1, checkpointer.state_bytes, file) == checkpointer.state_bytes
+            && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    written = fclose(file) == 0 && written;
+    return written && rename(checkpointer.temp_file_name, checkpointer.file_name) == 0;
+}
+
+/**
+ * The writer thread: writes each snapshot it is woken up for, until stopped
+ */
+static void *writer(void *unused)
+{
+    (void)unused;
+    pthread_mutex_lock(&checkpointer.lock);
+    while (true) {
+        while (!checkpointer.busy && !checkpointer.stop) {
+            pthread_cond_wait(&checkpointer.wake, &checkpointer.lock);
+        }
+        if (!checkpointer.busy) {
+            break; // stopped, and nothing left to write
+        }
+        pthread_mutex_unlock(&checkpointer.lock);
+        if (!write_snapshot()) {
+            fprintf(stderr, "Warning: cannot write the checkpoint file %s, carrying on without\n",
+                    checkpointer.file_name);
+        }
+        pthread_mutex_lock(&checkpointer.lock);
+        checkpointer.busy = false;
+    }
+    pthread_mutex_unlock(&checkpointer.lock);
+    return NULL;
+}
+
+/**
+ * Get ready to checkpoint a run, if the config asks for it, and start the writer thread.
+ * Called before reserve_workspace, so engines can register their state for the run.
+ *
+ * @param config --checkpoint file, --checkpoint-every interval, --resume and quiet
+ * @param dataset the points that will be clustered, in the order they will be clustered
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void checkpoint_start(struct kmeans_config *config, struct point *dataset, size_t num_points, int num_clusters)
+{
+    if (!config->checkpoint_file) {
+        return;
+    }
+    checkpointer.active = true;
+    checkpointer.attached = false;
+    checkpointer.file_name = config->checkpoint_file;
+    checkpointer.temp_file_name = malloc(strlen(config->checkpoint_file) + 5);
+    sprintf(checkpointer.temp_file_name, "%s.tmp", config->checkpoint_file);
+    memset(checkpointer.engine, 0, CHECKPOINT_ENGINE_NAME);
+    strncpy(checkpointer.engine, config->engine, CHECKPOINT_ENGINE_NAME - 1);
+    checkpointer.resume = config->resume;
+    checkpointer.quiet = config->quiet;
+    checkpointer.every_iterations = config->checkpoint_iterations;
+    checkpointer.every_seconds = config->checkpoint_seconds;
+    checkpointer.num_points = num_points;
+    checkpointer.num_clusters = num_clusters;
+    checkpointer.points_hash = hash_points(dataset, num_points);
+    checkpointer.num_regions = 0;
+    checkpointer.start_seconds = omp_get_wtime();
+    checkpointer.resumed_seconds = 0;
+    checkpointer.last_iteration = 0;
+    checkpointer.last_seconds = checkpointer.start_seconds;
+    checkpointer.centroids = malloc(num_clusters * 2 * sizeof(double));
+    checkpointer.labels = malloc(num_points * sizeof(int32_t));
+    checkpointer.state = NULL;
+    checkpointer.state_bytes = 0;
+    checkpointer.busy = false;
+    checkpointer.stop = false;
+    if (pthread_create(&checkpointer.writer, NULL, writer, NULL) != 0) {
+        fprintf(stderr, "Error: cannot start the thread that writes the checkpoints\n");
+        exit(1);
+    }
+}
+
+/**
+ * Register a piece of engine state that has to be saved in checkpoints and restored on resume
+ * for the run to continue exactly. Engines call it from reserve_workspace; it does nothing
+ * unless the run takes checkpoints.
+ *
+ * @param data the state, which must stay at the same address for the run
+ * @param bytes size of the state
+ */
+void checkpoint_state(void *data, size_t bytes)
+{
+    if (!checkpointer.active) {
+        return;
+    }
+    if (checkpointer.num_regions == MAX_STATE_REGIONS) {
+        fprintf(stderr, "Error: more than %d pieces of engine state to checkpoint\n", MAX_STATE_REGIONS);
+        exit(1);
+    }
+    checkpointer.regions[checkpointer.num_regions++] = (struct state_region) { data, bytes };
+    checkpointer.state_bytes += bytes;
+    checkpointer.state = realloc(checkpointer.state, checkpointer.state_bytes);
+}
+
+/**
+ * With --resume, restore the run from the checkpoint file into the dataset, centroids,
+ * engine state and metrics. Called by the loop before its first iteration; a missing
+ * checkpoint file means there is nothing to resume, and the run starts from the beginning.
+ *
+ * @param dataset the points to be clustered, their clusters are set to the checkpointed ones
+ * @param num_points number of points in the dataset
+ * @param centroids set to the checkpointed centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @param cluster_changes set to the points that changed cluster in the last iteration before the checkpoint
+ * @param metrics the timings and counters up to the checkpoint are restored here
+ * @return the number of iterations already done, 0 if not resumed
+ */
+int checkpoint_resume(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                      size_t *cluster_changes, struct kmeans_metrics *metrics)
+{
+    if (!checkpointer.active) {
+        return 0;
+    }
+    checkpointer.attached = true;
+    if (!checkpointer.resume) {
+        return 0;
+    }
+    char *file_name = checkpointer.file_name;
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        if (!checkpointer.quiet) {
+            printf("No checkpoint at %s yet: starting from the first iteration\n", file_name);
+        }
+        return 0;
+    }
+    struct checkpoint_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, 8) != 0) {
+        fprintf(stderr, "Error: %s is not a checkpoint file\n", file_name);
+        exit(1);
+    }
+    if (strncmp(header.engine, checkpointer.engine, CHECKPOINT_ENGINE_NAME) != 0) {
+        fprintf(stderr, "Error: checkpoint %s was written by %.*s, not %s\n", file_name,
+                CHECKPOINT_ENGINE_NAME, header.engine, checkpointer.engine);
+        exit(1);
+    }
+    if (header.num_points != num_points || header.points_hash != checkpointer.points_hash
+        || header.num_clusters != num_clusters || header.state_bytes != checkpointer.state_bytes) {
+        fprintf(stderr, "Error: checkpoint %s is of a run on other points or with other options "
+                        "(%llu points, %d clusters)\n", file_name, (unsigned long long)header.num_points,
+                header.num_clusters);
+        exit(1);
+    }
+    bool complete = fread(&engine_stats, sizeof(engine_stats), 1, file) == 1
+            && fread(checkpointer.centroids, 2 * sizeof(double), num_clusters, file) == (size_t)num_clusters
+            && fread(checkpointer.labels, sizeof(int32_t), num_points, file) == num_points
+            && fread(checkpointer.state, 1, checkpointer.state_bytes, file) == checkpointer.state_bytes;
+    fclose(file);
+    if (!complete) {
+        fprintf(stderr, "Error: checkpoint file %s is truncated\n", file_name);
+        exit(1);
+    }
+
+    for (int k = 0; k < num_clusters; ++k) {
+        centroids[k].x = checkpointer.centroids[2 * k];
+        centroids[k].y = checkpointer.centroids[2 * k + 1];
+    }
+#pragma omp parallel for schedule(static)
+    for (size_t n = 0; n < num_points; ++n) {
+        dataset[n].cluster = checkpointer.labels[n];
+    }
+    unsigned char *state = checkpointer.state;
+    for (int r = 0; r < checkpointer.num_regions; ++r) {
+        memcpy(checkpointer.regions[r].data, state, checkpointer.regions[r].bytes);
+        state += checkpointer.regions[r].bytes;
+    }
+    *cluster_changes = header.cluster_changes;
+    metrics->assignment_seconds = header.assignment_seconds;
+    metrics->centroids_seconds = header.centroids_seconds;
+    metrics->max_iteration_seconds = header.max_iteration_seconds;
+    metrics->tuning_iterations = header.tuning_iterations;
+    metrics->resumed_iterations = header.iterations;
+    metrics->resumed_seconds = header.elapsed_seconds;
+    checkpointer.resumed_seconds = header.elapsed_seconds;
+    checkpointer.last_iteration = header.iterations;
+    if (!checkpointer.quiet) {
+        printf("Resuming from checkpoint %s after %d iterations\n", file_name, header.iterations);
+    }
+    return header.iterations;
+}
+
+/**
+ * Called by the loop after every iteration: if a checkpoint is due, and the writer is done with
+ * the last one, copy a snapshot of the run for the writer thread.
+ *
+ * @param dataset set of all points with their current clusters
+ * @param num_points number of points in the dataset
+ * @param centroids the centroids at the end of the iteration
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @param iterations iterations done, including this one
+ * @param cluster_changes points that changed cluster in this iteration
+ * @param metrics timings and counters so far; the time spent here is added to checkpoint_seconds
+ */
+void checkpoint_iteration(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                          int iterations, size_t cluster_changes, struct kmeans_metrics *metrics)
+{
+    if (!checkpointer.active) {
+        return;
+    }
+    double now = omp_get_wtime();
+    bool due = checkpointer.every_iterations > 0
+            ? iterations - checkpointer.last_iteration >= checkpointer.every_iterations
+            : now - checkpointer.last_seconds >= checkpointer.every_seconds;
+    if (!due) {
+        return;
+    }
+    pthread_mutex_lock(&checkpointer.lock);
+    if (checkpointer.busy) {
+        // still writing the last one: try again after the next iteration
+        pthread_mutex_unlock(&checkpointer.lock);
+        return;
+    }
+    struct checkpoint_header *header = &checkpointer.header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CHECKPOINT_MAGIC, 8);
+    memcpy(header->engine, checkpointer.engine, CHECKPOINT_ENGINE_NAME);
+    header->num_points = num_points;
+    header->points_hash = checkpointer.points_hash;
+    header->cluster_changes = cluster_changes;
+    header->state_bytes = checkpointer.state_bytes;
+    header->num_clusters = num_clusters;
+    header->iterations = iterations;
+    header->tuning_iterations = metrics->tuning_iterations;
+    header->elapsed_seconds = checkpointer.resumed_seconds + now - checkpointer.start_seconds;
+    header->assignment_seconds = metrics->assignment_seconds;
+    header->centroids_seconds = metrics->centroids_seconds;
+    header->max_iteration_seconds = metrics->max_iteration_seconds;
+    checkpointer.engine_stats = engine_stats;
+    for (int k = 0; k < num_clusters; ++k) {
+        checkpointer.centroids[2 * k] = centroids[k].x;
+        checkpointer.centroids[2 * k + 1] = centroids[k].y;
+    }
+#pragma omp parallel for schedule(static)
+    for (size_t n = 0; n < num_points; ++n) {
+        checkpointer.labels[n] = dataset[n].cluster;
+    }
+    unsigned char *state = checkpointer.state;
+    for (int r = 0; r < checkpointer.num_regions; ++r) {
+        memcpy(state, checkpointer.regions[r].data, checkpointer.regions[r].bytes);
+        state += checkpointer.regions[r].bytes;
+    }
+    checkpointer.busy = true;
+    pthread_cond_signal(&checkpointer.wake);
+    pthread_mutex_unlock(&checkpointer.lock);
+
+    checkpointer.last_iteration = iterations;
+    checkpointer.last_seconds = omp_get_wtime();
+    metrics->checkpoints++;
+    metrics->checkpoint_seconds += checkpointer.last_seconds - now;
+}
+
+/**
+ * End the checkpoints of the run: wait for the writer to finish the last snapshot and stop it.
+ * Warns if checkpoints were asked for but the engine runs its own loop, which takes none.
+ */
+void checkpoint_finish()
+{
+    if (!checkpointer.active) {
+        return;
+    }
+    pthread_mutex_lock(&checkpointer.lock);
+    checkpointer.stop = true;
+    pthread_cond_signal(&checkpointer.wake);
+    pthread_mutex_unlock(&checkpointer.lock);
+    pthread_join(checkpointer.writer, NULL);
+    if (!checkpointer.attached) {
+        fprintf(stderr, "Warning: %s runs its own loop, which takes no checkpoints: %s was not %s\n",
+                checkpointer.engine, checkpointer.file_name, checkpointer.resume ? "used" : "written");
+    }
+    checkpointer.active = false;
+    free(checkpointer.temp_file_name);
+    free(checkpointer.centroids);
+    free(checkpointer.labels);
+    free(checkpointer.state);
+}
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Lightweight coresets (Bachem, Lucic and Krause, "Scalable k-Means Clustering via Lightweight
+ * Coresets", KDD 2018): a small weighted sample of the dataset whose k-means cost is close to
+ * the cost of the full dataset for any set of centroids, so the centroids fitted on the sample
+ * are close to those fitted on all points.
+ *
+ * Each point is sampled with a probability that is half uniform and half proportional to its
+ * squared distance from the mean of the dataset, so outlying points that pull the centroids
+ * are more likely to be in the sample, and it gets the inverse of that probability as weight.
+ * The points are sampled independently with a random number drawn from the point's index,
+ * so the sample does not depend on the number of threads, and it keeps the file order.
+ */
+
+// the sample is always the same for the same dataset and size
+#define CORESET_SEED 0x636f726573657431ULL
+
+/**
+ * Uniform random number in [0, 1) for the given counter: the finalizer of splitmix64 over the
+ * seeded counter, so numbers can be drawn in any order by any thread
+ */
+static inline double counter_uniform(uint64_t seed, uint64_t counter)
+{
+    uint64_t z = seed + (counter + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0); // top 53 bits over 2^53
+}
+
+/**
+ * Build a lightweight coreset of about coreset_size weighted points from the dataset.
+ *
+ * @param dataset array of (possibly already weighted) points, not changed
+ * @param num_points size of the array
+ * @param coreset_size expected number of points in the coreset
+ * @param num_coreset set to the actual number of points in the coreset
+ * @return allocated array of the coreset points, in the order of the dataset
+ */
+struct point *build_coreset(struct point *dataset, size_t num_points, size_t coreset_size, size_t *num_coreset)
+{
+    // the weighted mean of the dataset
+    double total_weight = 0.0, sum_x = 0.0, sum_y = 0.0;
+#pragma omp parallel for schedule(static) reduction(+:total_weight, sum_x, sum_y)
+    for (size_t n = 0; n < num_points; ++n) {
+        total_weight += dataset[n].weight;
+        sum_x += dataset[n].weight * dataset[n].x;
+        sum_y += dataset[n].weight * dataset[n].y;
+    }
+    double mean_x = sum_x / total_weight;
+    double mean_y = sum_y / total_weight;
+
+    double *square_distance = malloc(num_points * sizeof(double));
+    double total_square_distance = 0.0;
+#pragma omp parallel for schedule(static) reduction(+:total_square_distance)
+    for (size_t n = 0; n < num_points; ++n) {
+        double dx = dataset[n].x - mean_x;
+        double dy = dataset[n].y - mean_y;
+        square_distance[n] = dx * dx + dy * dy;
+        total_square_distance += dataset[n].weight * square_distance[n];
+    }
+
+    size_t *thread_counts = malloc((omp_get_max_threads() + 1) * sizeof(size_t));
+    struct point *coreset = NULL;
+    size_t count = 0;
+#pragma omp parallel
+    {
+        // each thread samples its own static share of the points, then copies them out from
+        // the total of the threads before it, so the sample stays in dataset order
+        int thread = omp_get_thread_num();
+        int team = omp_get_num_threads();
+        size_t begin = num_points * thread / team;
+        size_t end = num_points * (thread + 1) / team;
+        size_t thread_count = 0;
+        for (size_t n = begin; n < end; ++n) {
+            double q = 0.5 * dataset[n].weight / total_weight;
+            if (total_square_distance > 0) {
+                q += 0.5 * dataset[n].weight * square_distance[n] / total_square_distance;
+            }
+            else {
+                q *= 2; // all points are at the mean: sample uniformly
+            }
+            double probability = coreset_size * q < 1.0 ? coreset_size * q : 1.0;
+            // the probability replaces the distance, which is not needed any more
+            square_distance[n] = counter_uniform(CORESET_SEED, n) < probability ? probability : 0.0;
+            thread_count += square_distance[n] > 0;
+        }
+        thread_counts[thread + 1] = thread_count;
+#pragma omp barrier
+#pragma omp single
+        {
+            thread_counts[0] = 0;
+            for (int t = 0; t < team; ++t) {
+                thread_counts[t + 1] += thread_counts[t];
+            }
+            count = thread_counts[team];
+            coreset = malloc((count > 0 ? count : 1) * sizeof(struct point));
+        }
+        size_t next = thread_counts[thread];
+        for (size_t n = begin; n < end; ++n) {
+            if (square_distance[n] > 0) {
+                struct point *p = &coreset[next++];
+                *p = dataset[n];
+                p->cluster = -1;
+                p->weight = dataset[n].weight / square_distance[n];
+            }
+        }
+    }
+    free(square_distance);
+    free(thread_counts);
+    *num_coreset = count;
+    return coreset;
+}
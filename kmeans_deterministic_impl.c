@@ -0,0 +1,139 @@
+#include <float.h>
+#include <math.h>
+#include "kmeans.h"
+
+/**
+ * Deterministic version:
+ * - the sums for the centroids are done in fixed-size blocks of points, each block summed
+ *   in order by a single thread, and the block sums are then combined pairwise in a fixed
+ *   binary tree
+ * - neither the block boundaries nor the order of the additions depend on the number of
+ *   threads or the schedule, so the centroids (and hence the clustering) are bitwise
+ *   identical for any OMP_NUM_THREADS and OMP_SCHEDULE
+ * - compare the metrics with kmeans_omp3 (scripts/deterministic_run.sh) for the overhead
+ */
+
+// points per block: fixed, never derived from the thread count
+#define DETERMINISTIC_BLOCK_POINTS 4096
+// pad each block's partial sums to whole cache lines to avoid false sharing
+#define DOUBLES_PER_CACHE_LINE 8
+
+/**
+ * Assigns each point in the dataset to a cluster based on the distance from that cluster.
+ *
+ * The return value indicates how many points were assigned to a _different_ cluster
+ * in this assignment process: this indicates how close the algorithm is to completion.
+ * When the return value is zero, no points changed cluster so the clustering is complete.
+ *
+ * @param dataset set of all points with current cluster assignments
+ * @param num_points number of points in the dataset
+ * @param centroids array that holds the current centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @return the number of points for which the cluster assignment was changed
+ */
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+#ifdef DEBUG
+    printf("\nStarting assignment phase:\n");
+#endif
+    size_t cluster_changes = 0;
+    // each point only depends on the centroids, and integer sums are exact, so this is deterministic as is
+#pragma omp parallel for schedule(runtime) reduction(+:cluster_changes)
+    for (size_t n = 0; n < num_points; ++n) {
+        double min_distance = DBL_MAX; // init the min distance to a big number
+        int closest_cluster = -1;
+        for (int k = 0; k < num_clusters; ++k) {
+            // calc the distance passing pointers to points since the distance does not modify them
+            double distance_from_centroid = euclidean_distance(&dataset[n], &centroids[k]);
+            if (distance_from_centroid < min_distance) {
+                min_distance = distance_from_centroid;
+                closest_cluster = k;
+            }
+        }
+        // if the point was not already in the closest cluster, move it there and count changes
+        if (dataset[n].cluster != closest_cluster) {
+            dataset[n].cluster = closest_cluster;
+            cluster_changes++;
+#ifdef TRACE
+            debug_assignment(&dataset[n], closest_cluster, &centroids[closest_cluster], min_distance);
+#endif
+        }
+    }
+    return cluster_changes;
+}
+
+/**
+ * Calculates new centroids for the clusters of the given dataset by finding the
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
+ *
+ * The centroids are set in the array passed in, which is expected to be pre-allocated
+ * and contain the previous centroids: these are overwritten by the new values.
+ *
+ * @param dataset set of all points with current cluster assigments
+ * @param num_points number of points in the dataset
+ * @param centroids array to hold the centroids - already allocated
+ * @param num_clusters number of clusters - hence size of the centroids array
+ */
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    size_t num_blocks = (num_points + DETERMINISTIC_BLOCK_POINTS - 1) / DETERMINISTIC_BLOCK_POINTS;
+    if (num_blocks == 0) {
+        num_blocks = 1;
+    }
+    // per block: sums of x, sums of y and counts, each stride long
+    double *partials = workspace_buffer(WORKSPACE_PARTIALS, num_blocks * 3 * stride * sizeof(double));
+
+    // sum every block in point order, whichever thread gets it
+#pragma omp parallel for schedule(runtime)
+    for (size_t b = 0; b < num_blocks; ++b) {
+        double *partial = &partials[b * 3 * stride];
+        for (int i = 0; i < 3 * stride; ++i) {
+            partial[i] = 0.0;
+        }
+        size_t end = (b + 1) * DETERMINISTIC_BLOCK_POINTS < num_points ? (b + 1) * DETERMINISTIC_BLOCK_POINTS : num_points;
+        for (size_t n = b * DETERMINISTIC_BLOCK_POINTS; n < end; ++n) {
+            struct point *p = &dataset[n];
+            int k = p->cluster;
+            partial[k] += p->weight * p->x;
+            partial[stride + k] += p->weight * p->y;
+            partial[2 * stride + k] += p->weight;
+        }
+    }
+
+    // combine the blocks pairwise: at each level block b takes in block b + width, so the
+    // shape of the tree only depends on the number of blocks
+    for (size_t width = 1; width < num_blocks; width *= 2) {
+#pragma omp parallel for schedule(runtime)
+        for (size_t b = 0; b < num_blocks - width; b += 2 * width) {
+            double *into = &partials[b * 3 * stride];
+            double *from = &partials[(b + width) * 3 * stride];
+            for (int i = 0; i < 3 * stride; ++i) {
+                into[i] += from[i];
+            }
+        }
+    }
+
+    // the new centroids are at the mean x and y coords of the clusters
+    for (int k = 0; k < num_clusters; ++k) {
+        struct point new_centroid;
+        // mean x, mean y => new centroid
+        new_centroid.x = partials[k] / partials[2 * stride + k];
+        new_centroid.y = partials[stride + k] / partials[2 * stride + k];
+        centroids[k] = new_centroid;
+    }
+}
+
+/**
+ * Sizes the workspace for a run: the partial cluster sums of every block of points.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    size_t num_blocks = (num_points + DETERMINISTIC_BLOCK_POINTS - 1) / DETERMINISTIC_BLOCK_POINTS;
+    workspace_buffer(WORKSPACE_PARTIALS, (num_blocks > 0 ? num_blocks : 1) * 3 * stride * sizeof(double));
+}
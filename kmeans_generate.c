@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Synthetic datasets for scaling studies (--generate): far more points than the checked in
+ * data, of a known shape, with the clusters they were drawn from as the expected result.
+ *
+ * - blobs: normally distributed clusters around k centres spread uniformly over the square
+ *   [0, GENERATE_SIDE), with standard deviation --noise times the side
+ * - uniform: points spread uniformly over the same square, with no clusters at all
+ * - gps: k vehicle traces over roughly the longitudes and latitudes of Jutland, each a path
+ *   through a few random waypoints with the points spread along it, jittered by --noise
+ *   times the side of the area
+ *
+ * Every random number comes from a counter-based generator: a hash of the seed, the point
+ * index and what the number is for. Any point can be generated on its own, so the points are
+ * generated in parallel in batches and the file is the same for any number of threads. The
+ * first k points are taken from clusters 0 to k-1, so that the first-k seeding of the
+ * clustering starts in every cluster with the clusters numbered as generated.
+ *
+ * The points are written as csv, or in the binary points format (see read_csv_file) when the
+ * output file name ends in .bin. The expected clusters go to --truth as a csv test file for -t,
+ * with the coordinates exactly as they are in the output file.
+ * Points only have 2 dimensions in this program, so only 2-D data is generated.
+ */
+
+#define GENERATE_SIDE 1000000.0
+// Jutland, more or less: the area the gps traces are in
+#define GPS_LONGITUDE 8.0
+#define GPS_LATITUDE 55.0
+#define GPS_SIDE 3.0
+#define GPS_WAYPOINTS 8
+// points generated, then written, at a time: bounds the memory for any number of points
+#define GENERATE_BATCH_POINTS (1 << 18)
+// points formatted into one text buffer by one thread
+#define GENERATE_BLOCK_POINTS 4096
+// longest line written: two coordinates with 7 decimals and a cluster
+#define GENERATE_LINE_BYTES 80
+// PI is not in C99
+#define PI 3.14159265358979323846
+
+// what each random number of a point is used for: each gets its own stream
+enum random_stream {
+    STREAM_CLUSTER,
+    STREAM_X,
+    STREAM_Y,
+    STREAM_GAUSS_1,
+    STREAM_GAUSS_2,
+    STREAM_GAUSS_3,
+    STREAM_GAUSS_4,
+    STREAM_CENTRE_X,
+    STREAM_CENTRE_Y,
+    STREAMS
+};
+
+/**
+ * splitmix64 finalizer: a bijective mix of all 64 bits
+ */
+static uint64_t mix(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * The random number of the given stream for the given index: uniform in [0, 1)
+ */
+static double uniform(uint64_t seed, uint64_t index, enum random_stream stream)
+{
+    uint64_t bits = mix(mix(seed + 0x9e3779b97f4a7c15ULL) ^ (index * STREAMS + stream));
+    return (bits >> 11) * (1.0 / 9007199254740992.0); // 53 bits
+}
+
+/**
+ * Two independent standard normal numbers by Box-Muller, from two streams
+ */
+static void gauss(uint64_t seed, uint64_t index, enum random_stream first, double *g1, double *g2)
+{
+    double u1 = 1.0 - uniform(seed, index, first); // (0, 1] so the log is finite
+    double u2 = uniform(seed, index, first + 1);
+    double radius = sqrt(-2.0 * log(u1));
+    *g1 = radius * cos(2 * PI * u2);
+    *g2 = radius * sin(2 * PI * u2);
+}
+
+/**
+ * The shape of a dataset: the centres of the blobs or the waypoints of the traces
+ */
+struct generator {
+    enum {BLOBS, UNIFORM, GPS} kind;
+    uint64_t seed;
+    int num_clusters;
+    double noise;
+    double *anchor_x; // blobs: one centre per cluster; gps: GPS_WAYPOINTS waypoints per trace
+    double *anchor_y;
+};
+
+/**
+ * Generate point n of the dataset
+ */
+static void generate_point(struct generator *g, uint64_t n, struct point *p)
+{
+    int cluster = n < (uint64_t)g->num_clusters ? (int)n : (int)(uniform(g->seed, n, STREAM_CLUSTER) * g->num_clusters);
+    double g1, g2;
+    p->weight = 1.0;
+    switch (g->kind) {
+        case BLOBS:
+            gauss(g->seed, n, STREAM_GAUSS_1, &g1, &g2);
+            p->x = g->anchor_x[cluster] + g->noise * GENERATE_SIDE * g1;
+            p->y = g->anchor_y[cluster] + g->noise * GENERATE_SIDE * g2;
+            p->cluster = cluster;
+            break;
+        case UNIFORM:
+            p->x = uniform(g->seed, n, STREAM_X) * GENERATE_SIDE;
+            p->y = uniform(g->seed, n, STREAM_Y) * GENERATE_SIDE;
+            p->cluster = -1;
+            break;
+        case GPS: {
+            // somewhere along the path through the waypoints of the trace
+            double along = uniform(g->seed, n, STREAM_X) * (GPS_WAYPOINTS - 1);
+            int leg = (int)along;
+            double t = along - leg;
+            double *x = &g->anchor_x[cluster * GPS_WAYPOINTS + leg];
+            double *y = &g->anchor_y[cluster * GPS_WAYPOINTS + leg];
+            gauss(g->seed, n, STREAM_GAUSS_1, &g1, &g2);
+            p->x = x[0] + t * (x[1] - x[0]) + g->noise * GPS_SIDE * g1;
+            p->y = y[0] + t * (y[1] - y[0]) + g->noise * GPS_SIDE * g2;
+            p->cluster = cluster;
+            break;
+        }
+    }
+}
+
+/**
+ * Set up the generator for the config: the blob centres or the trace waypoints
+ */
+static void init_generator(struct kmeans_config *config, struct generator *g)
+{
+    g->seed = config->seed;
+    g->num_clusters = config->num_clusters;
+    g->noise = config->noise;
+    g->anchor_x = NULL;
+    g->anchor_y = NULL;
+    if (strcmp(config->generate, "blobs") == 0) {
+        g->kind = BLOBS;
+        g->anchor_x = malloc(g->num_clusters * sizeof(double));
+        g->anchor_y = malloc(g->num_clusters * sizeof(double));
+        for (int k = 0; k < g->num_clusters; ++k) {
+            g->anchor_x[k] = uniform(g->seed, k, STREAM_CENTRE_X) * GENERATE_SIDE;
+            g->anchor_y[k] = uniform(g->seed, k, STREAM_CENTRE_Y) * GENERATE_SIDE;
+        }
+    }
+    else if (strcmp(config->generate, "uniform") == 0) {
+        g->kind = UNIFORM;
+    }
+    else {
+        // a trace starts anywhere and wanders in legs of about a tenth of the area
+        g->kind = GPS;
+        g->anchor_x = malloc(g->num_clusters * GPS_WAYPOINTS * sizeof(double));
+        g->anchor_y = malloc(g->num_clusters * GPS_WAYPOINTS * sizeof(double));
+        for (int k = 0; k < g->num_clusters; ++k) {
+            double *x = &g->anchor_x[k * GPS_WAYPOINTS];
+            double *y = &g->anchor_y[k * GPS_WAYPOINTS];
+            x[0] = GPS_LONGITUDE + uniform(g->seed, k, STREAM_CENTRE_X) * GPS_SIDE;
+            y[0] = GPS_LATITUDE + uniform(g->seed, k, STREAM_CENTRE_Y) * GPS_SIDE;
+            for (int w = 1; w < GPS_WAYPOINTS; ++w) {
+                double g1, g2;
+                gauss(g->seed, (uint64_t)k * GPS_WAYPOINTS + w, STREAM_GAUSS_3, &g1, &g2);
+                x[w] = x[w - 1] + 0.1 * GPS_SIDE * g1;
+                y[w] = y[w - 1] + 0.1 * GPS_SIDE * g2;
+            }
+        }
+    }
+}
+
+static FILE *open_output(char *file_name)
+{
+    FILE *file = fopen(file_name, "wb");
+    if (!file) {
+        fprintf(stderr, "Error: cannot write to the output file at %s\n", file_name);
+        exit(1);
+    }
+    return file;
+}
+
+/**
+ * Generate the dataset described by the config (--generate, -k, --noise, --seed) in memory,
+ * in parallel: the same points as generate_file would write, with their expected clusters.
+ *
+ * @param config run configuration
+ * @param points array to fill, already allocated
+ * @param num_points number of points to generate
+ */
+void generate_points(struct kmeans_config *config, struct point *points, size_t num_points)
+{
+    struct generator g;
+    init_generator(config, &g);
+#pragma omp parallel for schedule(static)
+    for (size_t n = 0; n < num_points; ++n) {
+        generate_point(&g, n, &points[n]);
+    }
+    free(g.anchor_x);
+    free(g.anchor_y);
+}
+
+/**
+ * Generate the dataset described by the config (--generate, -n, -k, --noise, --seed) and
+ * write it to the output file (-o), with the expected clusters in the --truth file if set.
+ *
+ * @param config run configuration
+ * @param metrics set with the number of points and clusters, and the time taken
+ */
+void generate_file(struct kmeans_config *config, struct kmeans_metrics *metrics)
+{
+    struct generator g;
+    init_generator(config, &g);
+    bool binary = binary_file_name(config->out_file);
+    FILE *out_file = open_output(config->out_file);
+    FILE *truth_file = config->truth_file ? open_output(config->truth_file) : NULL;
+
+    double start_time = omp_get_wtime();
+    size_t num_points = config->max_points;
+    if (binary) {
+        uint64_t count = num_points;
+        fwrite(BINARY_POINTS_MAGIC, 1, 8, out_file);
+        fwrite(&count, sizeof(count), 1, out_file);
+    }
+    else {
+        fprintf(out_file, "x,y\n");
+    }
+    if (truth_file) {
+        fprintf(truth_file, "x,y,Cluster\n");
+    }
+    // the test compares coordinates exactly: the truth has them as the output file does, to 7
+    // decimals for csv, and with every digit of the doubles in a binary file
+    const char *truth_format = binary ? "%.17g,%.17g,cluster_%d\n" : "%.7f,%.7f,cluster_%d\n";
+
+    // per batch: the points, their coordinates for a binary file, and a text buffer per block
+    size_t num_blocks = GENERATE_BATCH_POINTS / GENERATE_BLOCK_POINTS;
+    size_t block_bytes = GENERATE_BLOCK_POINTS * GENERATE_LINE_BYTES;
+    struct point *points = malloc(GENERATE_BATCH_POINTS * sizeof(struct point));
+    double *coordinates = malloc(2 * GENERATE_BATCH_POINTS * sizeof(double));
+    char *text = malloc(num_blocks * block_bytes);
+    char *truth_text = truth_file ? malloc(num_blocks * block_bytes) : NULL;
+    size_t *text_lengths = malloc(num_blocks * sizeof(size_t));
+    size_t *truth_lengths = malloc(num_blocks * sizeof(size_t));
+
+    for (size_t first = 0; first < num_points; first += GENERATE_BATCH_POINTS) {
+        size_t count = num_points - first < GENERATE_BATCH_POINTS ? num_points - first : GENERATE_BATCH_POINTS;
+        size_t blocks = (count + GENERATE_BLOCK_POINTS - 1) / GENERATE_BLOCK_POINTS;
+        // generating and formatting are the expensive part: writing is one fwrite per block
+#pragma omp parallel for schedule(static)
+        for (size_t b = 0; b < blocks; ++b) {
+            size_t begin = b * GENERATE_BLOCK_POINTS;
+            size_t end = begin + GENERATE_BLOCK_POINTS < count ? begin + GENERATE_BLOCK_POINTS : count;
+            char *line = &text[b * block_bytes];
+            char *truth_line = truth_text ? &truth_text[b * block_bytes] : NULL;
+            for (size_t i = begin; i < end; ++i) {
+                generate_point(&g, first + i, &points[i]);
+                if (binary) {
+                    coordinates[2 * i] = points[i].x;
+                    coordinates[2 * i + 1] = points[i].y;
+                }
+                else {
+                    line += sprintf(line, "%.7f,%.7f\n", points[i].x, points[i].y);
+                }
+                if (truth_line) {
+                    truth_line += sprintf(truth_line, truth_format, points[i].x, points[i].y, points[i].cluster);
+                }
+            }
+            text_lengths[b] = line - &text[b * block_bytes];
+            truth_lengths[b] = truth_line ? (size_t)(truth_line - &truth_text[b * block_bytes]) : 0;
+        }
+        if (binary) {
+            fwrite(coordinates, 2 * sizeof(double), count, out_file);
+        }
+        for (size_t b = 0; b < blocks; ++b) {
+            if (!binary) {
+                fwrite(&text[b * block_bytes], 1, text_lengths[b], out_file);
+            }
+            if (truth_file) {
+                fwrite(&truth_text[b * block_bytes], 1, truth_lengths[b], truth_file);
+            }
+        }
+    }
+    fclose(out_file);
+    if (truth_file) {
+        fclose(truth_file);
+    }
+    metrics->total_seconds = omp_get_wtime() - start_time;
+    metrics->num_points = num_points;
+    metrics->num_clusters = config->num_clusters;
+    if (!config->quiet) {
+        printf("Generated %zu %s points in %.3f seconds: %.0f points/second\n", num_points, config->generate,
+               metrics->total_seconds, num_points / metrics->total_seconds);
+    }
+
+    free(points);
+    free(coordinates);
+    free(text);
+    free(truth_text);
+    free(text_lengths);
+    free(truth_lengths);
+    free(g.anchor_x);
+    free(g.anchor_y);
+}
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <math.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Geographic inputs (--geo): points given as longitude (x) and latitude (y) in degrees, like
+ * the Jutland datasets. A degree of longitude is only cos(latitude) as long as a degree of
+ * latitude, so Euclidean distances on degrees stretch everything east-west (by 1.8 times at
+ * the latitude of Jutland) and the clusters come out distorted.
+ *
+ * Instead of a spherical distance in the inner loop, which would be far too slow, the points
+ * are projected once, after loading, onto a plane in kilometres with an equirectangular
+ * projection around their centroid: x = R cos(lat0) (lon - lon0), y = R (lat - lat0). Every
+ * engine then clusters with its usual Euclidean kernels. Distances are true to within the
+ * change of cos(latitude) over the extent of the data, a few percent for a region the size
+ * of Denmark.
+ *
+ * The inertia and other quality measures of a --geo run are in kilometres (squared for the
+ * inertia). The output file, the tests, saved models and hierarchies get the degrees back.
+ */
+
+#define EARTH_RADIUS_KM 6371.0088 // mean radius
+// M_PI is not in C99
+#define PI 3.14159265358979323846
+#define RADIANS_PER_DEGREE (PI / 180.0)
+
+/**
+ * Projection around the given centre
+ *
+ * @param lon0 longitude of the centre, in degrees
+ * @param lat0 latitude of the centre, in degrees
+ * @return the projection
+ */
+struct geo_projection geo_projection_at(double lon0, double lat0)
+{
+    struct geo_projection projection;
+    projection.lon0 = lon0;
+    projection.lat0 = lat0;
+    projection.km_per_degree_y = EARTH_RADIUS_KM * RADIANS_PER_DEGREE;
+    projection.km_per_degree_x = projection.km_per_degree_y * cos(lat0 * RADIANS_PER_DEGREE);
+    return projection;
+}
+
+/**
+ * Projection around the weighted centroid of the points
+ *
+ * @param dataset points with longitude in x and latitude in y, in degrees
+ * @param num_points number of points in the dataset
+ * @return the projection
+ */
+struct geo_projection geo_projection_around(struct point *dataset, size_t num_points)
+{
+    double weight = 0, sum_lon = 0, sum_lat = 0;
+#pragma omp parallel for schedule(static) reduction(+:weight, sum_lon, sum_lat)
+    for (size_t n = 0; n < num_points; ++n) {
+        weight += dataset[n].weight;
+        sum_lon += dataset[n].weight * dataset[n].x;
+        sum_lat += dataset[n].weight * dataset[n].y;
+    }
+    return geo_projection_at(weight > 0 ? sum_lon / weight : 0, weight > 0 ? sum_lat / weight : 0);
+}
+
+/**
+ * Project points from degrees to kilometres on the plane of the projection, in place
+ *
+ * @param projection from geo_projection_around
+ * @param points longitude in x and latitude in y, in degrees; set to x and y in kilometres
+ * @param num_points number of points
+ */
+void geo_project(struct geo_projection *projection, struct point *points, size_t num_points)
+{
+    double lon0 = projection->lon0, lat0 = projection->lat0;
+    double scale_x = projection->km_per_degree_x, scale_y = projection->km_per_degree_y;
+#pragma omp parallel for simd schedule(static)
+    for (size_t n = 0; n < num_points; ++n) {
+        points[n].x = (points[n].x - lon0) * scale_x;
+        points[n].y = (points[n].y - lat0) * scale_y;
+    }
+}
+
+/**
+ * Project separate arrays of longitudes and latitudes, for the vectorized kernel of predict
+ *
+ * @param projection from geo_projection_around
+ * @param lon longitudes in degrees
+ * @param lat latitudes in degrees
+ * @param x set to the projected x in kilometres
+ * @param y set to the projected y in kilometres
+ * @param count number of points
+ */
+void geo_project_xy(struct geo_projection *projection, const double *lon, const double *lat,
+                    double *x, double *y, int count)
+{
+    double lon0 = projection->lon0, lat0 = projection->lat0;
+    double scale_x = projection->km_per_degree_x, scale_y = projection->km_per_degree_y;
+#pragma omp parallel for simd schedule(static)
+    for (int i = 0; i < count; ++i) {
+        x[i] = (lon[i] - lon0) * scale_x;
+        y[i] = (lat[i] - lat0) * scale_y;
+    }
+}
+
+/**
+ * Back from kilometres on the plane of the projection to degrees, in place: for the centroids,
+ * which have no original coordinates to go back to
+ *
+ * @param projection the projection the points were projected with
+ * @param points x and y in kilometres; set to longitude in x and latitude in y, in degrees
+ * @param num_points number of points
+ */
+void geo_unproject(struct geo_projection *projection, struct point *points, size_t num_points)
+{
+    for (size_t n = 0; n < num_points; ++n) {
+        points[n].x = projection->lon0 + points[n].x / projection->km_per_degree_x;
+        points[n].y = projection->lat0 + points[n].y / projection->km_per_degree_y;
+    }
+}
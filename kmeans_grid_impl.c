@@ -0,0 +1,303 @@
+#include <float.h>
+#include <math.h>
+#include "kmeans.h"
+
+/**
+ * Grid index version, for large numbers of clusters:
+ * - each assignment starts by bucketing the centroids into a uniform grid over their bounding
+ *   box, with about one centroid per cell
+ * - the nearest centroid of a point is then searched ring by ring outwards from the point's
+ *   cell, stopping as soon as the closest centroid found is nearer than any cell not searched
+ *   yet, so most points only look at a few centroids instead of all k
+ * - the search starts with the distance to the point's previous cluster, which in the later
+ *   iterations usually is the answer and lets the search stop after the first ring
+ * - ties are broken towards the lowest cluster, as in the linear scan of the other versions,
+ *   so the clustering is the same
+ */
+
+// slack on the bound of the unsearched cells for the rounding in the cell calculations
+#define GRID_BOUND_SLACK 1e-9
+// pad each thread's partial sums to whole cache lines to avoid false sharing
+#define DOUBLES_PER_CACHE_LINE 8
+
+struct centroid_grid {
+    int side;          // cells per row and per column
+    double min_x, min_y;
+    double cell_width, cell_height;
+    int *cell_start;   // centroids of cell c are cell_items[cell_start[c] .. cell_start[c + 1] - 1]
+    int *cell_items;
+};
+
+static inline int grid_column(struct centroid_grid *grid, double x)
+{
+    double column = (x - grid->min_x) / grid->cell_width;
+    return column < 0 ? 0 : column >= grid->side ? grid->side - 1 : (int)column;
+}
+
+static inline int grid_row(struct centroid_grid *grid, double y)
+{
+    double row = (y - grid->min_y) / grid->cell_height;
+    return row < 0 ? 0 : row >= grid->side ? grid->side - 1 : (int)row;
+}
+
+static inline int grid_side(int num_clusters)
+{
+    return (int)ceil(sqrt((double)num_clusters));
+}
+
+/**
+ * Ints needed in the workspace for the grid: the cell starts and the cell counts of a counting
+ * sort, the centroids in cell order and the cell of each centroid
+ */
+static inline size_t grid_ints(int num_clusters)
+{
+    size_t num_cells = (size_t)grid_side(num_clusters) * grid_side(num_clusters);
+    return 2 * num_cells + 1 + 2 * (size_t)num_clusters;
+}
+
+/**
+ * Bucket the centroids into the grid with a counting sort, lowest cluster first in every cell.
+ * Centroids of empty clusters (not a number) are left out: they can never be the nearest.
+ */
+static void build_grid(struct centroid_grid *grid, struct point *centroids, int num_clusters)
+{
+    double min_x = DBL_MAX, min_y = DBL_MAX;
+    double max_x = -DBL_MAX, max_y = -DBL_MAX;
+    for (int k = 0; k < num_clusters; ++k) {
+        if (isnan(centroids[k].x) || isnan(centroids[k].y)) {
+            continue;
+        }
+        min_x = centroids[k].x < min_x ? centroids[k].x : min_x;
+        min_y = centroids[k].y < min_y ? centroids[k].y : min_y;
+        max_x = centroids[k].x > max_x ? centroids[k].x : max_x;
+        max_y = centroids[k].y > max_y ? centroids[k].y : max_y;
+    }
+    grid->side = grid_side(num_clusters);
+    grid->min_x = min_x;
+    grid->min_y = min_y;
+    grid->cell_width = max_x > min_x ? (max_x - min_x) / grid->side : 1.0;
+    grid->cell_height = max_y > min_y ? (max_y - min_y) / grid->side : 1.0;
+
+    int num_cells = grid->side * grid->side;
+    int *ints = workspace_buffer(WORKSPACE_INDEX, grid_ints(num_clusters) * sizeof(int));
+    grid->cell_start = ints;
+    grid->cell_items = &ints[num_cells + 1];
+    int *cell_of = &ints[num_cells + 1 + num_clusters];
+    int *next = &ints[num_cells + 1 + 2 * num_clusters];
+    for (int c = 0; c <= num_cells; ++c) {
+        grid->cell_start[c] = 0;
+    }
+    for (int k = 0; k < num_clusters; ++k) {
+        if (isnan(centroids[k].x) || isnan(centroids[k].y)) {
+            cell_of[k] = -1;
+            continue;
+        }
+        cell_of[k] = grid_row(grid, centroids[k].y) * grid->side + grid_column(grid, centroids[k].x);
+        grid->cell_start[cell_of[k] + 1]++;
+    }
+    for (int c = 0; c < num_cells; ++c) {
+        grid->cell_start[c + 1] += grid->cell_start[c];
+    }
+    for (int c = 0; c < num_cells; ++c) {
+        next[c] = grid->cell_start[c];
+    }
+    for (int k = 0; k < num_clusters; ++k) {
+        if (cell_of[k] >= 0) {
+            grid->cell_items[next[cell_of[k]]++] = k;
+        }
+    }
+}
+
+/**
+ * Check the centroids of one cell against the closest found so far
+ */
+static inline void search_cell(struct centroid_grid *grid, int cell, struct point *p, struct point *centroids,
+                               int *closest_cluster, double *min_distance, long *distances)
+{
+    for (int i = grid->cell_start[cell]; i < grid->cell_start[cell + 1]; ++i) {
+        int k = grid->cell_items[i];
+        double distance_from_centroid = euclidean_distance(p, &centroids[k]);
+        if (distance_from_centroid < *min_distance
+            || (distance_from_centroid == *min_distance && k < *closest_cluster)) {
+            *min_distance = distance_from_centroid;
+            *closest_cluster = k;
+        }
+    }
+    *distances += grid->cell_start[cell + 1] - grid->cell_start[cell];
+}
+
+/**
+ * Find the nearest centroid by searching the rings of cells around the point's cell
+ */
+static int nearest_cluster(struct centroid_grid *grid, struct point *p, struct point *centroids, int num_clusters,
+                           double *min_distance, long *distances)
+{
+    int closest_cluster = -1;
+    *min_distance = DBL_MAX;
+    // the cluster may come from the input file (a clustered csv), not from an earlier assignment
+    if (p->cluster >= 0 && p->cluster < num_clusters) {
+        // the previous cluster is a good first guess and bounds the search from the start
+        closest_cluster = p->cluster;
+        *min_distance = euclidean_distance(p, &centroids[closest_cluster]);
+        (*distances)++;
+        if (isnan(*min_distance)) {
+            closest_cluster = -1;
+            *min_distance = DBL_MAX;
+        }
+    }
+    int column = grid_column(grid, p->x);
+    int row = grid_row(grid, p->y);
+    for (int ring = 0; ring < grid->side; ++ring) {
+        int first_column = column - ring, last_column = column + ring;
+        int first_row = row - ring, last_row = row + ring;
+        for (int r = first_row > 0 ? first_row : 0; r <= last_row && r < grid->side; ++r) {
+            if (r == first_row || r == last_row) {
+                for (int c = first_column > 0 ? first_column : 0; c <= last_column && c < grid->side; ++c) {
+                    search_cell(grid, r * grid->side + c, p, centroids, &closest_cluster, min_distance, distances);
+                }
+            }
+            else {
+                if (first_column >= 0) {
+                    search_cell(grid, r * grid->side + first_column, p, centroids, &closest_cluster, min_distance, distances);
+                }
+                if (last_column < grid->side) {
+                    search_cell(grid, r * grid->side + last_column, p, centroids, &closest_cluster, min_distance, distances);
+                }
+            }
+        }
+        // every centroid not searched yet is outside the square of cells searched so far: stop
+        // if the closest one found is nearer than each side of the square that is not at the
+        // edge of the grid (there are no centroids beyond those)
+        double bound = DBL_MAX;
+        if (first_column > 0) {
+            double distance = p->x - (grid->min_x + first_column * grid->cell_width);
+            bound = distance < bound ? distance : bound;
+        }
+        if (last_column < grid->side - 1) {
+            double distance = grid->min_x + (last_column + 1) * grid->cell_width - p->x;
+            bound = distance < bound ? distance : bound;
+        }
+        if (first_row > 0) {
+            double distance = p->y - (grid->min_y + first_row * grid->cell_height);
+            bound = distance < bound ? distance : bound;
+        }
+        if (last_row < grid->side - 1) {
+            double distance = grid->min_y + (last_row + 1) * grid->cell_height - p->y;
+            bound = distance < bound ? distance : bound;
+        }
+        if (bound == DBL_MAX || *min_distance < bound - GRID_BOUND_SLACK * (fabs(bound) + 1.0)) {
+            break;
+        }
+    }
+    return closest_cluster;
+}
+
+/**
+ * Assigns each point in the dataset to a cluster based on the distance from that cluster.
+ *
+ * The return value indicates how many points were assigned to a _different_ cluster
+ * in this assignment process: this indicates how close the algorithm is to completion.
+ * When the return value is zero, no points changed cluster so the clustering is complete.
+ *
+ * The time to build the grid and to search it are added to the engine stats.
+ *
+ * @param dataset set of all points with current cluster assignments
+ * @param num_points number of points in the dataset
+ * @param centroids array that holds the current centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @return the number of points for which the cluster assignment was changed
+ */
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+#ifdef DEBUG
+    printf("\nStarting assignment phase:\n");
+#endif
+    double start_build = omp_get_wtime();
+    struct centroid_grid grid;
+    build_grid(&grid, centroids, num_clusters);
+    double start_query = omp_get_wtime();
+    engine_stats.index_build_seconds += start_query - start_build;
+
+    size_t cluster_changes = 0;
+    long distances = 0;
+#pragma omp parallel for schedule(runtime) reduction(+:cluster_changes, distances)
+    for (size_t n = 0; n < num_points; ++n) {
+        double min_distance;
+        int closest_cluster = nearest_cluster(&grid, &dataset[n], centroids, num_clusters, &min_distance, &distances);
+        // if the point was not already in the closest cluster, move it there and count changes
+        if (dataset[n].cluster != closest_cluster) {
+            dataset[n].cluster = closest_cluster;
+            cluster_changes++;
+#ifdef TRACE
+            debug_assignment(&dataset[n], closest_cluster, &centroids[closest_cluster], min_distance);
+#endif
+        }
+    }
+    engine_stats.index_query_seconds += omp_get_wtime() - start_query;
+    engine_stats.distance_calculations += distances;
+    return cluster_changes;
+}
+
+/**
+ * Calculates new centroids for the clusters of the given dataset by finding the
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
+ *
+ * The centroids are set in the array passed in, which is expected to be pre-allocated
+ * and contain the previous centroids: these are overwritten by the new values.
+ *
+ * @param dataset set of all points with current cluster assigments
+ * @param num_points number of points in the dataset
+ * @param centroids array to hold the centroids - already allocated
+ * @param num_clusters number of clusters - hence size of the centroids array
+ */
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    double *partials = workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
+#pragma omp parallel
+    {
+        int team = omp_get_num_threads();
+        double *partial = &partials[omp_get_thread_num() * 3 * stride];
+        for (int i = 0; i < 3 * stride; ++i) {
+            partial[i] = 0.0;
+        }
+#pragma omp for schedule(runtime)
+        for (size_t n = 0; n < num_points; ++n) {
+            int k = dataset[n].cluster;
+            partial[k] += dataset[n].weight * dataset[n].x;
+            partial[stride + k] += dataset[n].weight * dataset[n].y;
+            partial[2 * stride + k] += dataset[n].weight;
+        }
+
+        // the new centroids are at the mean x and y coords of the clusters
+#pragma omp for schedule(static)
+        for (int k = 0; k < num_clusters; ++k) {
+            double sum_x = 0.0, sum_y = 0.0, weight = 0.0;
+            for (int t = 0; t < team; ++t) {
+                sum_x += partials[t * 3 * stride + k];
+                sum_y += partials[t * 3 * stride + stride + k];
+                weight += partials[t * 3 * stride + 2 * stride + k];
+            }
+            struct point new_centroid;
+            // mean x, mean y => new centroid
+            new_centroid.x = sum_x / weight;
+            new_centroid.y = sum_y / weight;
+            centroids[k] = new_centroid;
+        }
+    }
+}
+
+/**
+ * Sizes the workspace for a run: the grid and the per-thread partial sums.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    (void)num_points; // the scratch space depends on the clusters only
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    workspace_buffer(WORKSPACE_INDEX, grid_ints(num_clusters) * sizeof(int));
+    workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
+}
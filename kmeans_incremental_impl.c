@@ -0,0 +1,261 @@
+#include <float.h>
+#include <stdint.h>
+#include <math.h>
+#include "kmeans.h"
+
+/**
+ * Incremental centroids version:
+ * - running sums of x, y and the point count are kept per cluster between iterations
+ * - assign_clusters records every point that changed cluster (and the cluster it left) in a
+ *   change buffer in the workspace, which each thread claims in batches
+ * - calculate_centroids then only subtracts those points from their old cluster and adds them
+ *   to the new one, so once few points move the update costs O(changes) instead of O(n)
+ * - the sums are rebuilt from scratch every FULL_RECOMPUTE_INTERVAL iterations, and whenever
+ *   so many points changed that a full pass is cheaper, to bound the floating point drift
+ * - the running sums and the iterations since the last rebuild are saved in checkpoints, so a
+ *   resumed run applies the same deltas to the same sums as one that was never stopped
+ */
+
+// rebuild the running sums from all points at least this often
+#define FULL_RECOMPUTE_INTERVAL 16
+// rebuild instead of applying deltas when more than 1 in this many points changed
+#define FULL_RECOMPUTE_FRACTION 4
+// changes claimed by a thread at a time: a thread leaves less than this unused at the end
+#define CHANGE_BATCH 64
+// pad each thread's partial sums to whole cache lines to avoid false sharing
+#define DOUBLES_PER_CACHE_LINE 8
+
+struct change {
+    int64_t point;   // index in the dataset
+    int old_cluster; // -1 if the point was not in a cluster yet
+    int new_cluster;
+};
+
+// running sums (x, then y, then weights) in the workspace, valid for the dataset they were computed from
+// (or for whatever dataset comes next if NULL: the sums were restored from a checkpoint)
+static double *sums = NULL;
+static int sums_clusters = 0;
+static struct point *sums_dataset = NULL;
+static size_t sums_points = 0;
+static int iterations_since_full = 0;
+
+// filled by assign_clusters and consumed by calculate_centroids: changes[0 .. changes_used - 1],
+// with point -1 in the unused ends of the batches
+static struct change *changes = NULL;
+static size_t changes_used = 0;
+static size_t changes_count = 0;
+static bool changes_pending = false;
+static bool changes_lost = false; // assigned twice without calculating: only a full recompute is right
+// per thread, like the workspace, and only used outside the parallel regions
+#pragma omp threadprivate(sums, sums_clusters, sums_dataset, sums_points, iterations_since_full, \
+                          changes, changes_used, changes_count, changes_pending, changes_lost)
+
+static inline int partial_stride(int num_clusters)
+{
+    return (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+}
+
+static inline size_t changes_capacity(size_t num_points)
+{
+    return num_points + (size_t)omp_get_max_threads() * CHANGE_BATCH;
+}
+
+/**
+ * Assigns each point in the dataset to a cluster based on the distance from that cluster.
+ *
+ * The return value indicates how many points were assigned to a _different_ cluster
+ * in this assignment process: this indicates how close the algorithm is to completion.
+ * When the return value is zero, no points changed cluster so the clustering is complete.
+ *
+ * Every change is also recorded for the next call to calculate_centroids.
+ *
+ * @param dataset set of all points with current cluster assignments
+ * @param num_points number of points in the dataset
+ * @param centroids array that holds the current centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @return the number of points for which the cluster assignment was changed
+ */
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+#ifdef DEBUG
+    printf("\nStarting assignment phase:\n");
+#endif
+    struct change *slots = workspace_buffer(WORKSPACE_CHANGES, changes_capacity(num_points) * sizeof(struct change));
+    changes = slots;
+    if (changes_pending) {
+        changes_lost = true; // the changes of the last assignment were never applied to the sums
+    }
+    size_t used = 0;
+
+    size_t cluster_changes = 0;
+#pragma omp parallel reduction(+:cluster_changes)
+    {
+        // this thread's current batch of change slots
+        size_t next = 0;
+        size_t batch_end = 0;
+#pragma omp for schedule(runtime) nowait
+        for (size_t n = 0; n < num_points; ++n) {
+            double min_distance = DBL_MAX; // init the min distance to a big number
+            int closest_cluster = -1;
+            for (int k = 0; k < num_clusters; ++k) {
+                // calc the distance passing pointers to points since the distance does not modify them
+                double distance_from_centroid = euclidean_distance(&dataset[n], &centroids[k]);
+                if (distance_from_centroid < min_distance) {
+                    min_distance = distance_from_centroid;
+                    closest_cluster = k;
+                }
+            }
+            // if the point was not already in the closest cluster, move it there and record the change
+            if (dataset[n].cluster != closest_cluster) {
+                if (next == batch_end) {
+#pragma omp atomic capture
+                    { next = used; used += CHANGE_BATCH; }
+                    batch_end = next + CHANGE_BATCH;
+                }
+                slots[next].point = (int64_t)n;
+                slots[next].old_cluster = dataset[n].cluster;
+                slots[next].new_cluster = closest_cluster;
+                next++;
+                dataset[n].cluster = closest_cluster;
+                cluster_changes++;
+#ifdef TRACE
+                debug_assignment(&dataset[n], closest_cluster, &centroids[closest_cluster], min_distance);
+#endif
+            }
+        }
+        for (; next < batch_end; ++next) {
+            slots[next].point = -1;
+        }
+    }
+    changes_used = used;
+    changes_count = cluster_changes;
+    changes_pending = true;
+    return cluster_changes;
+}
+
+/**
+ * Rebuild the running sums from every point in the dataset, with per-thread partial sums
+ */
+static void recompute_sums(struct point* dataset, size_t num_points, int num_clusters)
+{
+    int stride = partial_stride(num_clusters);
+    double *partials = workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
+    double *running_sums = sums;
+#pragma omp parallel
+    {
+        int team = omp_get_num_threads();
+        double *partial = &partials[omp_get_thread_num() * 3 * stride];
+        for (int i = 0; i < 3 * stride; ++i) {
+            partial[i] = 0.0;
+        }
+#pragma omp for schedule(runtime)
+        for (size_t n = 0; n < num_points; ++n) {
+            int k = dataset[n].cluster;
+            partial[k] += dataset[n].weight * dataset[n].x;
+            partial[stride + k] += dataset[n].weight * dataset[n].y;
+            partial[2 * stride + k] += dataset[n].weight;
+        }
+#pragma omp for schedule(static)
+        for (int k = 0; k < num_clusters; ++k) {
+            double sum_x = 0.0, sum_y = 0.0, weight = 0.0;
+            for (int t = 0; t < team; ++t) {
+                sum_x += partials[t * 3 * stride + k];
+                sum_y += partials[t * 3 * stride + stride + k];
+                weight += partials[t * 3 * stride + 2 * stride + k];
+            }
+            running_sums[k] = sum_x;
+            running_sums[num_clusters + k] = sum_y;
+            running_sums[2 * num_clusters + k] = weight;
+        }
+    }
+    sums_clusters = num_clusters;
+    sums_dataset = dataset;
+    sums_points = num_points;
+    iterations_since_full = 0;
+    engine_stats.full_recomputes++;
+}
+
+/**
+ * Calculates new centroids for the clusters of the given dataset by finding the
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
+ *
+ * The centroids are set in the array passed in, which is expected to be pre-allocated
+ * and contain the previous centroids: these are overwritten by the new values.
+ *
+ * Only the points recorded as changed by the last assign_clusters are applied to the
+ * running sums, unless it is time for a full recompute.
+ *
+ * @param dataset set of all points with current cluster assigments
+ * @param num_points number of points in the dataset
+ * @param centroids array to hold the centroids - already allocated
+ * @param num_clusters number of clusters - hence size of the centroids array
+ */
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    double *sums_buffer = workspace_buffer(WORKSPACE_SUMS, 3 * num_clusters * sizeof(double));
+    bool full = !changes_pending || changes_lost || sums_buffer != sums
+            || (sums_dataset && sums_dataset != dataset) || sums_points != num_points || sums_clusters != num_clusters
+            || iterations_since_full >= FULL_RECOMPUTE_INTERVAL
+            || changes_count > num_points / FULL_RECOMPUTE_FRACTION;
+    sums = sums_buffer;
+    sums_dataset = dataset;
+    double *sum_x = sums;
+    double *sum_y = &sums[num_clusters];
+    double *count = &sums[2 * num_clusters];
+    if (full) {
+        recompute_sums(dataset, num_points, num_clusters);
+    }
+    else {
+        // move each changed point from its old cluster to its new one
+        for (size_t i = 0; i < changes_used; ++i) {
+            if (changes[i].point < 0) {
+                continue; // unused end of a batch
+            }
+            struct point *p = &dataset[changes[i].point];
+            int old_cluster = changes[i].old_cluster;
+            int new_cluster = changes[i].new_cluster;
+            if (old_cluster >= 0) {
+                sum_x[old_cluster] -= p->weight * p->x;
+                sum_y[old_cluster] -= p->weight * p->y;
+                count[old_cluster] -= p->weight;
+            }
+            sum_x[new_cluster] += p->weight * p->x;
+            sum_y[new_cluster] += p->weight * p->y;
+            count[new_cluster] += p->weight;
+        }
+        iterations_since_full++;
+    }
+    changes_pending = false;
+    changes_lost = false;
+
+    // the new centroids are at the mean x and y coords of the clusters
+    for (int k = 0; k < num_clusters; ++k) {
+        struct point new_centroid;
+        // mean x, mean y => new centroid
+        new_centroid.x = sum_x[k] / count[k];
+        new_centroid.y = sum_y[k] / count[k];
+        centroids[k] = new_centroid;
+    }
+}
+
+/**
+ * Sizes the workspace for a run: the change buffer, the running sums and the per-thread
+ * partial sums of a full recompute. The sums of an earlier run are no longer valid, unless
+ * they are restored from a checkpoint: they are registered as the state of the run.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    workspace_buffer(WORKSPACE_CHANGES, changes_capacity(num_points) * sizeof(struct change));
+    sums = workspace_buffer(WORKSPACE_SUMS, 3 * num_clusters * sizeof(double));
+    workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * partial_stride(num_clusters) * sizeof(double));
+    sums_clusters = 0;
+    sums_dataset = NULL;
+    checkpoint_state(sums, 3 * num_clusters * sizeof(double));
+    checkpoint_state(&sums_clusters, sizeof(sums_clusters));
+    checkpoint_state(&sums_points, sizeof(sums_points));
+    checkpoint_state(&iterations_since_full, sizeof(iterations_since_full));
+}
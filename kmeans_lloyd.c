@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Runs the Lloyd iterations (assign, then recalculate centroids) until no point changes
+ * cluster or the maximum number of iterations is reached.
+ *
+ * This is the default loop used by the engines that only provide assign_clusters and
+ * calculate_centroids: every call into the engine opens and closes its own parallel regions.
+ * Engines that want to keep a single thread team for the whole run (see kmeans_omp3_impl.c)
+ * provide their own run_lloyd instead and are linked without this file.
+ *
+ * With --checkpoint the loop hands a snapshot to the checkpoint writer after the iterations
+ * it asks for, and with --resume it starts from the iteration of the checkpoint file. After
+ * every iteration it publishes its progress for the reporter of kmeans_progress.c.
+ *
+ * @param dataset set of all points, cluster assignments are updated in place
+ * @param num_points number of points in the dataset
+ * @param centroids array that holds the initial centroids, overwritten with the final ones
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @param max_iterations stop after this many iterations even if points are still changing
+ * @param metrics timing metrics are accumulated here, including the used iterations
+ * @return the number of points that changed cluster in the last iteration (zero if converged)
+ */
+size_t run_lloyd(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                 int max_iterations, struct kmeans_metrics *metrics)
+{
+    size_t cluster_changes = num_points;
+    int iterations = checkpoint_resume(dataset, num_points, centroids, num_clusters, &cluster_changes, metrics);
+
+    while (cluster_changes > 0 && iterations < max_iterations) {
+        // K-Means Algo Step 2: assign every point to a cluster (closest centroid)
+        double start_iteration = omp_get_wtime();
+        double start_assignment = start_iteration;
+        cluster_changes = assign_clusters(dataset, num_points, centroids, num_clusters);
+        double assignment_seconds = omp_get_wtime() - start_assignment;
+
+        metrics->assignment_seconds += assignment_seconds;
+
+#ifdef DEBUG
+        printf("\n%zu clusters changed after assignment phase. New assignments:\n", cluster_changes);
+        print_points(stdout, dataset, num_points);
+        printf("Time taken: %.3f seconds total in assignment so far: %.3f seconds",
+               assignment_seconds, metrics->assignment_seconds);
+#endif
+        // K-Means Algo Step 3: calculate new centroids: one at the center of each cluster
+        double start_centroids = omp_get_wtime();
+        calculate_centroids(dataset, num_points, centroids, num_clusters);
+        double centroids_seconds = omp_get_wtime() - start_centroids;
+        metrics->centroids_seconds += centroids_seconds;
+
+#ifdef TRACE
+        printf("New centroids calculated New assignments:\n");
+        print_centroids(stdout, centroids, num_clusters);
+        printf("Time taken: %.3f seconds total in centroid calculation so far: %.3f seconds",
+               centroids_seconds, metrics->centroids_seconds);
+#endif
+#ifndef SKIP_MAX_ITERATION_CALC
+        // potentially costly calculation may skew stats, hence only in ifdef
+        double iteration_seconds = omp_get_wtime() - start_iteration;
+        if (iteration_seconds > metrics->max_iteration_seconds) {
+            metrics->max_iteration_seconds = iteration_seconds;
+        }
+#endif
+        if (autotune_active()) {
+            // --autotune: the next iteration may run with other threads and schedule
+            autotune_iteration(omp_get_wtime() - start_iteration, metrics);
+        }
+        iterations++;
+        checkpoint_iteration(dataset, num_points, centroids, num_clusters, iterations, cluster_changes, metrics);
+        progress_iteration(dataset, num_points, centroids, num_clusters, iterations, cluster_changes, metrics);
+    }
+    metrics->used_iterations = iterations;
+    return cluster_changes;
+}
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Microbenchmarks of the kernels of an engine, outside of any clustering run: the main loop
+ * only times whole iterations, which hides what each kernel costs and how close it gets to the
+ * memory bandwidth of the machine.
+ *
+ * `make microbench` links this main with each engine in turn, as bin/microbench_<engine>, and
+ * runs them all. Each times euclidean_distance (over every point and centroid),
+ * assign_clusters and calculate_centroids of its engine for every combination of
+ *   - points: a set that fits in the L2 cache of most cores, and one far bigger than any cache
+ *   - clusters: CLUSTER_COUNTS
+ *   - layout: the generated order (clusters interleaved) or sorted along a Hilbert curve
+ *   - threads: the max threads and every halving of it, as --autotune tries
+ * on synthetic blobs from generate_points, and compares the bandwidth reached with a
+ * STREAM-style triad run with the same number of threads.
+ *
+ * Every result is printed and appended as a csv row to the results file (microbench.csv or
+ * the first argument), with ns per point per centroid so that different n and k compare.
+ * Kernels run as the engine runs them in the loop, so engines that keep state between calls
+ * (kmeans_incremental) show the cost of a converged iteration after the first call.
+ */
+
+// each measurement repeats the kernel until it has run for at least this long
+#define MIN_SECONDS 0.1
+// 256 KB of points: in cache, to see the compute cost of a kernel
+#define IN_CACHE_POINTS 8192
+// 128 MB of points: out of cache, to see how a kernel copes with memory bandwidth
+#define OUT_OF_CACHE_POINTS (4 << 20)
+// doubles in each of the three arrays of the triad: 3 x 32 MB
+#define STREAM_ELEMENTS (4 << 20)
+
+static const int CLUSTER_COUNTS[] = {4, 16, 64};
+#define NUM_CLUSTER_COUNTS (sizeof(CLUSTER_COUNTS) / sizeof(CLUSTER_COUNTS[0]))
+
+struct bench {
+    struct point *points;
+    size_t num_points;
+    struct point *centroids;
+    int num_clusters;
+};
+
+// keeps the compiler from dropping the distance loop
+static volatile double distance_sink;
+
+static void run_distance(struct bench *b)
+{
+    double sum = 0;
+#pragma omp parallel for schedule(static) reduction(+:sum)
+    for (size_t n = 0; n < b->num_points; ++n) {
+        for (int k = 0; k < b->num_clusters; ++k) {
+            sum += euclidean_distance(&b->points[n], &b->centroids[k]);
+        }
+    }
+    distance_sink = sum;
+}
+
+static void run_assign(struct bench *b)
+{
+    assign_clusters(b->points, b->num_points, b->centroids, b->num_clusters);
+}
+
+static void run_centroids(struct bench *b)
+{
+    calculate_centroids(b->points, b->num_points, b->centroids, b->num_clusters);
+}
+
+struct kernel {
+    const char *name;
+    void (*run)(struct bench *);
+};
+
+static const struct kernel KERNELS[] = {
+        {"euclidean_distance", run_distance},
+        {"assign_clusters", run_assign},
+        {"calculate_centroids", run_centroids},
+};
+#define NUM_KERNELS (sizeof(KERNELS) / sizeof(KERNELS[0]))
+
+/**
+ * Run the kernel until MIN_SECONDS have passed, after one untimed call to warm up
+ *
+ * @return mean seconds per call
+ */
+static double time_kernel(const struct kernel *kernel, struct bench *b, long *calls)
+{
+    kernel->run(b);
+    double start = omp_get_wtime();
+    double elapsed;
+    *calls = 0;
+    do {
+        kernel->run(b);
+        (*calls)++;
+        elapsed = omp_get_wtime() - start;
+    } while (elapsed < MIN_SECONDS);
+    return elapsed / *calls;
+}
+
+/**
+ * Memory bandwidth in GB/s of a STREAM triad (a = b + s * c) with the current threads,
+ * counting 24 bytes per element as STREAM does. The best of a few runs.
+ */
+static double stream_triad(double *a, double *b, double *c)
+{
+    double best = 0;
+    for (int run = 0; run < 5; ++run) {
+        double start = omp_get_wtime();
+#pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < STREAM_ELEMENTS; ++i) {
+            a[i] = b[i] + 3.0 * c[i];
+        }
+        double seconds = omp_get_wtime() - start;
+        double rate = 3.0 * sizeof(double) * STREAM_ELEMENTS / seconds / 1e9;
+        best = rate > best ? rate : best;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    char *results_file_name = argc > 1 ? argv[1] : "microbench.csv";
+    char *slash = strrchr(argv[0], '/');
+    char *engine = slash ? slash + 1 : argv[0];
+    if (strncmp(engine, "microbench_", 11) == 0) {
+        engine += 11;
+    }
+
+    bool first_time = access(results_file_name, F_OK) == -1;
+    FILE *results = fopen(results_file_name, "a");
+    if (!results) {
+        fprintf(stderr, "Error: cannot write to the results file at %s\n", results_file_name);
+        exit(1);
+    }
+    if (first_time) {
+        fprintf(results, "engine,kernel,layout,num_points,num_clusters,threads,calls,seconds_per_call,"
+                         "ns_per_point_centroid,gb_per_second,stream_gb_per_second\n");
+    }
+
+    double *stream_a = malloc(STREAM_ELEMENTS * sizeof(double));
+    double *stream_b = malloc(STREAM_ELEMENTS * sizeof(double));
+    double *stream_c = malloc(STREAM_ELEMENTS * sizeof(double));
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < STREAM_ELEMENTS; ++i) {
+        stream_a[i] = 0.0;
+        stream_b[i] = 1.0;
+        stream_c[i] = 2.0;
+    }
+
+    int max_threads = omp_get_max_threads();
+    const size_t sizes[] = {IN_CACHE_POINTS, OUT_OF_CACHE_POINTS};
+    printf("%-14s %-20s %-8s %9s %4s %7s %14s %12s %10s %10s\n", "engine", "kernel", "layout", "points",
+           "k", "threads", "seconds/call", "ns/pt/cent", "GB/s", "stream");
+    for (size_t s = 0; s < 2; ++s) {
+        size_t num_points = sizes[s];
+        struct point *points = malloc(num_points * sizeof(struct point));
+        for (int layout = 0; layout < 2; ++layout) {
+            for (size_t c = 0; c < NUM_CLUSTER_COUNTS; ++c) {
+                int num_clusters = CLUSTER_COUNTS[c];
+                struct kmeans_config config = new_config();
+                config.generate = "blobs";
+                config.num_clusters = num_clusters;
+                generate_points(&config, points, num_points);
+                // the same centroids for both layouts: one in each blob
+                struct point *initial_centroids = malloc(num_clusters * sizeof(struct point));
+                struct point *centroids = malloc(num_clusters * sizeof(struct point));
+                for (int k = 0; k < num_clusters; ++k) {
+                    initial_centroids[k] = points[k];
+                }
+                if (layout == 1) {
+                    free(hilbert_reorder(points, num_points));
+                }
+                for (int threads = max_threads; threads >= 1; threads /= 2) {
+                    omp_set_num_threads(threads);
+                    double stream = stream_triad(stream_a, stream_b, stream_c);
+                    for (size_t kn = 0; kn < NUM_KERNELS; ++kn) {
+                        // every kernel starts from the same points and centroids
+                        memcpy(centroids, initial_centroids, num_clusters * sizeof(struct point));
+                        for (size_t n = 0; n < num_points; ++n) {
+                            points[n].cluster = -1;
+                        }
+                        reserve_workspace(num_points, num_clusters);
+                        assign_clusters(points, num_points, centroids, num_clusters);
+
+                        struct bench b = {points, num_points, centroids, num_clusters};
+                        long calls;
+                        double seconds = time_kernel(&KERNELS[kn], &b, &calls);
+                        double ns_per_pair = seconds * 1e9 / ((double)num_points * num_clusters);
+                        double gb_per_second = num_points * sizeof(struct point) / seconds / 1e9;
+                        const char *layout_name = layout == 1 ? "hilbert" : "generated";
+                        printf("%-14s %-20s %-8s %9zu %4d %7d %14.9f %12.4f %10.2f %10.2f\n", engine,
+                               KERNELS[kn].name, layout_name, num_points, num_clusters, threads, seconds,
+                               ns_per_pair, gb_per_second, stream);
+                        fprintf(results, "%s,%s,%s,%zu,%d,%d,%ld,%.9f,%.4f,%.2f,%.2f\n", engine, KERNELS[kn].name,
+                                layout_name, num_points, num_clusters, threads, calls, seconds, ns_per_pair,
+                                gb_per_second, stream);
+                    }
+                }
+                omp_set_num_threads(max_threads);
+                free(initial_centroids);
+                free(centroids);
+                workspace_free();
+            }
+        }
+        free(points);
+    }
+    fclose(results);
+    free(stream_a);
+    free(stream_b);
+    free(stream_c);
+    return 0;
+}
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <omp.h>
+#include "csvhelper.h"
+#include "kmeans.h"
+
+/**
+ * Fitted models: the final centroids of a run saved to a compact binary file, which can be
+ * used to warm-start another run or to label new points without clustering them (predict).
+ *
+ * File layout (native byte order): the 8 byte MODEL_MAGIC, the number of clusters and the
+ * number of dimensions as 32 bit ints, then x and y of every centroid as doubles. A model
+ * fitted with --geo has its centroids in degrees, followed by MODEL_GEO_MAGIC and the
+ * longitude and latitude of the centre of the projection it was fitted in, so predict can
+ * project the points exactly as the fit did. Readers that don't know about it stop before it.
+ */
+
+#define MODEL_MAGIC "KMMODEL1"
+#define MODEL_GEO_MAGIC "KMGEOPRJ"
+#define MODEL_DIMENSIONS 2
+// points read, labelled and written in one go when predicting
+#define PREDICT_BATCH_POINTS 65536
+// points handed to the nearest centroid kernel in one call: its scratch lives on the stack
+#define PREDICT_BLOCK_POINTS 256
+
+/**
+ * Write the centroids to a model file, silently overwriting it if it exists.
+ *
+ * @param model_file_name path of the model file
+ * @param centroids final centroids of the run
+ * @param num_clusters number of centroids
+ * @param projection the --geo projection the centroids were fitted in, NULL for none
+ */
+void save_model(char *model_file_name, struct point *centroids, int num_clusters,
+                struct geo_projection *projection)
+{
+    FILE *model_file = fopen(model_file_name, "wb");
+    if (!model_file) {
+        fprintf(stderr, "Error: cannot write to the model file at %s\n", model_file_name);
+        exit(1);
+    }
+    int dimensions = MODEL_DIMENSIONS;
+    fwrite(MODEL_MAGIC, 1, strlen(MODEL_MAGIC), model_file);
+    fwrite(&num_clusters, sizeof(int), 1, model_file);
+    fwrite(&dimensions, sizeof(int), 1, model_file);
+    for (int k = 0; k < num_clusters; ++k) {
+        fwrite(&centroids[k].x, sizeof(double), 1, model_file);
+        fwrite(&centroids[k].y, sizeof(double), 1, model_file);
+    }
+    if (projection) {
+        fwrite(MODEL_GEO_MAGIC, 1, strlen(MODEL_GEO_MAGIC), model_file);
+        fwrite(&projection->lon0, sizeof(double), 1, model_file);
+        fwrite(&projection->lat0, sizeof(double), 1, model_file);
+    }
+    fclose(model_file);
+}
+
+/**
+ * Read the centroids from a model file written by save_model.
+ *
+ * @param model_file_name path of the model file
+ * @param num_clusters set to the number of centroids in the model
+ * @return allocated array of the centroids
+ */
+struct point *load_model(char *model_file_name, int *num_clusters)
+{
+    FILE *model_file = fopen(model_file_name, "rb");
+    if (!model_file) {
+        fprintf(stderr, "Error: cannot read the model file at %s\n", model_file_name);
+        exit(1);
+    }
+    char magic[sizeof(MODEL_MAGIC)] = {0};
+    int dimensions = 0;
+    if (fread(magic, 1, strlen(MODEL_MAGIC), model_file) != strlen(MODEL_MAGIC)
+        || strcmp(magic, MODEL_MAGIC) != 0
+        || fread(num_clusters, sizeof(int), 1, model_file) != 1
+        || fread(&dimensions, sizeof(int), 1, model_file) != 1
+        || dimensions != MODEL_DIMENSIONS || *num_clusters <= 0) {
+        fprintf(stderr, "Error: %s is not a %d-dimensional k-means model file\n", model_file_name, MODEL_DIMENSIONS);
+        exit(1);
+    }
+    struct point *centroids = malloc(*num_clusters * sizeof(struct point));
+    for (int k = 0; k < *num_clusters; ++k) {
+        centroids[k].cluster = k;
+        if (fread(&centroids[k].x, sizeof(double), 1, model_file) != 1
+            || fread(&centroids[k].y, sizeof(double), 1, model_file) != 1) {
+            fprintf(stderr, "Error: model file %s is truncated after %d centroids\n", model_file_name, k);
+            exit(1);
+        }
+    }
+    fclose(model_file);
+    return centroids;
+}
+
+/**
+ * Read the projection a model was fitted in, if it was fitted with --geo.
+ *
+ * @param model_file_name path of the model file, already checked by load_model
+ * @param projection set to the projection of the fit, if there is one
+ * @return true if the model has a projection
+ */
+bool load_model_projection(char *model_file_name, struct geo_projection *projection)
+{
+    FILE *model_file = fopen(model_file_name, "rb");
+    if (!model_file) {
+        fprintf(stderr, "Error: cannot read the model file at %s\n", model_file_name);
+        exit(1);
+    }
+    int num_clusters = 0;
+    char magic[sizeof(MODEL_GEO_MAGIC)] = {0};
+    double lon0, lat0;
+    bool found = fseek(model_file, strlen(MODEL_MAGIC), SEEK_SET) == 0
+            && fread(&num_clusters, sizeof(int), 1, model_file) == 1
+            && fseek(model_file, sizeof(int) + num_clusters * MODEL_DIMENSIONS * sizeof(double), SEEK_CUR) == 0
+            && fread(magic, 1, strlen(MODEL_GEO_MAGIC), model_file) == strlen(MODEL_GEO_MAGIC)
+            && strcmp(magic, MODEL_GEO_MAGIC) == 0
+            && fread(&lon0, sizeof(double), 1, model_file) == 1
+            && fread(&lat0, sizeof(double), 1, model_file) == 1;
+    fclose(model_file);
+    if (found) {
+        *projection = geo_projection_at(lon0, lat0);
+    }
+    return found;
+}
+
+/**
+ * Write the tree of cluster splits to a csv file, one row per node, silently overwriting it if
+ * it exists. The clusters for any k up to the number of leaves can be read off it: they are the
+ * nodes with created < k whose split is 0 or at least k.
+ *
+ * @param hierarchy_file_name path of the file
+ * @param hierarchy tree built by the engine
+ */
+void save_hierarchy(char *hierarchy_file_name, struct cluster_hierarchy *hierarchy)
+{
+    FILE *hierarchy_file = fopen(hierarchy_file_name, "w");
+    if (!hierarchy_file) {
+        fprintf(stderr, "Error: cannot write to the hierarchy file at %s\n", hierarchy_file_name);
+        exit(1);
+    }
+    fprintf(hierarchy_file, "node,parent,created,split,cluster,weight,sse,x,y\n");
+    for (int i = 0; i < hierarchy->num_nodes; ++i) {
+        struct hierarchy_node *node = &hierarchy->nodes[i];
+        fprintf(hierarchy_file, "%d,%d,%d,%d,%d,%.17g,%.17g,%s\n", i, node->parent, node->created, node->split,
+                node->cluster, node->weight, node->sse, p_to_s(&node->centroid));
+    }
+    fclose(hierarchy_file);
+}
+
+/**
+ * Nearest centroid of each of a block of points, vectorized over the points.
+ *
+ * The points and centroids are in separate x and y arrays so the compiler can run the inner
+ * loop over several points at once. Squared distances are compared: the square root does not
+ * change which centroid is closest.
+ */
+static void nearest_centroids(const double *x, const double *y, int *labels, int count,
+                              const double *centroid_x, const double *centroid_y, int num_clusters)
+{
+    double min_distance[PREDICT_BLOCK_POINTS];
+    for (int i = 0; i < count; ++i) {
+        min_distance[i] = DBL_MAX;
+        labels[i] = -1;
+    }
+    for (int k = 0; k < num_clusters; ++k) {
+        double cx = centroid_x[k];
+        double cy = centroid_y[k];
+#pragma omp simd
+        for (int i = 0; i < count; ++i) {
+            double dx = x[i] - cx;
+            double dy = y[i] - cy;
+            double distance = dx * dx + dy * dy;
+            if (distance < min_distance[i]) {
+                min_distance[i] = distance;
+                labels[i] = k;
+            }
+        }
+    }
+}
+
+/**
+ * Read up to max_points points from the csv file into separate x and y arrays
+ *
+ * @return number of points read: fewer than max_points only at the end of the file
+ */
+static int read_batch(FILE *csv_file, double *x, double *y, int max_points)
+{
+    int count = 0;
+    char *line;
+    while (count < max_points && (line = csvgetline(csv_file)) != NULL) {
+        if (csvnfield() < 2) {
+            printf("Warning: found non-empty trailing line. Will stop reading points now: %s", line);
+            break;
+        }
+        x[count] = strtod(csvfield(0), NULL);
+        y[count] = strtod(csvfield(1), NULL);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Label the points of the input file (-f) with the nearest centroid of the model and write
+ * them to the output file (-o) if there is one, in the same format as a clustering run.
+ *
+ * The file is streamed in batches, so it can be much larger than memory: each batch is read,
+ * labelled in parallel by the vectorized kernel, then written.
+ *
+ * A model fitted with --geo has its projection, and the centroids and each batch are then
+ * projected to km with it, with or without --geo: the nearest centroid in km is not always the
+ * nearest in degrees. With --geo and a model without one, the projection is around the mean of
+ * its centroids instead, which is close but may label points near a boundary differently.
+ *
+ * @param config run configuration with the model to use in predict_model
+ * @param metrics set with the number of points, the time in the kernel (assignment_seconds)
+ *                and the total time
+ */
+void predict_file(struct kmeans_config *config, struct kmeans_metrics *metrics)
+{
+    int num_clusters;
+    struct point *centroids = load_model(config->predict_model, &num_clusters);
+    struct geo_projection projection;
+    bool geo = load_model_projection(config->predict_model, &projection);
+    if (geo && !config->geo && !config->quiet) {
+        printf("The model was fitted with --geo: predicting in its projection\n");
+    }
+    if (!geo && config->geo) {
+        if (!config->quiet) {
+            printf("The model has no projection from a --geo fit: projecting around its centroids\n");
+        }
+        for (int k = 0; k < num_clusters; ++k) {
+            centroids[k].weight = 1;
+        }
+        projection = geo_projection_around(centroids, num_clusters);
+        geo = true;
+    }
+    if (geo) {
+        geo_project(&projection, centroids, num_clusters);
+    }
+    double *centroid_x = malloc(num_clusters * sizeof(double));
+    double *centroid_y = malloc(num_clusters * sizeof(double));
+    for (int k = 0; k < num_clusters; ++k) {
+        centroid_x[k] = centroids[k].x;
+        centroid_y[k] = centroids[k].y;
+    }
+
+    char *csv_file_name = valid_file('f', config->in_file);
+    FILE *csv_file = fopen(csv_file_name, "r");
+    if (!csv_file) {
+        fprintf(stderr, "Error: cannot read the input file at %s\n", csv_file_name);
+        exit(1);
+    }
+    FILE *out_file = NULL;
+    if (config->out_file) {
+        out_file = fopen(config->out_file, "w");
+        if (!out_file) {
+            fprintf(stderr, "Error: cannot write to the output file at %s\n", config->out_file);
+            exit(1);
+        }
+    }
+
+    double start_time = omp_get_wtime();
+    char *headers[3];
+    int dimensions = csvheaders(csv_file, headers);
+    if (out_file) {
+        print_headers(out_file, headers, dimensions > 2 ? 2 : dimensions);
+    }
+
+    double *x = malloc(PREDICT_BATCH_POINTS * sizeof(double));
+    double *y = malloc(PREDICT_BATCH_POINTS * sizeof(double));
+    int *labels = malloc(PREDICT_BATCH_POINTS * sizeof(int));
+    // the kernel works on the projected points, and the output keeps the degrees
+    double *kernel_x = x, *kernel_y = y;
+    if (geo) {
+        kernel_x = malloc(PREDICT_BATCH_POINTS * sizeof(double));
+        kernel_y = malloc(PREDICT_BATCH_POINTS * sizeof(double));
+    }
+    size_t num_points = 0;
+    int count;
+    while ((count = read_batch(csv_file, x, y, PREDICT_BATCH_POINTS)) > 0) {
+        double start_kernel = omp_get_wtime();
+        if (geo) {
+            geo_project_xy(&projection, x, y, kernel_x, kernel_y, count);
+        }
+#pragma omp parallel for schedule(runtime)
+        for (int begin = 0; begin < count; begin += PREDICT_BLOCK_POINTS) {
+            int block = count - begin < PREDICT_BLOCK_POINTS ? count - begin : PREDICT_BLOCK_POINTS;
+            nearest_centroids(&kernel_x[begin], &kernel_y[begin], &labels[begin], block, centroid_x, centroid_y,
+                              num_clusters);
+        }
+        metrics->assignment_seconds += omp_get_wtime() - start_kernel;
+
+        if (out_file) {
+            for (int i = 0; i < count; ++i) {
+                fprintf(out_file, "%.7f,%.7f,cluster_%d\n", x[i], y[i], labels[i]);
+            }
+        }
+        num_points += count;
+    }
+    metrics->total_seconds = omp_get_wtime() - start_time;
+    metrics->num_points = num_points;
+    metrics->num_clusters = num_clusters;
+
+    fclose(csv_file);
+    if (out_file) {
+        fclose(out_file);
+    }
+    if (!config->quiet) {
+        printf("Predicted %zu points in %.3f seconds: %.0f points/second overall, %.0f points/second in the kernel\n",
+               num_points, metrics->total_seconds, num_points / metrics->total_seconds,
+               num_points / metrics->assignment_seconds);
+    }
+    if (kernel_x != x) {
+        free(kernel_x);
+        free(kernel_y);
+    }
+    free(x);
+    free(y);
+    free(labels);
+    free(centroid_x);
+    free(centroid_y);
+    free(centroids);
+}
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <mpi.h>
+#include <omp.h>
+#include "csvhelper.h"
+#include "kmeans.h"
+
+/**
+ * Hybrid MPI + OpenMP version, for datasets bigger than one node can handle:
+ * - every rank reads its own share of the bytes of the input file, so no rank ever holds the
+ *   whole dataset
+ * - each rank assigns its points with the OpenMP assignment of kmeans_omp3 and sums them up
+ *   per cluster, then the sums, counts and cluster changes of all ranks are combined with a
+ *   single MPI_Allreduce per iteration, after which every rank has the same new centroids
+ * - the labelled points are written to the output file with collective MPI-IO, each rank at
+ *   the offset given by the sizes of the ranks before it
+ * - communication time is reported next to the assignment and centroids times, all of them
+ *   taken from the slowest rank
+ *
+ * Run with e.g.: mpirun -np 4 bin/kmeans_mpi -f data/s1.csv -k 15 -t testdata/s1_clustered_knime.csv
+ */
+
+static char* headers[3];
+static int dimensions;
+
+/**
+ * Read the points of this rank: those whose line starts in the rank's share of the bytes
+ * after the header line. A line that straddles the start of the share belongs to the
+ * previous rank, which reads past the end of its share to finish it.
+ *
+ * @param csv_file_name input file
+ * @param rank this rank
+ * @param num_ranks number of ranks reading the file
+ * @param num_points set to the number of points read
+ * @return allocated array of the points read
+ */
+static struct point *read_csv_share(char *csv_file_name, int rank, int num_ranks, size_t *num_points)
+{
+    FILE *csv_file = fopen(csv_file_name, "r");
+    struct stat file_stat;
+    if (!csv_file || stat(csv_file_name, &file_stat) != 0) {
+        fprintf(stderr, "Error: cannot read the input file at %s\n", csv_file_name);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    dimensions = csvheaders(csv_file, headers);
+    long data_start = ftell(csv_file);
+    long data_bytes = file_stat.st_size - data_start;
+    long begin = data_start + data_bytes * rank / num_ranks;
+    long end = data_start + data_bytes * (rank + 1) / num_ranks;
+    if (rank > 0) {
+        fseek(csv_file, begin - 1, SEEK_SET);
+        int c = getc(csv_file);
+        while (c != '\n' && c != EOF) {
+            c = getc(csv_file);
+        }
+    }
+
+    size_t capacity = 1024;
+    size_t count = 0;
+    struct point *dataset = malloc(capacity * sizeof(struct point));
+    char *line;
+    while (ftell(csv_file) < end && (line = csvgetline(csv_file)) != NULL) {
+        if (csvnfield() < 2) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            dataset = realloc(dataset, capacity * sizeof(struct point));
+        }
+        dataset[count].x = strtod(csvfield(0), NULL);
+        dataset[count].y = strtod(csvfield(1), NULL);
+        dataset[count].cluster = -1; // -1 => no cluster yet assigned
+        dataset[count].weight = 1.0;
+        count++;
+    }
+    fclose(csv_file);
+    *num_points = count;
+    return dataset;
+}
+
+/**
+ * Append formatted text to a growing buffer
+ */
+static void append(char **buffer, size_t *length, size_t *capacity, const char *format, double x, double y, int cluster)
+{
+    int written;
+    while ((written = snprintf(*buffer + *length, *capacity - *length, format, x, y, cluster)) >= (int)(*capacity - *length)) {
+        *capacity *= 2;
+        *buffer = realloc(*buffer, *capacity);
+    }
+    *length += written;
+}
+
+/**
+ * Write the points of all ranks to one csv file with collective MPI-IO, in rank order so
+ * the file is the same as the one written by the other versions.
+ */
+static void write_csv_file_parallel(char *csv_file_name, struct point *dataset, size_t num_points, int rank)
+{
+    size_t capacity = 64 * num_points + 256;
+    size_t length = 0;
+    char *buffer = malloc(capacity);
+    buffer[0] = '\0';
+    if (rank == 0) {
+        for (int i = 0; i < dimensions && i < 2; ++i) {
+            length += snprintf(buffer + length, capacity - length, i == 0 ? "%s" : ",%s", headers[i]);
+        }
+        length += snprintf(buffer + length, capacity - length, ",Cluster\n");
+    }
+    for (size_t n = 0; n < num_points; ++n) {
+        append(&buffer, &length, &capacity, "%.7f,%.7f,cluster_%d\n", dataset[n].x, dataset[n].y, dataset[n].cluster);
+    }
+
+    long long bytes = length;
+    long long offset = 0;
+    MPI_Exscan(&bytes, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0) {
+        offset = 0; // MPI_Exscan leaves rank 0 undefined
+    }
+
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, csv_file_name, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                      MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        fprintf(stderr, "Error: cannot write to the output file at %s\n", csv_file_name);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_File_set_size(file, 0); // silently overwrite, like write_csv_file
+    // NOTE: the count is an int, so each rank can write at most 2GB
+    MPI_File_write_at_all(file, offset, buffer, (int)length, MPI_CHAR, MPI_STATUS_IGNORE);
+    MPI_File_close(&file);
+    free(buffer);
+}
+
+/**
+ * The options of a single-process run that this driver does not implement: it only clusters
+ * its shares of one input, from the first points or a --warm-start model, so these would be
+ * silently ignored
+ *
+ * @param config run configuration from the command line
+ * @return the names of the first option set that is not supported, NULL if there is none
+ */
+static const char *unsupported_options(struct kmeans_config *config)
+{
+    if (config->batch_file || config->generate || config->predict_model) {
+        return "--batch, --generate and --predict";
+    }
+    if (config->geo || config->reorder || config->dedup || config->grid_cell > 0) {
+        return "--geo, --reorder, --dedup and --grid";
+    }
+    if (config->coreset_size > 0 || config->coreset_compare || config->k_max > 0 || config->hierarchy_file) {
+        return "--coreset, --coreset-compare, --k-range and --hierarchy";
+    }
+    if (config->autotune || config->tuning_file || config->pipeline) {
+        return "--autotune, --tuning-file and --pipeline";
+    }
+    if (config->checkpoint_file || config->resume || config->progress_file || config->progress_seconds > 0) {
+        return "--checkpoint, --resume and --progress";
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv [])
+{
+    int provided, rank, num_ranks;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    if (rank != 0) {
+        // only rank 0 reports, the others would print the same config and results again
+        if (!freopen("/dev/null", "w", stdout)) {
+            fprintf(stderr, "Warning: rank %d cannot silence its output\n", rank);
+        }
+    }
+
+    struct kmeans_config config = parse_cli(argc, argv);
+    const char *unsupported = unsupported_options(&config);
+    if (unsupported) {
+        // every rank parsed the same command line and stops here
+        if (rank == 0) {
+            fprintf(stderr, "The MPI version does not support any of %s\n", unsupported);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    char* csv_file_name = valid_file('f', config.in_file);
+    size_t num_points;
+    struct point *dataset = read_csv_share(csv_file_name, rank, num_ranks, &num_points);
+
+    // position of this rank's first point in the whole dataset: -n limits the total
+    unsigned long long local_points = num_points;
+    unsigned long long offset = 0;
+    MPI_Exscan(&local_points, &offset, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0) {
+        offset = 0;
+    }
+    if (config.max_points > 0 && offset + num_points > config.max_points) {
+        num_points = offset < config.max_points ? config.max_points - offset : 0;
+    }
+    local_points = num_points;
+    unsigned long long total_points;
+    MPI_Allreduce(&local_points, &total_points, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+    // K-Means Algo Step 1: initialize the centroids with the first K points of the whole dataset,
+    // wherever they are: each rank fills in the ones it has and the rest are summed in as zeros
+    int num_clusters = config.num_clusters;
+    struct point *centroids;
+    if (config.warm_start) {
+        centroids = load_model(config.warm_start, &num_clusters);
+        config.num_clusters = num_clusters;
+    }
+    else {
+        double *first_points = calloc(2 * num_clusters, sizeof(double));
+        for (size_t n = offset; n < offset + num_points && n < (size_t)num_clusters; ++n) {
+            first_points[2 * n] = dataset[n - offset].x;
+            first_points[2 * n + 1] = dataset[n - offset].y;
+        }
+        MPI_Allreduce(MPI_IN_PLACE, first_points, 2 * num_clusters, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        centroids = malloc(num_clusters * sizeof(struct point));
+        for (int k = 0; k < num_clusters; ++k) {
+            centroids[k].x = first_points[2 * k];
+            centroids[k].y = first_points[2 * k + 1];
+            centroids[k].cluster = k;
+        }
+        free(first_points);
+    }
+
+    struct kmeans_metrics metrics = new_metrics();
+    metrics.label = config.label;
+    metrics.max_iterations = config.max_iterations;
+    metrics.num_clusters = num_clusters;
+    metrics.num_points = total_points;
+    metrics.omp_max_threads = omp_get_max_threads();
+    metrics.omp_schedule_kind = omp_schedule_kind(&metrics.omp_chunk_size);
+    metrics.mpi_ranks = num_ranks;
+
+    // per cluster: sums of x, sums of y, counts, then the cluster changes, all in one reduction
+    double *sums = malloc((3 * num_clusters + 1) * sizeof(double));
+    double *sum_x = sums;
+    double *sum_y = &sums[num_clusters];
+    double *count = &sums[2 * num_clusters];
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start_time = omp_get_wtime();
+    size_t cluster_changes = total_points;
+    int iterations = 0;
+    while (cluster_changes > 0 && iterations < config.max_iterations) {
+        // K-Means Algo Step 2: assign every local point to a cluster (closest centroid)
+        double start_iteration = omp_get_wtime();
+        size_t local_changes = assign_clusters(dataset, num_points, centroids, num_clusters);
+        double start_sums = omp_get_wtime();
+        metrics.assignment_seconds += start_sums - start_iteration;
+
+        // K-Means Algo Step 3: sum up the local points per cluster, combine with the other
+        // ranks, then every rank calculates the same new centroids
+        for (int i = 0; i < 3 * num_clusters; ++i) {
+            sums[i] = 0.0;
+        }
+#pragma omp parallel for schedule(runtime) reduction(+:sum_x[:num_clusters], sum_y[:num_clusters], count[:num_clusters])
+        for (size_t n = 0; n < num_points; ++n) {
+            int k = dataset[n].cluster;
+            sum_x[k] += dataset[n].weight * dataset[n].x;
+            sum_y[k] += dataset[n].weight * dataset[n].y;
+            count[k] += dataset[n].weight;
+        }
+        sums[3 * num_clusters] = local_changes;
+
+        double start_communication = omp_get_wtime();
+        MPI_Allreduce(MPI_IN_PLACE, sums, 3 * num_clusters + 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        double end_communication = omp_get_wtime();
+        metrics.communication_seconds += end_communication - start_communication;
+
+        for (int k = 0; k < num_clusters; ++k) {
+            // mean x, mean y => new centroid
+            centroids[k].x = sum_x[k] / count[k];
+            centroids[k].y = sum_y[k] / count[k];
+        }
+        cluster_changes = (size_t)sums[3 * num_clusters];
+        double end_iteration = omp_get_wtime();
+        metrics.centroids_seconds += (start_communication - start_sums) + (end_iteration - end_communication);
+#ifndef SKIP_MAX_ITERATION_CALC
+        if (end_iteration - start_iteration > metrics.max_iteration_seconds) {
+            metrics.max_iteration_seconds = end_iteration - start_iteration;
+        }
+#endif
+        iterations++;
+    }
+    metrics.total_seconds = omp_get_wtime() - start_time;
+    metrics.used_iterations = iterations;
+
+    // the slowest rank decides how long the run takes
+    double timings[5] = { metrics.assignment_seconds, metrics.centroids_seconds, metrics.communication_seconds,
+                          metrics.total_seconds, metrics.max_iteration_seconds };
+    MPI_Allreduce(MPI_IN_PLACE, timings, 5, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    metrics.assignment_seconds = timings[0];
+    metrics.centroids_seconds = timings[1];
+    metrics.communication_seconds = timings[2];
+    metrics.total_seconds = timings[3];
+    metrics.max_iteration_seconds = timings[4];
+
+    if (!config.quiet) {
+        printf("\nEnded after %d iterations with %zu changed clusters on %d ranks\n", iterations, cluster_changes, num_ranks);
+    }
+
+    if (config.save_model && rank == 0) {
+        save_model(config.save_model, centroids, num_clusters, NULL);
+    }
+
+    if (config.out_file) {
+        if (!config.silent) {
+            printf("Writing output to %s\n", config.out_file);
+        }
+        write_csv_file_parallel(config.out_file, dataset, num_points, rank);
+    }
+
+    if (config.test_file) {
+        // every rank compares its own points with the same positions in the test file
+        char* test_file_name = valid_file('t', config.test_file);
+        if (!config.quiet) {
+            printf("Comparing results against test file: %s\n", config.test_file);
+        }
+        struct point *testset;
+        int test_dimensions;
+        char *test_headers[3];
+        size_t num_test_points = read_csv_file(test_file_name, &testset, total_points, test_headers, &test_dimensions);
+        size_t test_offset = offset < num_test_points ? offset : num_test_points;
+        int result = compare_results(&config, &testset[test_offset], num_test_points - test_offset,
+                                     dataset, num_points);
+        MPI_Allreduce(&result, &metrics.test_result, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+        free(testset);
+    }
+
+    if (config.metrics_file && rank == 0) {
+        if (!config.quiet) {
+            printf("Reporting metrics to: %s\n", config.metrics_file);
+        }
+        write_metrics_file(config.metrics_file, &metrics);
+    }
+
+    if (!config.silent) {
+        print_metrics_headers(stdout);
+        print_metrics(stdout, &metrics);
+    }
+    free(sums);
+    free(centroids);
+    free(dataset);
+    MPI_Finalize();
+    return 0;
+}
@@ -15,17 +15,17 @@
  * @param num_clusters number of clusters - hence size of the centroids array
  * @return the number of points for which the cluster assignment was changed
  */
-int assign_clusters(struct point* dataset, int num_points, struct point *centroids, int num_clusters)
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
 {
 #ifdef DEBUG
     printf("\nStarting assignment phase:\n");
 #endif
-    int cluster_changes = 0;
+    size_t cluster_changes = 0;
 #pragma omp parallel for schedule(runtime)
-    for (int n = 0; n < num_points; ++n) {
+    for (size_t n = 0; n < num_points; ++n) {
 #ifdef DEBUG_OMP
         char msg[50];
-        sprintf(msg, "Point %d", n);
+        sprintf(msg, "Point %zu", n);
         omp_debug(msg);
 #endif
         double min_distance = DBL_MAX; // init the min distance to a big number
@@ -52,7 +52,8 @@ int assign_clusters(struct point* dataset, int num_points, struct point *centroi
 
 /**
  * Calculates new centroids for the clusters of the given dataset by finding the
- * mean x and y coordinates of the current members of the cluster for each cluster.
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
  *
  * The centroids are set in the array passed in, which is expected to be pre-allocated
  * and contain the previous centroids: these are overwritten by the new values.
@@ -62,32 +63,34 @@ int assign_clusters(struct point* dataset, int num_points, struct point *centroi
  * @param centroids array to hold the centroids - already allocated
  * @param num_clusters number of clusters - hence size of the centroids array
  */
-void calculate_centroids(struct point* dataset, int num_points, struct point *centroids, int num_clusters)
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
 {
-    double sum_of_x_per_cluster[num_clusters];
-    double sum_of_y_per_cluster[num_clusters];
-    int num_points_in_cluster[num_clusters];
+    // the sums live in the workspace instead of on the stack, which would overflow at large k
+    double *sums = workspace_buffer(WORKSPACE_PARTIALS, 3 * num_clusters * sizeof(double));
+    double *sum_of_x_per_cluster = sums;
+    double *sum_of_y_per_cluster = &sums[num_clusters];
+    double *weight_of_cluster = &sums[2 * num_clusters];
 #pragma omp parallel for schedule(runtime)
     for (int k = 0; k < num_clusters; ++k) {
         sum_of_x_per_cluster[k] = 0.0;
         sum_of_y_per_cluster[k] = 0.0;
-        num_points_in_cluster[k] = 0;
+        weight_of_cluster[k] = 0.0;
     }
 
     // loop over all points in the database and sum up
     // the x coords of clusters to which each belongs
     // FAIL: Note pramgma omp for schedule(runtime) here with anything but static scheduling will result in
     //       every point being assigned to the same cluster
-    //       this is because of a data race on num_points_in_cluster[k]
+    //       this is because of a data race on weight_of_cluster[k]
 //#pragma omp parallel for schedule(static,1) //schedule(runtime)
-    for (int n = 0; n < num_points; ++n) {
+    for (size_t n = 0; n < num_points; ++n) {
         // use pointer to struct to avoid creating unnecessary copy in memory
         struct point *p = &dataset[n];
         int k = p->cluster;
-        sum_of_x_per_cluster[k] += p->x;
-        sum_of_y_per_cluster[k] += p->y;
-        // count the points in the cluster to get a mean later
-        num_points_in_cluster[k]++;
+        sum_of_x_per_cluster[k] += p->weight * p->x;
+        sum_of_y_per_cluster[k] += p->weight * p->y;
+        // add up the weights (point counts unless the points were aggregated) to get a mean later
+        weight_of_cluster[k] += p->weight;
     }
 
     // the new centroids are at the mean x and y coords of the clusters
@@ -95,10 +98,20 @@ void calculate_centroids(struct point* dataset, int num_points, struct point *ce
     for (int k = 0; k < num_clusters; ++k) {
         struct point new_centroid;
         // mean x, mean y => new centroid
-        new_centroid.x = sum_of_x_per_cluster[k] / num_points_in_cluster[k];
-        new_centroid.y = sum_of_y_per_cluster[k] / num_points_in_cluster[k];
+        new_centroid.x = sum_of_x_per_cluster[k] / weight_of_cluster[k];
+        new_centroid.y = sum_of_y_per_cluster[k] / weight_of_cluster[k];
         centroids[k] = new_centroid;
     }
 }
 
-
+/**
+ * Sizes the workspace for a run: calculate_centroids needs one set of cluster sums.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    (void)num_points; // the scratch space depends on the clusters only
+    workspace_buffer(WORKSPACE_PARTIALS, 3 * num_clusters * sizeof(double));
+}
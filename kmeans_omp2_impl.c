@@ -8,6 +8,9 @@
  * - use reduction for the point counter
  */
 
+// pad each thread's partial sums to whole cache lines to avoid false sharing
+#define DOUBLES_PER_CACHE_LINE 8
+
 /**
  * Assigns each point in the dataset to a cluster based on the distance from that cluster.
  *
@@ -21,25 +24,25 @@
  * @param num_clusters number of clusters - hence size of the centroids array
  * @return the number of points for which the cluster assignment was changed
  */
-int assign_clusters(struct point* dataset, int num_points, struct point *centroids, int num_clusters)
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
 {
 #ifdef DEBUG
     printf("\nStarting assignment phase:\n");
 #endif
-    int cluster_changes = 0;
+    size_t cluster_changes = 0;
     // use reduction + for cluster changes which are added up
 #pragma omp parallel for schedule(runtime) reduction(+:cluster_changes)
-    for (int n = 0; n < num_points; ++n) {
+    for (size_t n = 0; n < num_points; ++n) {
 #ifdef DEBUG_OMP
         char msg[50];
-        sprintf(msg, "Point %d", n);
+        sprintf(msg, "Point %zu", n);
         omp_debug(msg);
 #endif
         double min_distance = DBL_MAX; // init the min distance to a big number
         int closest_cluster = -1;
 
-// Nested for loop parallelism - consider collapse instead of this or nowait
-#pragma omp parallel for schedule(runtime) shared(n)
+        // not a nested parallel for: the threads would race on min_distance and closest_cluster,
+        // and the points already give every thread plenty of work
         for (int k = 0; k < num_clusters; ++k) {
             // calc the distance passing pointers to points since the distance does not modify them
             double distance_from_centroid = euclidean_distance(&dataset[n], &centroids[k]);
@@ -62,7 +65,8 @@ int assign_clusters(struct point* dataset, int num_points, struct point *centroi
 
 /**
  * Calculates new centroids for the clusters of the given dataset by finding the
- * mean x and y coordinates of the current members of the cluster for each cluster.
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
  *
  * The centroids are set in the array passed in, which is expected to be pre-allocated
  * and contain the previous centroids: these are overwritten by the new values.
@@ -72,48 +76,66 @@ int assign_clusters(struct point* dataset, int num_points, struct point *centroi
  * @param centroids array to hold the centroids - already allocated
  * @param num_clusters number of clusters - hence size of the centroids array
  */
-void calculate_centroids(struct point* dataset, int num_points, struct point *centroids, int num_clusters)
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
 {
-    double sum_of_x_per_cluster[num_clusters];
-    double sum_of_y_per_cluster[num_clusters];
-    int num_points_in_cluster[num_clusters];
+    // a copy of the sums per thread, padded to whole cache lines, in the workspace: an array
+    // reduction would allocate and combine private copies in every call
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    double *partials = workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
 
 // reuse the thread team across the for loops
 #pragma omp parallel
 {
-
-#pragma for schedule(runtime)
+    int team = omp_get_num_threads();
+    double *sum_of_x_per_cluster = &partials[omp_get_thread_num() * 3 * stride];
+    double *sum_of_y_per_cluster = &sum_of_x_per_cluster[stride];
+    double *weight_of_cluster = &sum_of_x_per_cluster[2 * stride];
     for (int k = 0; k < num_clusters; ++k) {
         sum_of_x_per_cluster[k] = 0.0;
         sum_of_y_per_cluster[k] = 0.0;
-        num_points_in_cluster[k] = 0;
+        weight_of_cluster[k] = 0.0;
     }
 
     // loop over all points in the database and sum up
-    // the x coords of clusters to which each belongs
+    // the x coords of clusters to which each belongs, each thread into its own sums
 #pragma omp for schedule(runtime)
-    for (int n = 0; n < num_points; ++n) {
+    for (size_t n = 0; n < num_points; ++n) {
         // use pointer to struct to avoid creating unnecessary copy in memory
         struct point *p = &dataset[n];
         int k = p->cluster;
-        sum_of_x_per_cluster[k] += p->x;
-        sum_of_y_per_cluster[k] += p->y;
-        // count the points in the cluster to get a mean later
-        num_points_in_cluster[k]++;
+        sum_of_x_per_cluster[k] += p->weight * p->x;
+        sum_of_y_per_cluster[k] += p->weight * p->y;
+        // add up the weights (point counts unless the points were aggregated) to get a mean later
+        weight_of_cluster[k] += p->weight;
     }
 
-    // the new centroids are at the mean x and y coords of the clusters
+    // the new centroids are at the mean x and y coords of the clusters, over the sums of all threads
 #pragma omp for schedule(runtime)
     for (int k = 0; k < num_clusters; ++k) {
+        double sum_x = 0.0, sum_y = 0.0, weight = 0.0;
+        for (int t = 0; t < team; ++t) {
+            sum_x += partials[t * 3 * stride + k];
+            sum_y += partials[t * 3 * stride + stride + k];
+            weight += partials[t * 3 * stride + 2 * stride + k];
+        }
         struct point new_centroid;
         // mean x, mean y => new centroid
-        new_centroid.x = sum_of_x_per_cluster[k] / num_points_in_cluster[k];
-        new_centroid.y = sum_of_y_per_cluster[k] / num_points_in_cluster[k];
+        new_centroid.x = sum_x / weight;
+        new_centroid.y = sum_y / weight;
         centroids[k] = new_centroid;
     }
 }
 }
 
-
-
-
+/**
+ * Sizes the workspace for a run: the cluster sums of every thread.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    (void)num_points; // the scratch space depends on the clusters only
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
+}
@@ -0,0 +1,254 @@
+#include <float.h>
+#include <math.h>
+#include "kmeans.h"
+
+/**
+ * OpenMP performance version 3:
+ * - one parallel region for the whole run instead of several per iteration (run_lloyd below
+ *   replaces the default loop in kmeans_lloyd.c)
+ * - assignment and the per-thread partial sums for the new centroids are fused in one
+ *   omp for nowait, so each point is only read once per iteration
+ * - a single explicit barrier per iteration, after which every thread reads the same
+ *   number of cluster changes and decides on convergence by itself
+ * - timing is done with timestamps taken by the master thread only
+ */
+
+// cluster changes of iteration i are counted in slot i % CHANGE_SLOTS: with 3 slots the master
+// can reset the slot for the next iteration without waiting for the other threads to read theirs
+#define CHANGE_SLOTS 3
+// pad each thread's partial sums to whole cache lines to avoid false sharing
+#define DOUBLES_PER_CACHE_LINE 8
+
+/**
+ * Find the cluster with the centroid closest to the point
+ */
+static inline int nearest_cluster(struct point *p, struct point *centroids, int num_clusters, double *min_distance)
+{
+    *min_distance = DBL_MAX; // init the min distance to a big number
+    int closest_cluster = -1;
+    for (int k = 0; k < num_clusters; ++k) {
+        double distance_from_centroid = euclidean_distance(p, &centroids[k]);
+        if (distance_from_centroid < *min_distance) {
+            *min_distance = distance_from_centroid;
+            closest_cluster = k;
+        }
+    }
+    return closest_cluster;
+}
+
+/**
+ * Size of the sums for one cluster coordinate in a thread's partial sums, padded to a cache line.
+ * Each thread owns 3 * stride doubles: the sums of x, the sums of y and the point counts.
+ */
+static int partial_stride(int num_clusters)
+{
+    return (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+}
+
+static inline void zero_partial(double *partial, int stride)
+{
+    for (int i = 0; i < 3 * stride; ++i) {
+        partial[i] = 0.0;
+    }
+}
+
+static inline void add_to_partial(double *partial, int stride, struct point *p, int k)
+{
+    partial[k] += p->weight * p->x;
+    partial[stride + k] += p->weight * p->y;
+    partial[2 * stride + k] += p->weight;
+}
+
+/**
+ * Combine the partial sums of all threads in the team into the new centroids.
+ *
+ * Orphaned worksharing: must be called by every thread of the team after all partials are
+ * complete. The implied barrier at the end of the loop means the partials can be reused
+ * as soon as this returns.
+ */
+static void reduce_partials(double *partials, int num_threads, int stride, struct point *centroids, int num_clusters)
+{
+#pragma omp for schedule(static)
+    for (int k = 0; k < num_clusters; ++k) {
+        double sum_x = 0.0;
+        double sum_y = 0.0;
+        double count = 0.0;
+        for (int t = 0; t < num_threads; ++t) {
+            double *partial = &partials[t * 3 * stride];
+            sum_x += partial[k];
+            sum_y += partial[stride + k];
+            count += partial[2 * stride + k];
+        }
+        struct point new_centroid;
+        // mean x, mean y => new centroid
+        new_centroid.x = sum_x / count;
+        new_centroid.y = sum_y / count;
+        centroids[k] = new_centroid;
+    }
+}
+
+/**
+ * Assigns each point in the dataset to a cluster based on the distance from that cluster.
+ *
+ * Standalone version for callers outside the main loop: run_lloyd does not use it.
+ *
+ * @param dataset set of all points with current cluster assignments
+ * @param num_points number of points in the dataset
+ * @param centroids array that holds the current centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @return the number of points for which the cluster assignment was changed
+ */
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    size_t cluster_changes = 0;
+#pragma omp parallel for schedule(runtime) reduction(+:cluster_changes)
+    for (size_t n = 0; n < num_points; ++n) {
+        double min_distance;
+        int closest_cluster = nearest_cluster(&dataset[n], centroids, num_clusters, &min_distance);
+        if (dataset[n].cluster != closest_cluster) {
+            dataset[n].cluster = closest_cluster;
+            cluster_changes++;
+        }
+    }
+    return cluster_changes;
+}
+
+/**
+ * Calculates new centroids for the clusters of the given dataset by finding the
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
+ *
+ * Standalone version for callers outside the main loop: run_lloyd does not use it.
+ *
+ * @param dataset set of all points with current cluster assigments
+ * @param num_points number of points in the dataset
+ * @param centroids array to hold the centroids - already allocated
+ * @param num_clusters number of clusters - hence size of the centroids array
+ */
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    int stride = partial_stride(num_clusters);
+    double *partials = workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
+#pragma omp parallel
+    {
+        double *partial = &partials[omp_get_thread_num() * 3 * stride];
+        zero_partial(partial, stride);
+#pragma omp for schedule(runtime) nowait
+        for (size_t n = 0; n < num_points; ++n) {
+            add_to_partial(partial, stride, &dataset[n], dataset[n].cluster);
+        }
+#pragma omp barrier
+        reduce_partials(partials, omp_get_num_threads(), stride, centroids, num_clusters);
+    }
+}
+
+/**
+ * Runs the Lloyd iterations inside a single parallel region.
+ *
+ * Every thread runs the iteration loop itself. In each iteration it assigns its share of
+ * the points and adds them to its own partial sums (no barrier: omp for nowait), counts its
+ * changes into the shared counter for the iteration, then waits at the only explicit barrier.
+ * The partial sums are then reduced into the new centroids, after which all threads see the
+ * same total of changes and stop together when it is zero.
+ *
+ * @param dataset set of all points, cluster assignments are updated in place
+ * @param num_points number of points in the dataset
+ * @param centroids array that holds the initial centroids, overwritten with the final ones
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @param max_iterations stop after this many iterations even if points are still changing
+ * @param metrics timing metrics are accumulated here, including the used iterations
+ * @return the number of points that changed cluster in the last iteration (zero if converged)
+ */
+size_t run_lloyd(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                 int max_iterations, struct kmeans_metrics *metrics)
+{
+    int stride = partial_stride(num_clusters);
+    double *partials = workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
+    size_t changes[CHANGE_SLOTS] = {0};
+    size_t cluster_changes = num_points;
+    int iterations = 0;
+    // timestamps are only written and read by the master thread
+    double start_iteration = 0;
+    double start_centroids = 0;
+
+#pragma omp parallel
+    {
+        double *partial = &partials[omp_get_thread_num() * 3 * stride];
+        for (int i = 0; i < max_iterations; ++i) {
+#pragma omp master
+            {
+                start_iteration = omp_get_wtime();
+                // nobody reads this slot again until after the barrier of this iteration
+                changes[(i + 1) % CHANGE_SLOTS] = 0;
+            }
+            zero_partial(partial, stride);
+
+            // K-Means Algo Step 2: assign every point to a cluster (closest centroid)
+            // and sum up this thread's points for step 3 while they are in cache
+            size_t thread_changes = 0;
+#pragma omp for schedule(runtime) nowait
+            for (size_t n = 0; n < num_points; ++n) {
+                struct point *p = &dataset[n];
+                double min_distance;
+                int closest_cluster = nearest_cluster(p, centroids, num_clusters, &min_distance);
+                if (p->cluster != closest_cluster) {
+                    p->cluster = closest_cluster;
+                    thread_changes++;
+#ifdef TRACE
+                    debug_assignment(p, closest_cluster, &centroids[closest_cluster], min_distance);
+#endif
+                }
+                add_to_partial(partial, stride, p, closest_cluster);
+            }
+#pragma omp atomic
+            changes[i % CHANGE_SLOTS] += thread_changes;
+#pragma omp barrier
+
+#pragma omp master
+            {
+                start_centroids = omp_get_wtime();
+                metrics->assignment_seconds += start_centroids - start_iteration;
+            }
+            // K-Means Algo Step 3: calculate new centroids from the partial sums of every thread
+            reduce_partials(partials, omp_get_num_threads(), stride, centroids, num_clusters);
+
+            // all changes were counted before the barrier, so every thread reads the same total
+            size_t iteration_changes = changes[i % CHANGE_SLOTS];
+#pragma omp master
+            {
+                double end_iteration = omp_get_wtime();
+                metrics->centroids_seconds += end_iteration - start_centroids;
+#ifndef SKIP_MAX_ITERATION_CALC
+                if (end_iteration - start_iteration > metrics->max_iteration_seconds) {
+                    metrics->max_iteration_seconds = end_iteration - start_iteration;
+                }
+#endif
+                iterations = i + 1;
+                cluster_changes = iteration_changes;
+                // the other threads are already on the next iteration: no inertia from here
+                progress_iteration(NULL, num_points, centroids, num_clusters, iterations, cluster_changes, metrics);
+#ifdef TRACE
+                printf("Iteration %d: %zu clusters changed. New centroids:\n", i, iteration_changes);
+                print_centroids(stdout, centroids, num_clusters);
+#endif
+            }
+            if (iteration_changes == 0) {
+                break;
+            }
+        }
+    }
+    metrics->used_iterations = iterations;
+    return cluster_changes;
+}
+
+/**
+ * Sizes the workspace for a run: the partial cluster sums of every thread.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    (void)num_points; // the scratch space depends on the clusters only
+    workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * partial_stride(num_clusters) * sizeof(double));
+}
@@ -0,0 +1,311 @@
+// for sigaction with SA_RESTART, pipe, poll and fcntl, which -std=c99 hides
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Live progress of a run: a snapshot of where the loop is (iteration, points that changed
+ * cluster and their trend, inertia, seconds in each phase, points per second) is published on
+ * SIGUSR1, every --progress-every seconds, and once more at the end of the loop. Snapshots go
+ * to stderr as a line each, or with --progress FILE to that file as a csv header and row,
+ * replaced atomically, so a job scheduler can read the latest one and decide whether to let
+ * the run go on.
+ *
+ * The loop doesn't lock or wait for anybody: after every iteration the master thread updates
+ * the counters below under a sequence number (a seqlock: odd while an update is under way),
+ * and a reporter thread copies them out whenever the sequence is even and unchanged over the
+ * copy. Only the inertia takes a pass over the points, so the loop computes it after the
+ * iteration following a request, and the reporter waits for it up to INERTIA_WAIT_MS before
+ * writing the snapshot with the inertia it last had.
+ *
+ * SIGUSR1 is caught from the start of the loop of every clustering run, and ignored after it,
+ * so sending it to a run that is past loading never kills it. The handler only writes a byte
+ * to a pipe the reporter thread polls, which is safe in a signal handler.
+ */
+
+// longest the reporter waits for the loop to compute the inertia of a snapshot
+#define INERTIA_WAIT_MS 1000
+
+struct progress_counters {
+    int iterations;
+    int max_iterations;
+    size_t num_points;
+    size_t cluster_changes;  // in the last iteration
+    size_t previous_changes; // in the one before
+    double assignment_seconds;
+    double centroids_seconds;
+    double elapsed_seconds;  // since the loop started, including the time before a --resume
+    double inertia;          // nan until computed for a snapshot
+    int inertia_iteration;   // iteration the inertia was computed after
+    bool finished;
+};
+
+static struct {
+    bool active;
+    char *file_name;   // NULL for stderr
+    char *temp_file_name;
+    char *label;
+    double every_seconds; // 0 for snapshots on SIGUSR1 only
+    double start_seconds;
+
+    // written by the master thread between iterations, read by the reporter
+    unsigned long sequence;
+    struct progress_counters counters;
+    int inertia_wanted; // set by the reporter, cleared by the master once computed
+
+    int wake_pipe[2];   // SIGUSR1 and progress_finish -> reporter
+    int served_pipe[2]; // master -> reporter: the inertia asked for is in the counters
+    int stop;           // set by progress_finish, read by the reporter
+    pthread_t reporter;
+} progress;
+
+static void on_sigusr1(int signal)
+{
+    (void)signal;
+    char byte = 's';
+    ssize_t ignored = write(progress.wake_pipe[1], &byte, 1);
+    (void)ignored;
+}
+
+/**
+ * Copy the counters as they were at the end of an iteration, without stopping the loop
+ */
+static struct progress_counters read_counters()
+{
+    struct progress_counters counters;
+    unsigned long before, after;
+    do {
+#pragma omp atomic read
+        before = progress.sequence;
+#pragma omp flush
+        counters = progress.counters;
+#pragma omp flush
+#pragma omp atomic read
+        after = progress.sequence;
+    } while (before != after || (before & 1));
+    return counters;
+}
+
+/**
+ * Wait on a pipe for up to the given milliseconds (forever if negative), emptying it
+ *
+ * @return true if anything was written to it
+ */
+static bool wait_pipe(int fd, int milliseconds)
+{
+    struct pollfd poll_fd = { fd, POLLIN, 0 };
+    if (poll(&poll_fd, 1, milliseconds) <= 0) {
+        return false;
+    }
+    char bytes[64];
+    while (read(fd, bytes, sizeof(bytes)) > 0) {
+    }
+    return true;
+}
+
+static void write_snapshot(struct progress_counters *c)
+{
+    double loop_seconds = c->assignment_seconds + c->centroids_seconds;
+    double points_per_second = loop_seconds > 0 ? (double)c->num_points * c->iterations / loop_seconds : 0;
+    double changed_fraction = c->num_points > 0 ? (double)c->cluster_changes / c->num_points : 0;
+    // below 1 the changes are dying down: the run is converging
+    double change_ratio = c->previous_changes > 0 ? (double)c->cluster_changes / c->previous_changes : 0;
+    const char *state = c->finished ? "finished" : "running";
+    if (!progress.file_name) {
+        fprintf(stderr, "Progress: %s, iteration %d of %d, %zu changed (%.4f%%, %.3f of the iteration before), "
+                        "inertia %f after iteration %d, assignment %.3fs, centroids %.3fs, elapsed %.3fs, "
+                        "%.0f points/s\n", state, c->iterations, c->max_iterations, c->cluster_changes,
+                100.0 * changed_fraction, change_ratio, c->inertia, c->inertia_iteration,
+                c->assignment_seconds, c->centroids_seconds, c->elapsed_seconds, points_per_second);
+        return;
+    }
+    FILE *file = fopen(progress.temp_file_name, "w");
+    if (!file) {
+        fprintf(stderr, "Warning: cannot write the progress file %s\n", progress.file_name);
+        return;
+    }
+    fprintf(file, "label,state,iteration,max_iterations,num_points,changed_points,changed_fraction,change_ratio,"
+                  "inertia,inertia_iteration,assignment_seconds,centroids_seconds,elapsed_seconds,points_per_second\n");
+    fprintf(file, "%s,%s,%d,%d,%zu,%zu,%f,%f,%f,%d,%f,%f,%f,%f\n", progress.label, state, c->iterations,
+            c->max_iterations, c->num_points, c->cluster_changes, changed_fraction, change_ratio, c->inertia,
+            c->inertia_iteration, c->assignment_seconds, c->centroids_seconds, c->elapsed_seconds,
+            points_per_second);
+    fclose(file);
+    rename(progress.temp_file_name, progress.file_name);
+}
+
+/**
+ * The reporter thread: a snapshot on every SIGUSR1 and every interval, until stopped
+ */
+static void *reporter(void *unused)
+{
+    (void)unused;
+    int timeout = progress.every_seconds > 0 ? (int)(progress.every_seconds * 1000) : -1;
+    while (true) {
+        wait_pipe(progress.wake_pipe[0], timeout);
+        int stop;
+#pragma omp atomic read
+        stop = progress.stop;
+        if (stop) {
+            break;
+        }
+        // ask the loop for the inertia, and give it a moment to finish the iteration
+        wait_pipe(progress.served_pipe[0], 0);
+#pragma omp atomic write
+        progress.inertia_wanted = 1;
+        wait_pipe(progress.served_pipe[0], INERTIA_WAIT_MS);
+        struct progress_counters counters = read_counters();
+        write_snapshot(&counters);
+    }
+    return NULL;
+}
+
+/**
+ * Start publishing the progress of a run: catch SIGUSR1 and start the reporter thread.
+ *
+ * @param config --progress file, --progress-every interval, label and max iterations
+ * @param num_points number of points clustered
+ */
+void progress_start(struct kmeans_config *config, size_t num_points)
+{
+    progress.file_name = config->progress_file && strcmp(config->progress_file, "-") != 0
+            ? config->progress_file : NULL;
+    progress.temp_file_name = NULL;
+    if (progress.file_name) {
+        progress.temp_file_name = malloc(strlen(progress.file_name) + 5);
+        sprintf(progress.temp_file_name, "%s.tmp", progress.file_name);
+    }
+    progress.label = config->label;
+    progress.every_seconds = config->progress_seconds;
+    progress.start_seconds = omp_get_wtime();
+    progress.sequence = 0;
+    progress.counters = (struct progress_counters) {0};
+    progress.counters.max_iterations = config->max_iterations;
+    progress.counters.num_points = num_points;
+    progress.counters.inertia = NAN;
+    progress.inertia_wanted = 0;
+    progress.stop = 0; // before the reporter starts
+    if (pipe(progress.wake_pipe) != 0 || pipe(progress.served_pipe) != 0) {
+        fprintf(stderr, "Error: cannot make the pipes of the progress reporter\n");
+        exit(1);
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(progress.wake_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(progress.served_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+    if (pthread_create(&progress.reporter, NULL, reporter, NULL) != 0) {
+        fprintf(stderr, "Error: cannot start the thread that reports progress\n");
+        exit(1);
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigusr1;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    progress.active = true;
+}
+
+/**
+ * Called by the master thread after every iteration: publish the counters, and compute the
+ * inertia first if the reporter asked for it.
+ *
+ * @param dataset set of all points with their current clusters, NULL if the caller cannot
+ *                afford a pass over them here (other threads are still working on them)
+ * @param num_points number of points in the dataset
+ * @param centroids the centroids at the end of the iteration
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @param iterations iterations done, including this one
+ * @param cluster_changes points that changed cluster in this iteration
+ * @param metrics timings so far
+ */
+void progress_iteration(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                        int iterations, size_t cluster_changes, struct kmeans_metrics *metrics)
+{
+    if (!progress.active) {
+        return;
+    }
+    int wanted;
+#pragma omp atomic read
+    wanted = progress.inertia_wanted;
+    double inertia_now = 0;
+    if (wanted && dataset) {
+        inertia_now = inertia(dataset, num_points, centroids, num_clusters);
+    }
+
+    unsigned long sequence = progress.sequence;
+#pragma omp atomic write
+    progress.sequence = sequence + 1;
+#pragma omp flush
+    struct progress_counters *c = &progress.counters;
+    c->previous_changes = c->iterations > 0 ? c->cluster_changes : 0;
+    c->iterations = iterations;
+    c->cluster_changes = cluster_changes;
+    c->assignment_seconds = metrics->assignment_seconds;
+    c->centroids_seconds = metrics->centroids_seconds;
+    c->elapsed_seconds = metrics->resumed_seconds + omp_get_wtime() - progress.start_seconds;
+    if (wanted && dataset) {
+        c->inertia = inertia_now;
+        c->inertia_iteration = iterations;
+    }
+#pragma omp flush
+#pragma omp atomic write
+    progress.sequence = sequence + 2;
+
+    if (wanted) {
+#pragma omp atomic write
+        progress.inertia_wanted = 0;
+        char byte = 'i';
+        ssize_t ignored = write(progress.served_pipe[1], &byte, 1);
+        (void)ignored;
+    }
+}
+
+/**
+ * Stop the reporter and ignore SIGUSR1 from now on. With a progress file, a last snapshot
+ * marks the run as finished, with the inertia of the final centroids.
+ *
+ * @param dataset set of all points with their final clusters
+ * @param num_points number of points in the dataset
+ * @param centroids the final centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ */
+void progress_finish(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    if (!progress.active) {
+        return;
+    }
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGUSR1, &ignore, NULL);
+    progress.active = false;
+#pragma omp atomic write
+    progress.stop = 1;
+    char byte = 'f';
+    ssize_t ignored = write(progress.wake_pipe[1], &byte, 1);
+    (void)ignored;
+    pthread_join(progress.reporter, NULL);
+    if (progress.file_name) {
+        struct progress_counters counters = progress.counters;
+        counters.inertia = inertia(dataset, num_points, centroids, num_clusters);
+        counters.inertia_iteration = counters.iterations;
+        counters.finished = true;
+        write_snapshot(&counters);
+    }
+    for (int i = 0; i < 2; ++i) {
+        close(progress.wake_pipe[i]);
+        close(progress.served_pipe[i]);
+    }
+    free(progress.temp_file_name);
+}
@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include "kmeans.h"
+
+/**
+ * Measures of the quality of a clustering, computed after the run and never timed.
+ */
+
+// points the silhouette is estimated on
+#define SILHOUETTE_SAMPLE 4096
+
+/**
+ * The k-means cost of the clustering: the weighted sum of the squared distances of the points
+ * from the centroids of their clusters. Lower is better for the same dataset and k.
+ *
+ * @param dataset set of all points with their final cluster assignments
+ * @param num_points number of points in the dataset
+ * @param centroids final centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @return the inertia (within-cluster sum of squares)
+ */
+double inertia(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    double total = 0.0;
+#pragma omp parallel for schedule(static) reduction(+:total)
+    for (size_t n = 0; n < num_points; ++n) {
+        int k = dataset[n].cluster;
+        if (k < 0 || k >= num_clusters) {
+            continue;
+        }
+        double dx = dataset[n].x - centroids[k].x;
+        double dy = dataset[n].y - centroids[k].y;
+        total += dataset[n].weight * (dx * dx + dy * dy);
+    }
+    return total;
+}
+
+/**
+ * Mean silhouette of an evenly spread sample of the points, weighted by the point weights,
+ * with the mean distances to each cluster also taken over the sample.
+ */
+static double sampled_silhouette(struct point *dataset, size_t num_points, int num_clusters)
+{
+    size_t stride = num_points > SILHOUETTE_SAMPLE ? num_points / SILHOUETTE_SAMPLE : 1;
+    size_t sample_size = (num_points + stride - 1) / stride;
+    double total = 0, total_weight = 0;
+#pragma omp parallel reduction(+:total, total_weight)
+    {
+        // per cluster: weighted sum of the distances from the point, and the weight
+        double *distance_sum = malloc(2 * num_clusters * sizeof(double));
+        double *weight = &distance_sum[num_clusters];
+#pragma omp for schedule(dynamic, 16)
+        for (size_t i = 0; i < sample_size; ++i) {
+            struct point *p = &dataset[i * stride];
+            int own = p->cluster;
+            if (own < 0 || own >= num_clusters) {
+                continue;
+            }
+            for (int k = 0; k < 2 * num_clusters; ++k) {
+                distance_sum[k] = 0;
+            }
+            for (size_t j = 0; j < sample_size; ++j) {
+                struct point *q = &dataset[j * stride];
+                if (j == i || q->cluster < 0 || q->cluster >= num_clusters) {
+                    continue;
+                }
+                distance_sum[q->cluster] += q->weight * euclidean_distance(p, q);
+                weight[q->cluster] += q->weight;
+            }
+            if (weight[own] <= 0) {
+                continue; // alone in its cluster in the sample: silhouette 0 by convention
+            }
+            double a = distance_sum[own] / weight[own];
+            double b = -1;
+            for (int k = 0; k < num_clusters; ++k) {
+                if (k != own && weight[k] > 0 && (b < 0 || distance_sum[k] / weight[k] < b)) {
+                    b = distance_sum[k] / weight[k];
+                }
+            }
+            if (b >= 0) {
+                double larger = a > b ? a : b;
+                total += p->weight * (larger > 0 ? (b - a) / larger : 0);
+            }
+            total_weight += p->weight;
+        }
+        free(distance_sum);
+    }
+    return total_weight > 0 ? total / total_weight : 0;
+}
+
+/**
+ * Sizes, radii and the Davies-Bouldin index of the clusters, and an estimate of the mean
+ * silhouette, put in the metrics. Computed after the run and never timed.
+ *
+ * The silhouette of a point compares its mean distance to the other points of its cluster
+ * with its mean distance to the points of the nearest other cluster, which is quadratic in the
+ * number of points: it is estimated on an evenly spread sample of SILHOUETTE_SAMPLE points,
+ * with the distances also taken to the sample only.
+ *
+ * @param dataset set of all points with their final cluster assignments
+ * @param num_points number of points in the dataset
+ * @param centroids final centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @param metrics the cluster sizes (weights), radii, Davies-Bouldin index and silhouette are set here
+ */
+void cluster_quality(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters,
+                     struct kmeans_metrics *metrics)
+{
+    // per cluster: total weight, weighted sum of the distances from the centroid, largest distance
+    double *weight = calloc(num_clusters, sizeof(double));
+    double *distance_sum = calloc(num_clusters, sizeof(double));
+    double *radius = calloc(num_clusters, sizeof(double));
+#pragma omp parallel for schedule(static) reduction(+:weight[:num_clusters], distance_sum[:num_clusters]) \
+        reduction(max:radius[:num_clusters])
+    for (size_t n = 0; n < num_points; ++n) {
+        int k = dataset[n].cluster;
+        if (k < 0 || k >= num_clusters) {
+            continue;
+        }
+        double distance = euclidean_distance(&dataset[n], &centroids[k]);
+        weight[k] += dataset[n].weight;
+        distance_sum[k] += dataset[n].weight * distance;
+        if (distance > radius[k]) {
+            radius[k] = distance;
+        }
+    }
+
+    metrics->min_cluster_size = num_clusters > 0 ? weight[0] : 0;
+    metrics->max_cluster_size = 0;
+    metrics->max_cluster_radius = 0;
+    for (int k = 0; k < num_clusters; ++k) {
+        metrics->min_cluster_size = weight[k] < metrics->min_cluster_size ? weight[k] : metrics->min_cluster_size;
+        metrics->max_cluster_size = weight[k] > metrics->max_cluster_size ? weight[k] : metrics->max_cluster_size;
+        metrics->max_cluster_radius = radius[k] > metrics->max_cluster_radius ? radius[k] : metrics->max_cluster_radius;
+    }
+
+    // Davies-Bouldin: for each cluster the worst ratio of the spread of it and another cluster
+    // to the distance between their centroids, averaged over the clusters. Lower is better.
+    double davies_bouldin = 0;
+    int non_empty = 0;
+#pragma omp parallel for schedule(static) reduction(+:davies_bouldin, non_empty)
+    for (int i = 0; i < num_clusters; ++i) {
+        if (weight[i] <= 0) {
+            continue;
+        }
+        double spread_i = distance_sum[i] / weight[i];
+        double worst = 0;
+        for (int j = 0; j < num_clusters; ++j) {
+            if (j == i || weight[j] <= 0) {
+                continue;
+            }
+            double separation = euclidean_distance(&centroids[i], &centroids[j]);
+            double ratio = separation > 0 ? (spread_i + distance_sum[j] / weight[j]) / separation : 0;
+            worst = ratio > worst ? ratio : worst;
+        }
+        davies_bouldin += worst;
+        non_empty++;
+    }
+    metrics->davies_bouldin = non_empty > 0 ? davies_bouldin / non_empty : 0;
+    metrics->silhouette = sampled_silhouette(dataset, num_points, num_clusters);
+
+    free(weight);
+    free(distance_sum);
+    free(radius);
+}
+
+/**
+ * Adjusted Rand index of the clustering against reference labels for the same points: 1 when
+ * they are the same partition (whatever the cluster numbers), around 0 for chance agreement.
+ *
+ * The contingency table of reference by result clusters is counted in a single parallel pass
+ * over the points, after which the index only needs the table.
+ *
+ * @param reference points with the reference clusters, in the same order as the dataset
+ * @param dataset points with the clusters to compare
+ * @param num_points number of points in both
+ * @return the adjusted Rand index
+ */
+double adjusted_rand_index(struct point *reference, struct point *dataset, size_t num_points)
+{
+    // cluster numbers are shifted up by one so unassigned points (-1) get a row and column too
+    int rows = 0, columns = 0;
+#pragma omp parallel for schedule(static) reduction(max:rows, columns)
+    for (size_t n = 0; n < num_points; ++n) {
+        rows = reference[n].cluster + 2 > rows ? reference[n].cluster + 2 : rows;
+        columns = dataset[n].cluster + 2 > columns ? dataset[n].cluster + 2 : columns;
+    }
+    size_t cells = (size_t)rows * columns;
+    long *table = calloc(cells, sizeof(long));
+#pragma omp parallel for schedule(static) reduction(+:table[:cells])
+    for (size_t n = 0; n < num_points; ++n) {
+        int row = reference[n].cluster + 1 > 0 ? reference[n].cluster + 1 : 0;
+        int column = dataset[n].cluster + 1 > 0 ? dataset[n].cluster + 1 : 0;
+        table[(size_t)row * columns + column]++;
+    }
+
+    // pairs of points in the same cell, the same row and the same column
+    double same_both = 0, same_row = 0, same_column = 0;
+    for (int r = 0; r < rows; ++r) {
+        double row_count = 0;
+        for (int c = 0; c < columns; ++c) {
+            double count = table[(size_t)r * columns + c];
+            same_both += count * (count - 1) / 2;
+            row_count += count;
+        }
+        same_row += row_count * (row_count - 1) / 2;
+    }
+    for (int c = 0; c < columns; ++c) {
+        double column_count = 0;
+        for (int r = 0; r < rows; ++r) {
+            column_count += table[(size_t)r * columns + c];
+        }
+        same_column += column_count * (column_count - 1) / 2;
+    }
+    free(table);
+
+    double pairs = (double)num_points * (num_points - 1) / 2;
+    double expected = pairs > 0 ? same_row * same_column / pairs : 0;
+    double maximum = (same_row + same_column) / 2;
+    return maximum > expected ? (same_both - expected) / (maximum - expected) : 1.0;
+}
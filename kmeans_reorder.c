@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Reordering of the dataset along a Hilbert curve, so points that are next to each other in
+ * the dataset are also close on the map. Neighbouring iterations of the assignment loop then
+ * mostly pick the same cluster (better branch prediction) and each block of points handed to
+ * a thread covers a small area.
+ *
+ * The Hilbert index of each point is calculated on a 2^16 x 2^16 grid over the bounding box of
+ * the dataset, and the points are sorted by it with a parallel LSD radix sort, which is stable
+ * so points in the same grid cell keep their file order.
+ */
+
+#define HILBERT_ORDER 16
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+/**
+ * Distance along the Hilbert curve of the cell (x, y) in a grid of side cells (a power of 2).
+ * See https://en.wikipedia.org/wiki/Hilbert_curve
+ */
+static uint32_t hilbert_index(uint32_t side, uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (uint32_t s = side / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        // rotate the quadrant so the curve continues in the right direction
+        if (ry == 0) {
+            if (rx == 1) {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            uint32_t swap = x;
+            x = y;
+            y = swap;
+        }
+    }
+    return d;
+}
+
+/**
+ * Sort the keys and carry the index along with them: stable, least significant digit first.
+ * Each thread counts and then scatters its own static share of the keys.
+ */
+static void radix_sort(uint32_t *keys, size_t *index, size_t num_points)
+{
+    uint32_t *keys_out = malloc(num_points * sizeof(uint32_t));
+    size_t *index_out = malloc(num_points * sizeof(size_t));
+    size_t *counts = malloc(omp_get_max_threads() * RADIX_BUCKETS * sizeof(size_t));
+
+    for (int shift = 0; shift < 32; shift += RADIX_BITS) {
+#pragma omp parallel
+        {
+            int thread = omp_get_thread_num();
+            int team = omp_get_num_threads();
+            size_t begin = num_points * thread / team;
+            size_t end = num_points * (thread + 1) / team;
+            size_t *count = &counts[thread * RADIX_BUCKETS];
+            for (int b = 0; b < RADIX_BUCKETS; ++b) {
+                count[b] = 0;
+            }
+            for (size_t i = begin; i < end; ++i) {
+                count[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+            }
+#pragma omp barrier
+#pragma omp single
+            {
+                // turn the counts into the first output position of each (bucket, thread)
+                size_t position = 0;
+                for (int b = 0; b < RADIX_BUCKETS; ++b) {
+                    for (int t = 0; t < team; ++t) {
+                        size_t bucket_count = counts[t * RADIX_BUCKETS + b];
+                        counts[t * RADIX_BUCKETS + b] = position;
+                        position += bucket_count;
+                    }
+                }
+            }
+            for (size_t i = begin; i < end; ++i) {
+                size_t to = count[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+                keys_out[to] = keys[i];
+                index_out[to] = index[i];
+            }
+        }
+        uint32_t *swap_keys = keys;
+        keys = keys_out;
+        keys_out = swap_keys;
+        size_t *swap_index = index;
+        index = index_out;
+        index_out = swap_index;
+    }
+    // an even number of passes, so the sorted data is back in the caller's arrays
+    free(keys_out);
+    free(index_out);
+    free(counts);
+}
+
+/**
+ * Sorts the dataset in place along a Hilbert curve over its bounding box.
+ *
+ * @param dataset array of points to reorder
+ * @param num_points size of the array
+ * @return allocated permutation: element i is the original position of the point now at i,
+ *         to be passed to restore_order when the original order is needed again
+ */
+size_t *hilbert_reorder(struct point *dataset, size_t num_points)
+{
+    double min_x = DBL_MAX, min_y = DBL_MAX;
+    double max_x = -DBL_MAX, max_y = -DBL_MAX;
+#pragma omp parallel for reduction(min:min_x, min_y) reduction(max:max_x, max_y)
+    for (size_t n = 0; n < num_points; ++n) {
+        min_x = dataset[n].x < min_x ? dataset[n].x : min_x;
+        min_y = dataset[n].y < min_y ? dataset[n].y : min_y;
+        max_x = dataset[n].x > max_x ? dataset[n].x : max_x;
+        max_y = dataset[n].y > max_y ? dataset[n].y : max_y;
+    }
+    uint32_t side = 1u << HILBERT_ORDER;
+    double scale_x = max_x > min_x ? (side - 1) / (max_x - min_x) : 0.0;
+    double scale_y = max_y > min_y ? (side - 1) / (max_y - min_y) : 0.0;
+
+    uint32_t *keys = malloc(num_points * sizeof(uint32_t));
+    size_t *order = malloc(num_points * sizeof(size_t));
+#pragma omp parallel for schedule(static)
+    for (size_t n = 0; n < num_points; ++n) {
+        uint32_t x = (uint32_t)((dataset[n].x - min_x) * scale_x);
+        uint32_t y = (uint32_t)((dataset[n].y - min_y) * scale_y);
+        keys[n] = hilbert_index(side, x, y);
+        order[n] = n;
+    }
+    radix_sort(keys, order, num_points);
+    free(keys);
+
+    struct point *sorted = malloc(num_points * sizeof(struct point));
+#pragma omp parallel for schedule(static)
+    for (size_t n = 0; n < num_points; ++n) {
+        sorted[n] = dataset[order[n]];
+    }
+    memcpy(dataset, sorted, num_points * sizeof(struct point));
+    free(sorted);
+    return order;
+}
+
+/**
+ * Puts the points of a dataset reordered by hilbert_reorder back in their original order,
+ * with the cluster assignments they have now.
+ *
+ * @param dataset array of reordered points
+ * @param num_points size of the array
+ * @param order permutation returned by hilbert_reorder
+ */
+void restore_order(struct point *dataset, size_t num_points, size_t *order)
+{
+    struct point *original = malloc(num_points * sizeof(struct point));
+#pragma omp parallel for schedule(static)
+    for (size_t n = 0; n < num_points; ++n) {
+        original[order[n]] = dataset[n];
+    }
+    memcpy(dataset, original, num_points * sizeof(struct point));
+    free(original);
+}
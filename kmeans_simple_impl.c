@@ -15,13 +15,13 @@
  * @param num_clusters number of clusters - hence size of the centroids array
  * @return the number of points for which the cluster assignment was changed
  */
-int assign_clusters(struct point* dataset, int num_points, struct point *centroids, int num_clusters)
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
 {
 #ifdef DEBUG
     printf("\nStarting assignment phase:\n");
 #endif
-    int cluster_changes = 0;
-    for (int n = 0; n < num_points; ++n) {
+    size_t cluster_changes = 0;
+    for (size_t n = 0; n < num_points; ++n) {
         double min_distance = DBL_MAX; // init the min distance to a big number
         int closest_cluster = -1;
         for (int k = 0; k < num_clusters; ++k) {
@@ -46,7 +46,8 @@ int assign_clusters(struct point* dataset, int num_points, struct point *centroi
 
 /**
  * Calculates new centroids for the clusters of the given dataset by finding the
- * mean x and y coordinates of the current members of the cluster for each cluster.
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
  *
  * The centroids are set in the array passed in, which is expected to be pre-allocated
  * and contain the previous centroids: these are overwritten by the new values.
@@ -56,37 +57,49 @@ int assign_clusters(struct point* dataset, int num_points, struct point *centroi
  * @param centroids array to hold the centroids - already allocated
  * @param num_clusters number of clusters - hence size of the centroids array
  */
-void calculate_centroids(struct point* dataset, int num_points, struct point *centroids, int num_clusters)
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
 {
-    double sum_of_x_per_cluster[num_clusters];
-    double sum_of_y_per_cluster[num_clusters];
-    int num_points_in_cluster[num_clusters];
+    // the sums live in the workspace instead of on the stack, which would overflow at large k
+    double *sums = workspace_buffer(WORKSPACE_PARTIALS, 3 * num_clusters * sizeof(double));
+    double *sum_of_x_per_cluster = sums;
+    double *sum_of_y_per_cluster = &sums[num_clusters];
+    double *weight_of_cluster = &sums[2 * num_clusters];
     for (int k = 0; k < num_clusters; ++k) {
         sum_of_x_per_cluster[k] = 0.0;
         sum_of_y_per_cluster[k] = 0.0;
-        num_points_in_cluster[k] = 0;
+        weight_of_cluster[k] = 0.0;
     }
 
     // loop over all points in the database and sum up
     // the x coords of clusters to which each belongs
-    for (int n = 0; n < num_points; ++n) {
+    for (size_t n = 0; n < num_points; ++n) {
         // use pointer to struct to avoid creating unnecessary copy in memory
         struct point *p = &dataset[n];
         int k = p->cluster;
-        sum_of_x_per_cluster[k] += p->x;
-        sum_of_y_per_cluster[k] += p->y;
-        // count the points in the cluster to get a mean later
-        num_points_in_cluster[k]++;
+        sum_of_x_per_cluster[k] += p->weight * p->x;
+        sum_of_y_per_cluster[k] += p->weight * p->y;
+        // add up the weights (point counts unless the points were aggregated) to get a mean later
+        weight_of_cluster[k] += p->weight;
     }
 
     // the new centroids are at the mean x and y coords of the clusters
     for (int k = 0; k < num_clusters; ++k) {
         struct point new_centroid;
         // mean x, mean y => new centroid
-        new_centroid.x = sum_of_x_per_cluster[k] / num_points_in_cluster[k];
-        new_centroid.y = sum_of_y_per_cluster[k] / num_points_in_cluster[k];
+        new_centroid.x = sum_of_x_per_cluster[k] / weight_of_cluster[k];
+        new_centroid.y = sum_of_y_per_cluster[k] / weight_of_cluster[k];
         centroids[k] = new_centroid;
     }
 }
 
-
+/**
+ * Sizes the workspace for a run: calculate_centroids needs one set of cluster sums.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    (void)num_points; // the scratch space depends on the clusters only
+    workspace_buffer(WORKSPACE_PARTIALS, 3 * num_clusters * sizeof(double));
+}
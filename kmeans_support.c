@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <getopt.h>
 #include <unistd.h>
 #include "csvhelper.h"
@@ -8,21 +10,87 @@
 #include <math.h>
 #include <omp.h>
 
+struct engine_stats engine_stats;
+struct cluster_hierarchy cluster_hierarchy;
+
+// p_to_s formats into a small ring of buffers per thread instead of allocating a string per call
+#define POINT_STRINGS 8
+#define POINT_STRING_SIZE 64
+static char point_strings[POINT_STRINGS][POINT_STRING_SIZE];
+static int next_point_string = 0;
+#pragma omp threadprivate(point_strings, next_point_string)
+
+// options that only have a long form start after the last char so they can't clash with short ones
+enum long_only_options {
+    OPT_REORDER = 256,
+    OPT_SAVE_MODEL,
+    OPT_WARM_START,
+    OPT_PREDICT,
+    OPT_DEDUP,
+    OPT_GRID,
+    OPT_CORESET,
+    OPT_CORESET_COMPARE,
+    OPT_AUTOTUNE,
+    OPT_TUNING_FILE,
+    OPT_K_RANGE,
+    OPT_HIERARCHY,
+    OPT_PIPELINE,
+    OPT_GENERATE,
+    OPT_NOISE,
+    OPT_SEED,
+    OPT_TRUTH,
+    OPT_CHECKPOINT,
+    OPT_CHECKPOINT_EVERY,
+    OPT_RESUME,
+    OPT_PROGRESS,
+    OPT_PROGRESS_EVERY,
+    OPT_GEO,
+    OPT_BATCH,
+};
+
 /**
  * Initialize a new kmeans_config to hold the run configuration set from the command line
  */
 struct kmeans_config new_config()
 {
     struct kmeans_config new_config;
+    new_config.in_file = NULL;
     new_config.out_file = NULL;
     new_config.test_file = NULL;
     new_config.metrics_file = NULL;
     new_config.label = "no-label";
-    new_config.max_points = MAX_POINTS;
+    new_config.max_points = 0; // all of them
     new_config.num_clusters = NUM_CLUSTERS;
     new_config.max_iterations = MAX_ITERATIONS;
     new_config.silent = false;
     new_config.quiet = false;
+    new_config.reorder = false;
+    new_config.save_model = NULL;
+    new_config.warm_start = NULL;
+    new_config.predict_model = NULL;
+    new_config.dedup = false;
+    new_config.grid_cell = 0.0;
+    new_config.coreset_size = 0;
+    new_config.coreset_compare = false;
+    new_config.autotune = false;
+    new_config.tuning_file = NULL;
+    new_config.engine = "kmeans";
+    new_config.k_max = 0;
+    new_config.hierarchy_file = NULL;
+    new_config.pipeline = false;
+    new_config.generate = NULL;
+    new_config.noise = 0.01;
+    new_config.seed = 1;
+    new_config.truth_file = NULL;
+    new_config.checkpoint_file = NULL;
+    new_config.checkpoint_iterations = 0;
+    new_config.checkpoint_seconds = 60.0;
+    new_config.resume = false;
+    new_config.progress_file = NULL;
+    new_config.progress_seconds = 0;
+    new_config.geo = false;
+    new_config.batch_file = NULL;
+    new_config.batch_job = false;
     return new_config;
 }
 
@@ -37,6 +105,34 @@ struct kmeans_metrics new_metrics()
     new_metrics.assignment_seconds = 0;
     new_metrics.total_seconds = 0;
     new_metrics.max_iteration_seconds = 0;
+    new_metrics.reorder_seconds = 0;
+    new_metrics.communication_seconds = 0;
+    new_metrics.mpi_ranks = 1;
+    new_metrics.aggregate_seconds = 0;
+    new_metrics.aggregated_points = 0;
+    new_metrics.coreset_seconds = 0;
+    new_metrics.coreset_points = 0;
+    new_metrics.tuning_iterations = 0;
+    new_metrics.peak_rss_kb = 0;
+    new_metrics.loop_allocations = 0;
+    new_metrics.min_cluster_size = 0;
+    new_metrics.max_cluster_size = 0;
+    new_metrics.max_cluster_radius = 0;
+    new_metrics.davies_bouldin = 0;
+    new_metrics.silhouette = 0;
+    new_metrics.adjusted_rand = NAN; // not tested
+    new_metrics.load_seconds = 0;
+    new_metrics.test_load_seconds = 0;
+    new_metrics.output_seconds = 0;
+    new_metrics.quality_seconds = 0;
+    new_metrics.wall_seconds = 0;
+    new_metrics.resumed_iterations = 0;
+    new_metrics.resumed_seconds = 0;
+    new_metrics.checkpoints = 0;
+    new_metrics.checkpoint_seconds = 0;
+    new_metrics.projection_seconds = 0;
+    new_metrics.inertia = 0;
+    new_metrics.inertia_gap = 0;
     new_metrics.used_iterations = 0;
     new_metrics.test_result = 0; // zero = no test performed
     new_metrics.num_points = 0;
@@ -44,6 +140,7 @@ struct kmeans_metrics new_metrics()
     new_metrics.max_iterations = 0;
     new_metrics.omp_max_threads = -1;
     new_metrics.omp_schedule_kind = -1; // if we see -1 then the kind was not fetched
+    new_metrics.engine = (struct engine_stats) {0};
     return new_metrics;
 }
 
@@ -138,22 +235,34 @@ double euclidean_distance(struct point *p1, struct point *p2)
 
 void usage()
 {
-    fprintf(stderr, "Usage: kmeans -f data.csv [-o OUTPUT.CSV] [-i MAX_ITERATIONS] [-n MAX_POINTS] [-k NUM_CLUSTERS] [-t TESTFILE.CSV]\n");
+    fprintf(stderr, "Usage: kmeans -f data.csv [-o OUTPUT.CSV] [-i MAX_ITERATIONS] [-n MAX_POINTS] [-k NUM_CLUSTERS] [-t TESTFILE.CSV]\n"
+                    "              [-m METRICS.CSV] [-l LABEL] [-s] [-q] [--reorder]\n"
+                    "              [--save-model MODEL] [--warm-start MODEL] [--predict MODEL]\n"
+                    "              [--dedup] [--grid CELL] [--coreset POINTS] [--coreset-compare]\n"
+                    "              [--autotune] [--tuning-file FILE] [--k-range MIN:MAX]\n"
+                    "              [--hierarchy FILE] [--pipeline]\n"
+                    "              [--checkpoint FILE] [--checkpoint-every ITERATIONS|SECONDSs] [--resume]\n"
+                    "              [--progress FILE|-] [--progress-every SECONDS] [--geo]\n"
+                    "       kmeans --batch MANIFEST.CSV [-k NUM_CLUSTERS] [-m METRICS.CSV] [other options for every job]\n"
+                    "       kmeans --generate blobs|uniform|gps -n POINTS [-k CLUSTERS] -o OUT.CSV|OUT.BIN\n"
+                    "              [--noise SIGMA] [--seed SEED] [--truth TEST.CSV]\n");
     exit(1);
 }
 
 /**
  * Convert a point to a string with a standard precision
  *
+ * The string is in a buffer of the calling thread that is reused after POINT_STRINGS more
+ * calls, so up to that many can be used in one printf: copy it to keep it longer.
+ *
  * @param p point to print to string
- * @return allocated string holding point
+ * @return string holding point, not to be freed
  */
 const char *p_to_s(struct point *p)
 {
-    // TODO this eats a lot of memory when in a big loop - consider passing in a string to reuse
-    // but for now we keep string printing out of timed sections so it won't have much affect
-    char *result = malloc(50 * sizeof(char)); // big enough for 2 points
-    sprintf(result, "%.7f,%.7f", p->x, p->y);
+    char *result = point_strings[next_point_string];
+    next_point_string = (next_point_string + 1) % POINT_STRINGS;
+    snprintf(result, POINT_STRING_SIZE, "%.7f,%.7f", p->x, p->y);
     return result;
 }
 
@@ -164,8 +273,8 @@ const char *p_to_s(struct point *p)
  * @param dataset array of points
  * @param num_points size of the array
  */
-void print_points(FILE *out, struct point *dataset, int num_points) {
-    for (int i = 0; i < num_points; ++i) {
+void print_points(FILE *out, struct point *dataset, size_t num_points) {
+    for (size_t i = 0; i < num_points; ++i) {
         fprintf(out, "%s,cluster_%d\n", p_to_s(&dataset[i]), dataset[i].cluster);
     }
 }
@@ -175,10 +284,10 @@ void print_points(FILE *out, struct point *dataset, int num_points) {
  *
  * @param out file pointer for output
  * @param centroids array of centroid points
- * @param num_points number of centroids == number of clusters
+ * @param num_clusters number of centroids
  */
-void print_centroids(FILE *out, struct point *centroids, int num_points) {
-    for (int i = 0; i < num_points; ++i) {
+void print_centroids(FILE *out, struct point *centroids, int num_clusters) {
+    for (int i = 0; i < num_clusters; ++i) {
         fprintf(out, "centroid[%d] is at %s\n", i, p_to_s(&centroids[i]));
     }
 }
@@ -211,7 +320,13 @@ void print_metrics_headers(FILE *out)
     fprintf(out, "label,used_iterations,total_seconds,assignments_seconds,"
                  "centroids_seconds,max_iteration_seconds,num_points,"
                  "num_clusters,max_iterations,max_threads,omp_schedule,omp_chunk_size,"
-                 "test_results\n");
+                 "test_results,work_blocks,work_steals,block_seconds,max_block_seconds,block_grain,full_recomputes,reorder_seconds,"
+                 "communication_seconds,mpi_ranks,aggregated_points,aggregate_seconds,"
+                 "coreset_points,coreset_seconds,inertia,inertia_gap,index_build_seconds,index_query_seconds,"
+                 "distance_calculations,tuning_iterations,peak_rss_kb,loop_allocations,"
+                 "min_cluster_size,max_cluster_size,max_cluster_radius,davies_bouldin,silhouette,adjusted_rand,"
+                 "load_seconds,test_load_seconds,output_seconds,quality_seconds,wall_seconds,"
+                 "resumed_iterations,resumed_seconds,checkpoints,checkpoint_seconds,projection_seconds\n");
 }
 
 /**
@@ -230,32 +345,52 @@ void print_metrics(FILE *out, struct kmeans_metrics *metrics)
             test_results = "FAILED!";
             break;
     }
-    fprintf(out, "%s,%d,%f,%f,%f,%f,%d,%d,%d,%d,%d,%d,%s\n",
+    fprintf(out, "%s,%d,%f,%f,%f,%f,%zu,%d,%d,%d,%d,%d,%s,%ld,%ld,%f,%f,%d,%ld,%f,%f,%d,%zu,%f,%zu,%f,%f,%f,%f,%f,%ld,%d,%ld,%ld,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%d,%f,%ld,%f,%f\n",
             metrics->label, metrics->used_iterations, metrics->total_seconds,
             metrics->assignment_seconds, metrics->centroids_seconds, metrics->max_iteration_seconds,
             metrics->num_points, metrics->num_clusters, metrics->max_iterations,
             metrics->omp_max_threads, metrics->omp_schedule_kind, metrics->omp_chunk_size,
-            test_results);
+            test_results, metrics->engine.work_blocks, metrics->engine.work_steals,
+            metrics->engine.block_seconds, metrics->engine.max_block_seconds, metrics->engine.block_grain,
+            metrics->engine.full_recomputes, metrics->reorder_seconds,
+            metrics->communication_seconds, metrics->mpi_ranks,
+            metrics->aggregated_points, metrics->aggregate_seconds,
+            metrics->coreset_points, metrics->coreset_seconds, metrics->inertia, metrics->inertia_gap,
+            metrics->engine.index_build_seconds, metrics->engine.index_query_seconds,
+            metrics->engine.distance_calculations, metrics->tuning_iterations,
+            metrics->peak_rss_kb, metrics->loop_allocations,
+            metrics->min_cluster_size, metrics->max_cluster_size, metrics->max_cluster_radius,
+            metrics->davies_bouldin, metrics->silhouette, metrics->adjusted_rand,
+            metrics->load_seconds, metrics->test_load_seconds, metrics->output_seconds,
+            metrics->quality_seconds, metrics->wall_seconds, metrics->resumed_iterations,
+            metrics->resumed_seconds, metrics->checkpoints, metrics->checkpoint_seconds,
+            metrics->projection_seconds);
 }
 
 /**
  * Read 2-dimensional points from the CSV file with headers.
  *
+ * Without a max the size of the file is not known up front, so the array starts with room
+ * for INITIAL_POINTS points and doubles whenever it is full: the copying adds up to less
+ * than one more pass over the points. With a max it is allocated once at that size.
+ *
  * @param csv_file file pointer to the input file
- * @param dataset pre-allocated array of points into which to read the file
- * @param max_points max number of points to read
+ * @param dataset set to the allocated array of points read from the file
+ * @param max_points max number of points to read, 0 to read them all
  * @param headers if not null, pre-allocated string array to hold the headers
  * @param dimensions number of headers
  *
  * @return number of actual points read from the file
  */
-int read_csv(FILE* csv_file, struct point *dataset, int max_points, char *headers[], int *dimensions)
+size_t read_csv(FILE* csv_file, struct point **dataset, size_t max_points, char *headers[], int *dimensions)
 {
     char *line;
     *dimensions = csvheaders(csv_file, headers);
     int max_fields = *dimensions > 2 ? 3 : 2; // max is 2 unless there is a cluster in which case 3
-    int count = 0;
-    while (count < max_points && (line = csvgetline(csv_file)) != NULL) {
+    size_t capacity = max_points > 0 ? max_points : INITIAL_POINTS;
+    struct point *points = malloc(capacity * sizeof(struct point));
+    size_t count = 0;
+    while ((max_points == 0 || count < max_points) && (line = csvgetline(csv_file)) != NULL) {
         int num_fields = csvnfield(); // fields on the line
 #ifdef DEBUG
         if (num_fields > max_fields) {
@@ -269,6 +404,7 @@ int read_csv(FILE* csv_file, struct point *dataset, int max_points, char *header
         else {
             struct point new_point;
             new_point.cluster = -1; // -1 => no cluster yet assigned
+            new_point.weight = 1.0; // every row counts once unless the points are aggregated later
             char *x_string = csvfield(0);
             char *y_string = csvfield(1);
             new_point.x = strtod(x_string, NULL);
@@ -281,34 +417,88 @@ int read_csv(FILE* csv_file, struct point *dataset, int max_points, char *header
                 sscanf(cluster_string,"%[^0-9]%d", prefix, &cluster);
                 new_point.cluster = cluster;
             }
-            dataset[count] = new_point;
+            if (count == capacity) {
+                capacity *= 2;
+                points = realloc(points, capacity * sizeof(struct point));
+            }
+            if (!points) {
+                fprintf(stderr, "Error: out of memory after reading %zu points\n", count);
+                exit(1);
+            }
+            points[count] = new_point;
             count++;
         }
     }
     fclose(csv_file);
+    *dataset = points;
     return count;
 }
 
 /**
+ * True if the file name ends in .bin, for the binary points format
+ */
+bool binary_file_name(char *file_name)
+{
+    size_t length = strlen(file_name);
+    return length >= 4 && strcmp(&file_name[length - 4], ".bin") == 0;
+}
+
+/**
+ * Read points from a binary points file: BINARY_POINTS_MAGIC, the number of points as a
+ * 64 bit integer, then the x and y of each point as doubles, all in the byte order of the
+ * machine. Much faster to read than csv for large generated datasets.
+ */
+static size_t read_binary(FILE *binary_file, struct point **dataset, size_t max_points, char *headers[], int *dimensions)
+{
+    char magic[8];
+    uint64_t count;
+    if (fread(magic, 1, 8, binary_file) != 8 || memcmp(magic, BINARY_POINTS_MAGIC, 8) != 0
+        || fread(&count, sizeof(count), 1, binary_file) != 1) {
+        fprintf(stderr, "Error: not a binary points file\n");
+        exit(1);
+    }
+    size_t num_points = max_points > 0 && max_points < count ? max_points : (size_t)count;
+    struct point *points = malloc((num_points > 0 ? num_points : 1) * sizeof(struct point));
+    double xy[2];
+    size_t n = 0;
+    while (n < num_points && fread(xy, sizeof(double), 2, binary_file) == 2) {
+        points[n].x = xy[0];
+        points[n].y = xy[1];
+        points[n].cluster = -1;
+        points[n].weight = 1.0;
+        n++;
+    }
+    fclose(binary_file);
+    if (headers) {
+        headers[0] = "x";
+        headers[1] = "y";
+    }
+    *dimensions = 2;
+    *dataset = points;
+    return n;
+}
+
+/**
+ * Read points from a csv file, or from a binary points file if the file name ends in .bin,
+ * exiting if it cannot be read.
  *
- * Write a Comma-Separated-Values file with points and cluster assignments
- * to the specified file path.
- *
- * IF the file exists it is silently overwritten.
- *
- * @param csv_file_name absolute path to the file to be written
- * @param dataset array of all points with cluster information
- * @param num_points size of the array of points
- * @param headers optional headers to put at the top of the file
- * @param dimensions number of headers
+ * @param csv_file_name path to the file to read
+ * @param dataset set to the points read, allocated here
+ * @param max_points read at most this many points, 0 for all of them
+ * @param headers set to the headers of the file
+ * @param dimensions set to the number of headers
+ * @return the number of points read
 */
-int read_csv_file(char* csv_file_name, struct point *dataset, int max_points, char *headers[], int *dimensions)
+size_t read_csv_file(char* csv_file_name, struct point **dataset, size_t max_points, char *headers[], int *dimensions)
 {
-    FILE *csv_file = fopen(csv_file_name, "r");
+    FILE *csv_file = fopen(csv_file_name, "rb");
     if (!csv_file) {
         fprintf(stderr, "Error: cannot read the input file at %s\n", csv_file_name);
         exit(1);
     }
+    if (binary_file_name(csv_file_name)) {
+        return read_binary(csv_file, dataset, max_points, headers, dimensions);
+    }
     return read_csv(csv_file, dataset, max_points, headers, dimensions);
 }
 
@@ -321,7 +511,7 @@ int read_csv_file(char* csv_file_name, struct point *dataset, int max_points, ch
  * @param headers optional headers to put at the top of the file
  * @param dimensions number of headers
  */
-void write_csv(FILE *csv_file, struct point *dataset, int num_points, char *headers[], int dimensions)
+void write_csv(FILE *csv_file, struct point *dataset, size_t num_points, char *headers[], int dimensions)
 {
     if (headers != NULL) {
         print_headers(csv_file, headers, dimensions);
@@ -330,7 +520,7 @@ void write_csv(FILE *csv_file, struct point *dataset, int num_points, char *head
     print_points(csv_file, dataset, num_points);
 }
 
-void write_csv_file(char *csv_file_name, struct point *dataset, int num_points, char *headers[], int dimensions) {
+void write_csv_file(char *csv_file_name, struct point *dataset, size_t num_points, char *headers[], int dimensions) {
     FILE *csv_file = fopen(csv_file_name, "w");
     if (!csv_file) {
         fprintf(stderr, "Error: cannot write to the output file at %s\n", csv_file_name);
@@ -338,6 +528,7 @@ void write_csv_file(char *csv_file_name, struct point *dataset, int num_points,
     }
 
     write_csv(csv_file, dataset, num_points, headers, dimensions);
+    fclose(csv_file); // a batch writes thousands of files in one process
 }
 
 void write_metrics_file(char *metrics_file_name, struct kmeans_metrics *metrics) {
@@ -345,7 +536,7 @@ void write_metrics_file(char *metrics_file_name, struct kmeans_metrics *metrics)
     bool first_time = false;
     if (access(metrics_file_name, F_OK ) == -1 ) {
         // first time - lets change the mode to "w" and append
-        fprintf(stdout, "Creating metrics file and adding headers: %s", metrics_file_name);
+        fprintf(stdout, "Creating metrics file and adding headers: %s\n", metrics_file_name);
         first_time = true;
         mode = "w";
     }
@@ -355,6 +546,7 @@ void write_metrics_file(char *metrics_file_name, struct kmeans_metrics *metrics)
     }
 
     print_metrics(metrics_file, metrics);
+    fclose(metrics_file);
 }
 
 char* valid_file(char opt, char *filename)
@@ -376,12 +568,69 @@ int valid_count(char opt, char *arg)
     return value;
 }
 
+size_t valid_size(char opt, char *arg)
+{
+    char *end;
+    long long value = strtoll(arg, &end, 10);
+    if (value <= 0 || *end != '\0') {
+        fprintf(stderr, "Error: The option '%c' expects a counting number (got %s)\n", opt, arg);
+        usage();
+    }
+    return (size_t)value;
+}
+
 void validate_config(struct kmeans_config config)
 {
+    if (config.generate) {
+        if (!config.out_file || config.max_points == 0) {
+            fprintf(stderr, "You must provide an output file with -o and the number of points with -n to generate\n");
+            usage();
+        }
+        if (config.truth_file && strcmp(config.generate, "uniform") == 0) {
+            fprintf(stderr, "Uniform points have no clusters to write to the truth file\n");
+            usage();
+        }
+        if (!config.quiet) {
+            printf("Generate      : %zu %s points, %d clusters, noise %g, seed %llu\n", config.max_points,
+                   config.generate, config.num_clusters, config.noise, config.seed);
+            printf("Output file   : %-10s\n", config.out_file);
+            if (config.truth_file) {
+                printf("Truth file    : %-10s\n", config.truth_file);
+            }
+        }
+        return;
+    }
+    if (config.batch_file) {
+        if (config.in_file || config.out_file || config.test_file) {
+            fprintf(stderr, "The input, output and test files of a batch are in its manifest\n");
+            usage();
+        }
+        if (config.predict_model || config.k_max > 0 || config.autotune || config.pipeline || config.save_model
+            || config.hierarchy_file || config.checkpoint_file || config.progress_file || config.progress_seconds > 0) {
+            fprintf(stderr, "A batch cannot --predict, --k-range, --autotune, --pipeline, --save-model, --hierarchy, "
+                            "--checkpoint or --progress: these are for a single input\n");
+            usage();
+        }
+        if (!config.quiet) {
+            printf("Batch         : %-10s\n", config.batch_file);
+            printf("Metrics file  : %-10s\n", config.metrics_file);
+            printf("Num clusters  : %-10d (unless the manifest says)\n", config.num_clusters);
+            printf("Max iterations: %-10d\n", config.max_iterations);
+        }
+        return;
+    }
     if (!config.in_file) {
         fprintf(stderr, "You must at least provide an input file with -f\n");
         usage();
     }
+    if (config.resume && !config.checkpoint_file) {
+        fprintf(stderr, "You must provide the checkpoint file to resume from with --checkpoint\n");
+        usage();
+    }
+    if (config.checkpoint_file && config.k_max > 0) {
+        fprintf(stderr, "A --k-range sweep runs many fits and cannot be checkpointed\n");
+        usage();
+    }
 
     if (!config.quiet) {
         printf("Config:\n");
@@ -390,51 +639,132 @@ void validate_config(struct kmeans_config config)
         printf("Test file     : %-10s\n", config.test_file);
         printf("Metrics file  : %-10s\n", config.metrics_file);
         printf("Num clusters  : %-10d\n", config.num_clusters);
-        printf("Max points    : %-10d\n", config.max_points);
+        if (config.max_points > 0) {
+            printf("Max points    : %-10zu\n", config.max_points);
+        }
+        else {
+            printf("Max points    : %-10s\n", "all");
+        }
         printf("Max iterations: %-10d\n", config.max_iterations);
+        printf("Reorder       : %-10s\n", config.reorder ? "hilbert" : "no");
+        if (config.warm_start) {
+            printf("Warm start    : %-10s\n", config.warm_start);
+        }
+        if (config.save_model) {
+            printf("Save model    : %-10s\n", config.save_model);
+        }
+        if (config.hierarchy_file) {
+            printf("Hierarchy     : %-10s\n", config.hierarchy_file);
+        }
+        if (config.predict_model) {
+            printf("Predict with  : %-10s\n", config.predict_model);
+        }
+        if (config.grid_cell > 0) {
+            printf("Aggregate     : grid of %g\n", config.grid_cell);
+        }
+        else if (config.dedup) {
+            printf("Aggregate     : duplicates\n");
+        }
+        if (config.coreset_size > 0) {
+            printf("Coreset       : %-10zu\n", config.coreset_size);
+        }
+        if (config.autotune) {
+            printf("Autotune      : %-10s\n", config.tuning_file ? config.tuning_file : "yes");
+        }
+        if (config.k_max > 0) {
+            printf("K range       : %d:%d\n", config.num_clusters, config.k_max);
+        }
+        if (config.geo) {
+            printf("Geo           : longitude, latitude projected to km\n");
+        }
+        if (config.pipeline) {
+            printf("Pipeline      : yes\n");
+        }
+        if (config.checkpoint_file) {
+            if (config.checkpoint_iterations > 0) {
+                printf("Checkpoint    : %s every %d iterations%s\n", config.checkpoint_file,
+                       config.checkpoint_iterations, config.resume ? ", resume" : "");
+            }
+            else {
+                printf("Checkpoint    : %s every %g seconds%s\n", config.checkpoint_file,
+                       config.checkpoint_seconds, config.resume ? ", resume" : "");
+            }
+        }
+        if (config.progress_file || config.progress_seconds > 0) {
+            if (config.progress_seconds > 0) {
+                printf("Progress      : %s every %g seconds and on SIGUSR1\n",
+                       config.progress_file ? config.progress_file : "-", config.progress_seconds);
+            }
+            else {
+                printf("Progress      : %s on SIGUSR1\n", config.progress_file);
+            }
+        }
     }
 }
 
 /**
- * Compares the dataset against test file.
+ * Compares the dataset against a test dataset read from a test file.
  *
  * If every point in the dataset has a matching point at the same position in the
- * test dataset from the test file, and the clusters match, then 1 is returned,
- * otherwise -1 is returned indicating a failure.
+ * test dataset, and the clusters match, then 1 is returned, otherwise -1 is returned
+ * indicating a failure.
  *
  * Note that the test file may have more points than the dataset - trailing points are ignored
  * in this case - but if it has fewer points, this is considered a test failure.
  *
  * The method returns -1 after the first failure.
  *
+ * Since cluster numbers can differ without the clusters being any different, the adjusted Rand
+ * index of the clusters against those of the test dataset is also worked out.
+ *
+ * @param config
+ * @param testset expected points with their clusters, read from the test file
+ * @param num_test_points size of the test dataset
+ * @param dataset
+ * @param num_points
+ * @param adjusted_rand set to the adjusted Rand index if the test dataset has enough points, if not NULL
+ * @return 1 or -1 if the datasets match
+ */
+int test_results(struct kmeans_config *config, struct point *testset, size_t num_test_points,
+                 struct point *dataset, size_t num_points, double *adjusted_rand)
+{
+    int result = compare_results(config, testset, num_test_points, dataset, num_points);
+    if (adjusted_rand && num_test_points >= num_points) {
+        *adjusted_rand = adjusted_rand_index(testset, dataset, num_points);
+    }
+    return result;
+}
+
+/**
+ * Compares the dataset against a test dataset already read from a test file.
+ *
  * @param config
+ * @param testset expected points with their clusters
+ * @param num_test_points size of the test dataset
  * @param dataset
  * @param num_points
- * @return 1 or -1 if the files match
+ * @return 1 or -1 if the datasets match
  */
-int test_results(struct kmeans_config *config, char* test_file_name, struct point *dataset, int num_points)
+int compare_results(struct kmeans_config *config, struct point *testset, size_t num_test_points,
+                    struct point *dataset, size_t num_points)
 {
     int result = 1;
-    struct point *testset = malloc((num_points + 10) * sizeof(struct point));
-    int test_dimensions;
-    static char* test_headers[3];
-    int num_test_points = read_csv_file(test_file_name, testset, num_points, test_headers, &test_dimensions);
     if (num_test_points < num_points) {
         if (!config->silent) {
-        fprintf(stderr, "Test failed. The test dataset has only %d records, but needs at least %d",
+        fprintf(stderr, "Test failed. The test dataset has only %zu records, but needs at least %zu",
                 num_test_points, num_points);
         }
-        result = 1;
+        result = -1;
     }
     else {
-        for (int n = 0; n < num_points; ++n) {
+        for (size_t n = 0; n < num_points; ++n) {
             struct point *p = &dataset[n];
             struct point *test_p = &testset[n];
             if (test_p->x == p->x && test_p->y == p->y) {
                 if (test_p->cluster != p->cluster) {
                     // points match but assigned to different clusters
                     if (!config->silent) {
-                        fprintf(stderr, "Test failure at %d: (%s) result cluster: %d does not match test: %d\n",
+                        fprintf(stderr, "Test failure at %zu: (%s) result cluster: %d does not match test: %d\n",
                                 n + 1, p_to_s(p), p->cluster, test_p->cluster);
                     }
                     result = -1;
@@ -442,7 +772,7 @@ int test_results(struct kmeans_config *config, char* test_file_name, struct poin
                 }
 #ifdef TRACE
                 else {
-                    fprintf(stdout, "Test success at %d: (%s) clusters match: %d\n",
+                    fprintf(stdout, "Test success at %zu: (%s) clusters match: %d\n",
                             n+1, p_to_s(p), p->cluster);
 
                 }
@@ -451,7 +781,7 @@ int test_results(struct kmeans_config *config, char* test_file_name, struct poin
             else {
                 // points themselves are different
                 if (!config->silent) {
-                fprintf(stderr, "Test failure at %d: %s does not match test point: %s\n",
+                fprintf(stderr, "Test failure at %zu: %s does not match test point: %s\n",
                         n+1, p_to_s(p), p_to_s(test_p));
 
                 }
@@ -476,9 +806,150 @@ struct kmeans_config parse_cli(int argc, char *argv[])
         usage();
     }
 
-    while((opt = getopt(argc, argv, "f:i:o:k:n:l:t:m:sq")) != -1)
+    // the engine is the program: kmeans_omp1, kmeans_grid, ...
+    char *slash = strrchr(argv[0], '/');
+    config.engine = slash ? slash + 1 : argv[0];
+
+    static struct option long_options[] = {
+            {"reorder", no_argument, NULL, OPT_REORDER},
+            {"save-model", required_argument, NULL, OPT_SAVE_MODEL},
+            {"warm-start", required_argument, NULL, OPT_WARM_START},
+            {"predict", required_argument, NULL, OPT_PREDICT},
+            {"dedup", no_argument, NULL, OPT_DEDUP},
+            {"grid", required_argument, NULL, OPT_GRID},
+            {"coreset", required_argument, NULL, OPT_CORESET},
+            {"coreset-compare", no_argument, NULL, OPT_CORESET_COMPARE},
+            {"autotune", no_argument, NULL, OPT_AUTOTUNE},
+            {"tuning-file", required_argument, NULL, OPT_TUNING_FILE},
+            {"k-range", required_argument, NULL, OPT_K_RANGE},
+            {"hierarchy", required_argument, NULL, OPT_HIERARCHY},
+            {"pipeline", no_argument, NULL, OPT_PIPELINE},
+            {"generate", required_argument, NULL, OPT_GENERATE},
+            {"noise", required_argument, NULL, OPT_NOISE},
+            {"seed", required_argument, NULL, OPT_SEED},
+            {"truth", required_argument, NULL, OPT_TRUTH},
+            {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+            {"checkpoint-every", required_argument, NULL, OPT_CHECKPOINT_EVERY},
+            {"resume", no_argument, NULL, OPT_RESUME},
+            {"progress", required_argument, NULL, OPT_PROGRESS},
+            {"progress-every", required_argument, NULL, OPT_PROGRESS_EVERY},
+            {"geo", no_argument, NULL, OPT_GEO},
+            {"batch", required_argument, NULL, OPT_BATCH},
+            {NULL, 0, NULL, 0}
+    };
+
+    while((opt = getopt_long(argc, argv, "f:i:o:k:n:l:t:m:sq", long_options, NULL)) != -1)
     {
         switch(opt) {
+            case OPT_REORDER:
+                config.reorder = true;
+                break;
+            case OPT_SAVE_MODEL:
+                config.save_model = optarg;
+                break;
+            case OPT_WARM_START:
+                config.warm_start = optarg;
+                break;
+            case OPT_PREDICT:
+                config.predict_model = optarg;
+                break;
+            case OPT_DEDUP:
+                config.dedup = true;
+                break;
+            case OPT_GRID:
+                config.grid_cell = strtod(optarg, NULL);
+                if (config.grid_cell <= 0) {
+                    fprintf(stderr, "Error: The option 'grid' expects a positive cell size (got %s)\n", optarg);
+                    usage();
+                }
+                config.dedup = true; // points snapped to the same cell are duplicates
+                break;
+            case OPT_CORESET:
+                if (atoll(optarg) <= 0) {
+                    fprintf(stderr, "Error: The option 'coreset' expects a counting number (got %s)\n", optarg);
+                    usage();
+                }
+                config.coreset_size = (size_t)atoll(optarg);
+                break;
+            case OPT_CORESET_COMPARE:
+                config.coreset_compare = true;
+                break;
+            case OPT_AUTOTUNE:
+                config.autotune = true;
+                break;
+            case OPT_TUNING_FILE:
+                config.tuning_file = optarg;
+                config.autotune = true;
+                break;
+            case OPT_K_RANGE:
+                if (sscanf(optarg, "%d:%d", &config.num_clusters, &config.k_max) != 2
+                    || config.num_clusters <= 0 || config.k_max < config.num_clusters) {
+                    fprintf(stderr, "Error: The option 'k-range' expects MIN:MAX with 0 < MIN <= MAX (got %s)\n", optarg);
+                    usage();
+                }
+                break;
+            case OPT_HIERARCHY:
+                config.hierarchy_file = optarg;
+                break;
+            case OPT_PIPELINE:
+                config.pipeline = true;
+                break;
+            case OPT_GENERATE:
+                if (strcmp(optarg, "blobs") != 0 && strcmp(optarg, "uniform") != 0 && strcmp(optarg, "gps") != 0) {
+                    fprintf(stderr, "Error: The option 'generate' expects blobs, uniform or gps (got %s)\n", optarg);
+                    usage();
+                }
+                config.generate = optarg;
+                break;
+            case OPT_NOISE:
+                config.noise = strtod(optarg, NULL);
+                if (config.noise < 0 || config.noise > 1) {
+                    fprintf(stderr, "Error: The option 'noise' expects a fraction of the area from 0 to 1 (got %s)\n", optarg);
+                    usage();
+                }
+                break;
+            case OPT_SEED:
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case OPT_TRUTH:
+                config.truth_file = optarg;
+                break;
+            case OPT_CHECKPOINT:
+                config.checkpoint_file = optarg;
+                break;
+            case OPT_CHECKPOINT_EVERY: {
+                // a count of iterations, or seconds with an s after the number
+                char *end;
+                double every = strtod(optarg, &end);
+                if (every <= 0 || (*end != '\0' && strcmp(end, "s") != 0)
+                    || (*end == '\0' && every != (int)every)) {
+                    fprintf(stderr, "Error: The option 'checkpoint-every' expects a number of iterations "
+                                    "or of seconds followed by s (got %s)\n", optarg);
+                    usage();
+                }
+                config.checkpoint_iterations = *end == '\0' ? (int)every : 0;
+                config.checkpoint_seconds = every;
+                break;
+            }
+            case OPT_RESUME:
+                config.resume = true;
+                break;
+            case OPT_PROGRESS:
+                config.progress_file = optarg;
+                break;
+            case OPT_GEO:
+                config.geo = true;
+                break;
+            case OPT_BATCH:
+                config.batch_file = valid_file('b', optarg);
+                break;
+            case OPT_PROGRESS_EVERY:
+                config.progress_seconds = strtod(optarg, NULL);
+                if (config.progress_seconds <= 0) {
+                    fprintf(stderr, "Error: The option 'progress-every' expects a positive number of seconds (got %s)\n", optarg);
+                    usage();
+                }
+                break;
             case 's':
                 config.silent = true;
                 config.quiet = true; // silent is quiet too - one day replace this with proper logging
@@ -505,7 +976,7 @@ struct kmeans_config parse_cli(int argc, char *argv[])
                 config.max_iterations = valid_count(optopt, optarg);
                 break;
             case 'n':
-                config.max_points = valid_count(optopt, optarg);
+                config.max_points = valid_size(optopt, optarg);
                 break;
             case 'k':
                 config.num_clusters = valid_count(optopt, optarg);
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Sweep over a range of k (--k-range) to choose the number of clusters, with the dataset read
+ * and preprocessed once instead of once per run.
+ *
+ * Only the first k is started from the initial centroids. Every later k is warm started from
+ * the solution for k - 1: the cluster with the largest sum of squared distances is split in two
+ * along its main axis, and the other centroids are kept where they are. Most points then stay
+ * in their cluster, so each fit after the first usually needs few iterations.
+ *
+ * Each k gets its own metrics row, with the inertia for elbow plots and the Davies-Bouldin index
+ * and silhouette, and its time includes the split.
+ */
+
+// M_PI is not in C99
+#define PI 3.14159265358979323846
+
+/**
+ * Two centroids to split a cluster with: its centroid moved half a "standard deviation" each
+ * way along the main axis of the cluster, which for a normally distributed cluster are the
+ * means of the two halves.
+ *
+ * @param centroid centroid of the cluster
+ * @param weight total weight of the points of the cluster
+ * @param sxx weighted sum of dx * dx over the points, with dx and dy the distance from the centroid
+ * @param sxy weighted sum of dx * dy
+ * @param syy weighted sum of dy * dy
+ * @param halves set to the two new centroids
+ */
+void split_centroid(struct point *centroid, double weight, double sxx, double sxy, double syy, struct point halves[2])
+{
+    // largest eigenvalue and its eigenvector of the covariance of the cluster
+    double a = sxx / weight, b = sxy / weight, d = syy / weight;
+    double lambda = (a + d) / 2 + sqrt((a - d) * (a - d) / 4 + b * b);
+    double vx = b != 0 ? lambda - d : (a >= d ? 1.0 : 0.0);
+    double vy = b != 0 ? b : (a >= d ? 0.0 : 1.0);
+    double length = sqrt(vx * vx + vy * vy);
+    double offset = sqrt(2 * lambda / PI);
+    vx *= offset / length;
+    vy *= offset / length;
+
+    halves[0] = *centroid;
+    halves[0].x -= vx;
+    halves[0].y -= vy;
+    halves[1] = *centroid;
+    halves[1].x += vx;
+    halves[1].y += vy;
+}
+
+/**
+ * Split the cluster with the largest weighted sum of squared distances from its centroid into
+ * two with split_centroid, keeping the other centroids.
+ *
+ * @param dataset points assigned to the clusters of the centroids
+ * @param num_points number of points in the dataset
+ * @param centroids the centroids of the clusters, with room for one more
+ * @param num_clusters number of clusters before the split: the new centroid goes at this index
+ * @return false if no cluster can be split because every point is on its centroid
+ */
+static bool split_largest_cluster(struct point *dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    // per cluster: weight, then the weighted sums of dx * dx, dx * dy and dy * dy
+    double *moments = calloc(4 * num_clusters, sizeof(double));
+#pragma omp parallel for schedule(static) reduction(+:moments[:4 * num_clusters])
+    for (size_t n = 0; n < num_points; ++n) {
+        int k = dataset[n].cluster;
+        double dx = dataset[n].x - centroids[k].x;
+        double dy = dataset[n].y - centroids[k].y;
+        moments[4 * k] += dataset[n].weight;
+        moments[4 * k + 1] += dataset[n].weight * dx * dx;
+        moments[4 * k + 2] += dataset[n].weight * dx * dy;
+        moments[4 * k + 3] += dataset[n].weight * dy * dy;
+    }
+
+    int largest = 0;
+    for (int k = 1; k < num_clusters; ++k) {
+        if (moments[4 * k + 1] + moments[4 * k + 3] > moments[4 * largest + 1] + moments[4 * largest + 3]) {
+            largest = k;
+        }
+    }
+    double weight = moments[4 * largest];
+    double sxx = moments[4 * largest + 1];
+    double sxy = moments[4 * largest + 2];
+    double syy = moments[4 * largest + 3];
+    free(moments);
+    if (sxx + syy <= 0 || weight <= 0) {
+        return false;
+    }
+
+    struct point halves[2];
+    split_centroid(&centroids[largest], weight, sxx, sxy, syy, halves);
+    centroids[largest] = halves[0];
+    centroids[num_clusters] = halves[1];
+    return true;
+}
+
+/**
+ * Fit every k of the --k-range of the config, from config->num_clusters up to config->k_max,
+ * reporting the inertia and the time of each: on stdout, and a row each in the metrics file.
+ *
+ * @param config run configuration
+ * @param dataset points to cluster, possibly aggregated and reordered
+ * @param num_points number of points in the dataset
+ * @param initial_centroids centroids to start the first k from
+ * @param base metrics shared by every k (label, points, preprocessing times), copied for each k
+ */
+void sweep_clusters(struct kmeans_config *config, struct point *dataset, size_t num_points,
+                    struct point *initial_centroids, struct kmeans_metrics *base)
+{
+    struct point *centroids = malloc(config->k_max * sizeof(struct point));
+    memcpy(centroids, initial_centroids, config->num_clusters * sizeof(struct point));
+    char label[256];
+
+    if (!config->quiet) {
+        printf("\n%4s %20s %12s %10s %14s %12s\n", "k", "inertia", "seconds", "iterations",
+               "davies_bouldin", "silhouette");
+    }
+    for (int k = config->num_clusters; k <= config->k_max; ++k) {
+        double start_time = omp_get_wtime();
+        if (k > config->num_clusters && !split_largest_cluster(dataset, num_points, centroids, k - 1)) {
+            if (!config->quiet) {
+                printf("Stopping at k = %d: there are no more distinct points to split off\n", k - 1);
+            }
+            break;
+        }
+        if (config->autotune) {
+            autotune_start(config, num_points, k);
+        }
+        struct kmeans_metrics metrics = *base;
+        snprintf(label, sizeof(label), "%s k=%d", base->label, k);
+        metrics.label = label;
+        metrics.num_clusters = k;
+        metrics.omp_max_threads = omp_get_max_threads();
+        metrics.omp_schedule_kind = omp_schedule_kind(&metrics.omp_chunk_size);
+        engine_stats = (struct engine_stats) {0};
+
+        reserve_workspace(num_points, k);
+        long allocations_before_loop = workspace_allocations();
+        run_lloyd(dataset, num_points, centroids, k, config->max_iterations, &metrics);
+        metrics.loop_allocations = workspace_allocations() - allocations_before_loop;
+        if (config->autotune) {
+            autotune_finish(&metrics);
+        }
+        metrics.total_seconds = omp_get_wtime() - start_time;
+        metrics.engine = engine_stats;
+        metrics.inertia = inertia(dataset, num_points, centroids, k);
+        cluster_quality(dataset, num_points, centroids, k, &metrics);
+        metrics.peak_rss_kb = peak_rss_kb();
+
+        if (!config->quiet) {
+            printf("%4d %20.10g %12.6f %10d %14.6f %12.6f\n", k, metrics.inertia, metrics.total_seconds,
+                   metrics.used_iterations, metrics.davies_bouldin, metrics.silhouette);
+        }
+        if (config->metrics_file) {
+            write_metrics_file(config->metrics_file, &metrics);
+        }
+    }
+    free(centroids);
+}
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/**
+ * Work-stealing execution of a loop over the points, built on OpenMP tasks.
+ *
+ * The range of points is split in half recursively: the first half becomes a task that any
+ * idle thread can steal, the thread that split it carries on with the second half. Splitting
+ * stops at the grain size, and the remaining range is run as one block.
+ * Ranges where the points are expensive (e.g. when pruning skips most of the distance calculations
+ * for the cheap ones) get picked apart by idle threads, so no OMP_SCHEDULE tuning is needed.
+ *
+ * The grain starts at a cache-sized block and adapts after every loop: it is halved when the
+ * busiest thread spent much longer in blocks than the average thread (the last blocks were too
+ * big to even out the work) and grows back towards the cache-sized block when they are even.
+ */
+
+// largest block: the points of a block should fit comfortably in L2
+#define CACHE_BLOCK_BYTES (256 * 1024)
+#define MIN_BLOCK_POINTS 64
+// ratio of the busiest thread's block time to the average above which the grain is halved
+#define IMBALANCE_FACTOR 1.25
+// never make fewer blocks than this per thread, so there is something to steal
+#define MIN_BLOCKS_PER_THREAD 4
+
+/**
+ * Per-thread counters, padded to a cache line so threads don't share lines when updating them
+ */
+struct thread_block_stats {
+    long blocks;
+    long steals;
+    double block_seconds;
+    double max_block_seconds;
+    char padding[32];
+};
+
+static int block_grain = 0; // adapted from one call to the next, 0 until the first call
+#pragma omp threadprivate(block_grain)
+
+static int max_block_points()
+{
+    return CACHE_BLOCK_BYTES / sizeof(struct point);
+}
+
+/**
+ * Run the points from begin to end, splitting off tasks while the range is bigger than the grain.
+ *
+ * @param owner thread that created the task for this range: if it is not the current thread
+ *              the range was stolen
+ * @param thread_stats statistics of each thread of the team, in the workspace
+ */
+static void run_range(block_function function, void *context, size_t begin, size_t end, size_t grain, int owner,
+                      struct thread_block_stats *thread_stats)
+{
+    int thread = omp_get_thread_num();
+    struct thread_block_stats *stats = &thread_stats[thread];
+    if (owner != thread) {
+        stats->steals++;
+    }
+    while (end - begin > grain) {
+        size_t middle = begin + (end - begin) / 2;
+#pragma omp task
+        run_range(function, context, begin, middle, grain, thread, thread_stats);
+        begin = middle;
+    }
+
+    double start_block = omp_get_wtime();
+    function(begin, end, context);
+    double block_seconds = omp_get_wtime() - start_block;
+
+    stats->blocks++;
+    stats->block_seconds += block_seconds;
+    if (block_seconds > stats->max_block_seconds) {
+        stats->max_block_seconds = block_seconds;
+    }
+}
+
+/**
+ * Sizes the scheduler's per thread statistics in the workspace, so parallel_blocks does not
+ * allocate them in the first iteration
+ */
+void reserve_parallel_blocks()
+{
+    workspace_buffer(WORKSPACE_SCHEDULER, omp_get_max_threads() * sizeof(struct thread_block_stats));
+}
+
+/**
+ * Calls the function for blocks of points that together cover 0 to num_points, in parallel
+ * using work-stealing. The blocks are disjoint, but the function is called concurrently on
+ * different threads, so anything it accumulates must be per thread (omp_get_thread_num()) or atomic.
+ *
+ * Block counts, steals and timings are added to the global engine_stats.
+ *
+ * @param num_points number of points to run the function over
+ * @param function called with the begin (inclusive) and end (exclusive) of each block
+ * @param context passed to the function unchanged
+ */
+void parallel_blocks(size_t num_points, block_function function, void *context)
+{
+    int num_threads = omp_get_max_threads();
+    struct thread_block_stats *thread_stats =
+            workspace_buffer(WORKSPACE_SCHEDULER, num_threads * sizeof(struct thread_block_stats));
+    if (block_grain == 0) {
+        block_grain = max_block_points();
+    }
+    size_t grain = block_grain;
+    if (grain > num_points / (num_threads * MIN_BLOCKS_PER_THREAD)) {
+        grain = num_points / (num_threads * MIN_BLOCKS_PER_THREAD);
+    }
+    if (grain < MIN_BLOCK_POINTS) {
+        grain = MIN_BLOCK_POINTS;
+    }
+
+    for (int t = 0; t < num_threads; ++t) {
+        thread_stats[t] = (struct thread_block_stats) {0};
+    }
+#pragma omp parallel
+#pragma omp single
+    run_range(function, context, 0, num_points, grain, omp_get_thread_num(), thread_stats);
+
+    long blocks = 0;
+    double block_seconds = 0;
+    double max_block_seconds = 0;
+    double max_thread_seconds = 0;
+    for (int t = 0; t < num_threads; ++t) {
+        blocks += thread_stats[t].blocks;
+        block_seconds += thread_stats[t].block_seconds;
+        if (thread_stats[t].block_seconds > max_thread_seconds) {
+            max_thread_seconds = thread_stats[t].block_seconds;
+        }
+        engine_stats.work_steals += thread_stats[t].steals;
+        if (thread_stats[t].max_block_seconds > max_block_seconds) {
+            max_block_seconds = thread_stats[t].max_block_seconds;
+        }
+    }
+    engine_stats.work_blocks += blocks;
+    engine_stats.block_seconds += block_seconds;
+    if (max_block_seconds > engine_stats.max_block_seconds) {
+        engine_stats.max_block_seconds = max_block_seconds;
+    }
+
+    // adapt the grain for the next call from how evenly the work of this one was spread
+    double mean_thread_seconds = block_seconds / num_threads;
+    if (max_thread_seconds > IMBALANCE_FACTOR * mean_thread_seconds) {
+        if (block_grain / 2 >= MIN_BLOCK_POINTS) {
+            block_grain /= 2;
+        }
+    }
+    else if (block_grain * 2 <= max_block_points()) {
+        block_grain *= 2;
+    }
+    engine_stats.block_grain = grain;
+}
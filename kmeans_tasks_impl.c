@@ -0,0 +1,148 @@
+#include <float.h>
+#include <math.h>
+#include "kmeans.h"
+
+/**
+ * OpenMP tasks version:
+ * - both phases run over blocks of points scheduled by the work-stealing scheduler in
+ *   kmeans_tasks.c instead of omp for schedule(runtime), so OMP_SCHEDULE has no effect
+ * - per-thread partial sums for the centroids, combined after the blocks are done
+ */
+
+// pad each thread's partial sums to whole cache lines to avoid false sharing
+#define DOUBLES_PER_CACHE_LINE 8
+
+struct assign_context {
+    struct point *dataset;
+    struct point *centroids;
+    int num_clusters;
+    size_t cluster_changes;
+};
+
+struct centroids_context {
+    struct point *dataset;
+    double *partials; // per thread: sums of x, sums of y, counts, each stride long
+    int stride;
+};
+
+static void assign_block(size_t begin, size_t end, void *context)
+{
+    struct assign_context *c = context;
+    size_t cluster_changes = 0;
+    for (size_t n = begin; n < end; ++n) {
+        double min_distance = DBL_MAX; // init the min distance to a big number
+        int closest_cluster = -1;
+        for (int k = 0; k < c->num_clusters; ++k) {
+            // calc the distance passing pointers to points since the distance does not modify them
+            double distance_from_centroid = euclidean_distance(&c->dataset[n], &c->centroids[k]);
+            if (distance_from_centroid < min_distance) {
+                min_distance = distance_from_centroid;
+                closest_cluster = k;
+            }
+        }
+        // if the point was not already in the closest cluster, move it there and count changes
+        if (c->dataset[n].cluster != closest_cluster) {
+            c->dataset[n].cluster = closest_cluster;
+            cluster_changes++;
+#ifdef TRACE
+            debug_assignment(&c->dataset[n], closest_cluster, &c->centroids[closest_cluster], min_distance);
+#endif
+        }
+    }
+#pragma omp atomic
+    c->cluster_changes += cluster_changes;
+}
+
+static void sum_block(size_t begin, size_t end, void *context)
+{
+    struct centroids_context *c = context;
+    double *partial = &c->partials[omp_get_thread_num() * 3 * c->stride];
+    for (size_t n = begin; n < end; ++n) {
+        struct point *p = &c->dataset[n];
+        int k = p->cluster;
+        partial[k] += p->weight * p->x;
+        partial[c->stride + k] += p->weight * p->y;
+        partial[2 * c->stride + k] += p->weight;
+    }
+}
+
+/**
+ * Assigns each point in the dataset to a cluster based on the distance from that cluster.
+ *
+ * The return value indicates how many points were assigned to a _different_ cluster
+ * in this assignment process: this indicates how close the algorithm is to completion.
+ * When the return value is zero, no points changed cluster so the clustering is complete.
+ *
+ * @param dataset set of all points with current cluster assignments
+ * @param num_points number of points in the dataset
+ * @param centroids array that holds the current centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @return the number of points for which the cluster assignment was changed
+ */
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+#ifdef DEBUG
+    printf("\nStarting assignment phase:\n");
+#endif
+    struct assign_context context = { dataset, centroids, num_clusters, 0 };
+    parallel_blocks(num_points, assign_block, &context);
+    return context.cluster_changes;
+}
+
+/**
+ * Calculates new centroids for the clusters of the given dataset by finding the
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
+ *
+ * The centroids are set in the array passed in, which is expected to be pre-allocated
+ * and contain the previous centroids: these are overwritten by the new values.
+ *
+ * @param dataset set of all points with current cluster assigments
+ * @param num_points number of points in the dataset
+ * @param centroids array to hold the centroids - already allocated
+ * @param num_clusters number of clusters - hence size of the centroids array
+ */
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    int num_threads = omp_get_max_threads();
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    double *partials = workspace_buffer(WORKSPACE_PARTIALS, num_threads * 3 * stride * sizeof(double));
+    for (int i = 0; i < num_threads * 3 * stride; ++i) {
+        partials[i] = 0.0;
+    }
+    struct centroids_context context = { dataset, partials, stride };
+    parallel_blocks(num_points, sum_block, &context);
+
+    // the new centroids are at the mean x and y coords of the clusters
+    for (int k = 0; k < num_clusters; ++k) {
+        double sum_x = 0.0;
+        double sum_y = 0.0;
+        double count = 0.0;
+        for (int t = 0; t < num_threads; ++t) {
+            double *partial = &partials[t * 3 * stride];
+            sum_x += partial[k];
+            sum_y += partial[stride + k];
+            count += partial[2 * stride + k];
+        }
+        struct point new_centroid;
+        // mean x, mean y => new centroid
+        new_centroid.x = sum_x / count;
+        new_centroid.y = sum_y / count;
+        centroids[k] = new_centroid;
+    }
+}
+
+/**
+ * Sizes the workspace for a run: the partial cluster sums of every thread, and the statistics
+ * of the scheduler.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    (void)num_points; // the scratch space depends on the clusters only
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
+    reserve_parallel_blocks();
+}
@@ -0,0 +1,169 @@
+#include <float.h>
+#include "kmeans.h"
+
+/**
+ * Assignment with kernels specialized for each small number of clusters.
+ *
+ * The generic assignment loops over a runtime number of clusters and calls euclidean_distance
+ * through pointers for every centroid. For k from 2 to MAX_UNROLLED_K the ASSIGN_KERNEL macro
+ * below stamps out a kernel with k fixed at compile time: the centroids are copied into local
+ * arrays the compiler can keep in registers, the loop over them is fully unrolled, and the
+ * nearest one is picked without branches (conditional moves) on squared distances, since the
+ * square root doesn't change which centroid is nearest. Other k fall back to the generic loop.
+ *
+ * Only 2-D points exist in this program, so the kernels are specialized on k alone.
+ */
+
+#define MAX_UNROLLED_K 16
+// pad each thread's partial sums to whole cache lines to avoid false sharing
+#define DOUBLES_PER_CACHE_LINE 8
+
+typedef size_t (*assign_kernel)(struct point *, size_t, struct point *);
+
+/**
+ * Defines assign_k<K>, the assignment for exactly K clusters. Ties go to the lowest cluster,
+ * as in the generic loop, and a centroid at NaN (an empty cluster) is never the nearest.
+ */
+#define ASSIGN_KERNEL(K) \
+static size_t assign_k##K(struct point *dataset, size_t num_points, struct point *centroids) \
+{ \
+    double cx[K], cy[K]; \
+    for (int k = 0; k < K; ++k) { \
+        cx[k] = centroids[k].x; \
+        cy[k] = centroids[k].y; \
+    } \
+    size_t cluster_changes = 0; \
+    _Pragma("omp parallel for schedule(runtime) reduction(+:cluster_changes)") \
+    for (size_t n = 0; n < num_points; ++n) { \
+        double x = dataset[n].x, y = dataset[n].y; \
+        double min_distance = DBL_MAX; \
+        int closest_cluster = 0; \
+        for (int k = 0; k < K; ++k) { \
+            double distance = (x - cx[k]) * (x - cx[k]) + (y - cy[k]) * (y - cy[k]); \
+            closest_cluster = distance < min_distance ? k : closest_cluster; \
+            min_distance = distance < min_distance ? distance : min_distance; \
+        } \
+        if (dataset[n].cluster != closest_cluster) { \
+            dataset[n].cluster = closest_cluster; \
+            cluster_changes++; \
+        } \
+    } \
+    return cluster_changes; \
+}
+
+ASSIGN_KERNEL(2)
+ASSIGN_KERNEL(3)
+ASSIGN_KERNEL(4)
+ASSIGN_KERNEL(5)
+ASSIGN_KERNEL(6)
+ASSIGN_KERNEL(7)
+ASSIGN_KERNEL(8)
+ASSIGN_KERNEL(9)
+ASSIGN_KERNEL(10)
+ASSIGN_KERNEL(11)
+ASSIGN_KERNEL(12)
+ASSIGN_KERNEL(13)
+ASSIGN_KERNEL(14)
+ASSIGN_KERNEL(15)
+ASSIGN_KERNEL(16)
+
+// kernel for each k, NULL where there is none
+static const assign_kernel kernels[MAX_UNROLLED_K + 1] = {
+        NULL, NULL, assign_k2, assign_k3, assign_k4, assign_k5, assign_k6, assign_k7, assign_k8,
+        assign_k9, assign_k10, assign_k11, assign_k12, assign_k13, assign_k14, assign_k15, assign_k16
+};
+
+/**
+ * Assigns each point in the dataset to a cluster based on the distance from that cluster,
+ * with the kernel for num_clusters if there is one.
+ *
+ * @param dataset set of all points with current cluster assignments
+ * @param num_points number of points in the dataset
+ * @param centroids array that holds the current centroids
+ * @param num_clusters number of clusters - hence size of the centroids array
+ * @return the number of points for which the cluster assignment was changed
+ */
+size_t assign_clusters(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    if (num_clusters <= MAX_UNROLLED_K && kernels[num_clusters]) {
+        return kernels[num_clusters](dataset, num_points, centroids);
+    }
+
+    size_t cluster_changes = 0;
+#pragma omp parallel for schedule(runtime) reduction(+:cluster_changes)
+    for (size_t n = 0; n < num_points; ++n) {
+        double min_distance = DBL_MAX;
+        int closest_cluster = -1;
+        for (int k = 0; k < num_clusters; ++k) {
+            double distance_from_centroid = euclidean_distance(&dataset[n], &centroids[k]);
+            if (distance_from_centroid < min_distance) {
+                min_distance = distance_from_centroid;
+                closest_cluster = k;
+            }
+        }
+        if (dataset[n].cluster != closest_cluster) {
+            dataset[n].cluster = closest_cluster;
+            cluster_changes++;
+        }
+    }
+    return cluster_changes;
+}
+
+/**
+ * Calculates new centroids for the clusters of the given dataset by finding the
+ * mean x and y coordinates of the current members of the cluster for each cluster,
+ * weighted by the point weights.
+ *
+ * @param dataset set of all points with current cluster assigments
+ * @param num_points number of points in the dataset
+ * @param centroids array to hold the centroids - already allocated
+ * @param num_clusters number of clusters - hence size of the centroids array
+ */
+void calculate_centroids(struct point* dataset, size_t num_points, struct point *centroids, int num_clusters)
+{
+    // a partial sum per thread instead of an array reduction, which allocates a private
+    // copy of the sums in every call
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    double *partials = workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
+#pragma omp parallel
+    {
+        int team = omp_get_num_threads();
+        double *partial = &partials[omp_get_thread_num() * 3 * stride];
+        for (int i = 0; i < 3 * stride; ++i) {
+            partial[i] = 0.0;
+        }
+#pragma omp for schedule(runtime)
+        for (size_t n = 0; n < num_points; ++n) {
+            int k = dataset[n].cluster;
+            partial[k] += dataset[n].weight * dataset[n].x;
+            partial[stride + k] += dataset[n].weight * dataset[n].y;
+            partial[2 * stride + k] += dataset[n].weight;
+        }
+
+        // the new centroids are at the mean x and y coords of the clusters
+#pragma omp for schedule(static)
+        for (int k = 0; k < num_clusters; ++k) {
+            double sum_x = 0.0, sum_y = 0.0, weight = 0.0;
+            for (int t = 0; t < team; ++t) {
+                sum_x += partials[t * 3 * stride + k];
+                sum_y += partials[t * 3 * stride + stride + k];
+                weight += partials[t * 3 * stride + 2 * stride + k];
+            }
+            centroids[k].x = sum_x / weight;
+            centroids[k].y = sum_y / weight;
+        }
+    }
+}
+
+/**
+ * Sizes the workspace for a run: the partial cluster sums of every thread.
+ *
+ * @param num_points number of points in the dataset
+ * @param num_clusters number of clusters
+ */
+void reserve_workspace(size_t num_points, int num_clusters)
+{
+    (void)num_points; // the scratch space depends on the clusters only
+    int stride = (num_clusters + DOUBLES_PER_CACHE_LINE - 1) / DOUBLES_PER_CACHE_LINE * DOUBLES_PER_CACHE_LINE;
+    workspace_buffer(WORKSPACE_PARTIALS, omp_get_max_threads() * 3 * stride * sizeof(double));
+}
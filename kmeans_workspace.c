@@ -0,0 +1,81 @@
+// for posix_memalign and getrusage, which -std=c99 hides
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <sys/resource.h>
+#include "kmeans.h"
+
+/**
+ * The workspace owns the scratch buffers of the engines, so nothing is allocated inside the
+ * iterations: main asks the engine to reserve what it needs for the run (reserve_workspace)
+ * before the first iteration, and the engine then gets the same buffers back on every call.
+ *
+ * Each buffer starts on a cache line. A buffer only grows, and only when asked for more than
+ * it has, in which case its contents are lost - every growth is counted so the metrics can
+ * show that none happened in the loop.
+ */
+
+#define CACHE_LINE_BYTES 64
+
+static void *buffers[WORKSPACE_SLOTS];
+static size_t buffer_sizes[WORKSPACE_SLOTS];
+static long allocations = 0;
+// every thread that runs a clustering has its own workspace: the jobs of a batch run side by side
+#pragma omp threadprivate(buffers, buffer_sizes, allocations)
+
+/**
+ * Get the buffer of a slot, with room for at least the given number of bytes.
+ * Must not be called from inside a parallel region: the buffers are those of the calling thread.
+ *
+ * @param slot which buffer
+ * @param bytes size needed
+ * @return the buffer, cache line aligned; the same as the last call unless it had to grow
+ */
+void *workspace_buffer(enum workspace_slot slot, size_t bytes)
+{
+    if (bytes > buffer_sizes[slot] || !buffers[slot]) {
+        free(buffers[slot]);
+        if (posix_memalign(&buffers[slot], CACHE_LINE_BYTES, bytes > 0 ? bytes : CACHE_LINE_BYTES) != 0) {
+            fprintf(stderr, "Error: cannot allocate %zu bytes of workspace\n", bytes);
+            exit(1);
+        }
+        buffer_sizes[slot] = bytes;
+        allocations++;
+    }
+    return buffers[slot];
+}
+
+/**
+ * Number of times a workspace buffer was allocated since the start of the program
+ */
+long workspace_allocations()
+{
+    return allocations;
+}
+
+/**
+ * Free every workspace buffer
+ */
+void workspace_free()
+{
+    for (int slot = 0; slot < WORKSPACE_SLOTS; ++slot) {
+        free(buffers[slot]);
+        buffers[slot] = NULL;
+        buffer_sizes[slot] = 0;
+    }
+}
+
+/**
+ * The most memory the process has had resident at any time, in kilobytes
+ */
+long peak_rss_kb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+}
@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+# Check that kmeans_deterministic gives bitwise identical results for any number of threads and
+# schedule, and report its overhead against the non-deterministic fast path (kmeans_omp3)
+if [ -z "$KMEANS_HOME" ]; then
+  current_dir=$( cd "$( dirname ${BASH_SOURCE[0]} )" && pwd )
+  export KMEANS_HOME=$( dirname ${current_dir} )
+fi
+data_dir=${KMEANS_HOME}/data
+out_dir=${KMEANS_HOME}/outdata
+test_dir=${KMEANS_HOME}/testdata
+metrics_dir=${KMEANS_HOME}/reports
+bin_dir=${KMEANS_HOME}/bin
+
+in=${1:-jutland_500.csv}
+test=${2:-jutland_500_clustered_knime.csv}
+num_clusters=${3:-22}
+max_points=1000000
+max_iterations=500
+thread_counts="1 2 4 8"
+schedules="static dynamic,1 guided"
+
+metrics_file=${metrics_dir}/deterministic_metrics.csv
+mkdir -p "${out_dir}" "${metrics_dir}"
+rm -f "${metrics_file}"
+
+singlerun() {
+  "${bin_dir}/${program}" -s -f "${data_dir}/${in}" ${out_arg} -m "${metrics_file}" -t "${test_dir}/${test}" \
+      -k ${num_clusters} -n ${max_points} -i ${max_iterations} -l "${program} t=${threads} ${OMP_SCHEDULE}"
+}
+
+reference=""
+identical=yes
+for threads in ${thread_counts}; do
+  export OMP_NUM_THREADS=${threads}
+  for schedule in ${schedules}; do
+    export OMP_SCHEDULE=${schedule}
+    out_file=${out_dir}/deterministic_t${threads}_${schedule/,/_}.csv
+    out_arg="-o ${out_file}"
+    program=kmeans_deterministic
+    singlerun
+    if [ -z "${reference}" ]; then
+      reference=${out_file}
+    elif ! cmp -s "${reference}" "${out_file}"; then
+      echo "NOT IDENTICAL: ${out_file} differs from ${reference}"
+      identical=no
+    fi
+    out_arg=""
+    program=kmeans_omp3
+    singlerun
+  done
+done
+
+echo "Bitwise identical output for all thread counts and schedules: ${identical}"
+# average total_seconds per program and thread count, deterministic relative to omp3
+awk -F, 'NR > 1 {
+    split($1, words, " ");
+    key = words[2]; sum[words[1] " " key] += $3; runs[words[1] " " key]++; keys[key] = 1
+  }
+  END {
+    printf("%-8s %14s %14s %10s\n", "threads", "omp3_seconds", "determ_seconds", "overhead");
+    for (key in keys) {
+      fast = sum["kmeans_omp3 " key] / runs["kmeans_omp3 " key];
+      det = sum["kmeans_deterministic " key] / runs["kmeans_deterministic " key];
+      printf("%-8s %14f %14f %9.1f%%\n", key, fast, det, 100 * (det - fast) / fast);
+    }
+  }' "${metrics_file}"
+[ "${identical}" = yes ]
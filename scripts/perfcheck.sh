@@ -0,0 +1,134 @@
+#!/usr/bin/env bash
+# Performance regression gate (make perfcheck): run every engine on a fixed set of inputs a few
+# times, and compare the median time, the iterations and the test result of each run with the
+# baseline in scripts/perfcheck_baseline.csv. Fails, with a table of what changed, if any run
+# got slower than the noise allows, needs a different number of iterations or stops passing.
+#
+# usage: perfcheck.sh [--update]    --update writes a new baseline instead of comparing
+#
+# Timings only compare on the same machine and thread count, so make a baseline on the machine
+# the check runs on first (make perfcheck-baseline): the check fails if the baseline has no runs
+# with the same threads, and then only checks the test results. A run counts as slower when its median is
+# above the baseline median by more than REL_TOLERANCE of it, ABS_TOLERANCE seconds and
+# 3 median absolute deviations of either run, whichever is largest.
+if [ -z "$KMEANS_HOME" ]; then
+  current_dir=$( cd "$( dirname ${BASH_SOURCE[0]} )" && pwd )
+  export KMEANS_HOME=$( dirname ${current_dir} )
+fi
+data_dir=${KMEANS_HOME}/data
+test_dir=${KMEANS_HOME}/testdata
+bin_dir=${KMEANS_HOME}/bin
+baseline=${BASELINE:-${KMEANS_HOME}/scripts/perfcheck_baseline.csv}
+
+engines=${ENGINES:-"simple omp1 omp2 omp3 tasks incremental deterministic grid bisect unrolled"}
+repeats=${REPEATS:-5}
+REL_TOLERANCE=${REL_TOLERANCE:-0.25}
+ABS_TOLERANCE=${ABS_TOLERANCE:-0.005}
+max_iterations=500
+threads=${OMP_NUM_THREADS:-$(nproc)}
+export OMP_NUM_THREADS=${threads}
+
+# input, clusters, test file: jutland_400k only with PERFCHECK_LARGE=1, since it takes minutes
+matrix="iris_petals_2.csv 3 iris_petals_knime.csv
+s1.csv 15 s1_clustered_knime.csv
+jutland_500.csv 22 jutland_500_clustered_knime.csv"
+work_dir=$(mktemp -d)
+trap 'rm -rf "${work_dir}"' EXIT
+# and a generated set big enough for the timings to rise well above the noise
+# with blobs far enough apart that every point is in the cluster it was drawn from, so the
+# test against the truth file passes and a change of result shows up as a failed test
+"${bin_dir}/kmeans_simple" -s --generate blobs -n 500000 -k 16 --seed 1 --noise 0.002 \
+    -o "${work_dir}/blobs_500k.csv" --truth "${work_dir}/blobs_500k_truth.csv" > /dev/null || exit 1
+matrix="${matrix}
+${work_dir}/blobs_500k.csv 16 ${work_dir}/blobs_500k_truth.csv"
+if [ -n "${PERFCHECK_LARGE}" ]; then
+  unzip -q -o "${data_dir}/jutland_400k.csv.zip" -d "${work_dir}" \
+    && unzip -q -o "${test_dir}/jutland_400k_clustered_knime.csv.zip" -d "${work_dir}" \
+    && matrix="${matrix}
+${work_dir}/jutland_400k.csv 22 ${work_dir}/jutland_400k_clustered_knime.csv"
+fi
+
+# median of the numbers on stdin, one per line
+median() {
+  sort -g | awk '{ v[NR] = $1 } END { printf "%.6f\n", (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# median and median absolute deviation of the numbers on stdin, one per line
+median_mad() {
+  local values=$(cat)
+  local m=$(echo "${values}" | median)
+  local mad=$(echo "${values}" | awk -v m=${m} '{ d = $1 - m; print d < 0 ? -d : d }' | median)
+  echo "${m},${mad}"
+}
+
+results=${work_dir}/results.csv
+echo "engine,input,clusters,threads,iterations,test_result,median_seconds,mad_seconds" > "${results}"
+while read -r in num_clusters test; do
+  [[ "${in}" = /* ]] || in=${data_dir}/${in}
+  [[ "${test}" = /* ]] || test=${test_dir}/${test}
+  for engine in ${engines}; do
+    metrics=${work_dir}/metrics_${engine}.csv
+    rm -f "${metrics}"
+    for ((r = 0; r < repeats; r++)); do
+      "${bin_dir}/kmeans_${engine}" -s -f "${in}" -t "${test}" -k ${num_clusters} -i ${max_iterations} \
+          -m "${metrics}" > /dev/null || { echo "kmeans_${engine} failed on ${in}"; exit 1; }
+    done
+    # columns of the metrics file: 2 used_iterations, 3 total_seconds, 13 test_results
+    iterations=$(tail -n +2 "${metrics}" | cut -d, -f2 | sort -u | paste -sd/)
+    test_result=$(tail -n +2 "${metrics}" | cut -d, -f13 | sort -u | paste -sd/)
+    timing=$(tail -n +2 "${metrics}" | cut -d, -f3 | median_mad)
+    echo "${engine},$(basename ${in}),${num_clusters},${threads},${iterations},${test_result},${timing}" >> "${results}"
+  done
+done <<< "${matrix}"
+
+if [ "$1" = "--update" ]; then
+  cp "${results}" "${baseline}"
+  echo "Wrote a new baseline of $(( $(wc -l < "${baseline}") - 1 )) runs to ${baseline}"
+  exit 0
+fi
+if [ ! -f "${baseline}" ]; then
+  echo "No baseline at ${baseline}: make one with make perfcheck-baseline"
+  exit 1
+fi
+
+awk -F, -v rel=${REL_TOLERANCE} -v abs=${ABS_TOLERANCE} -v threads=${threads} '
+  FNR == 1 { next }
+  NR == FNR {
+    key = $1 "," $2 "," $3 "," $4; iterations[key] = $5; test[key] = $6; median[key] = $7; mad[key] = $8
+    # the result does not depend on the threads: any row of the baseline can check it
+    run = $1 "," $2 "," $3; run_test[run] = $6
+    next
+  }
+  {
+    key = $1 "," $2 "," $3 "," $4
+    run = $1 "," $2 "," $3
+    if (!(key in median)) {
+      # no timings to compare with for this thread count, but the test must still pass
+      status = "NEW (no timing in the baseline)"
+      if (run_test[run] == "passed" && $6 != "passed") { status = "REGRESSION: test " run_test[run] " -> " $6; failed++ }
+      printf "%-14s %-32s %4d %8s %12s %12.6f %8s  %s\n", $1, $2, $3, $5, "-", $7, "-", status
+      next
+    }
+    matched++
+    allowed = rel * median[key]
+    if (abs > allowed) allowed = abs
+    if (3 * mad[key] > allowed) allowed = 3 * mad[key]
+    if (3 * $8 > allowed) allowed = 3 * $8
+    status = "ok"
+    if ($5 != iterations[key]) { status = "REGRESSION: iterations " iterations[key] " -> " $5; failed++ }
+    else if (test[key] == "passed" && $6 != "passed") { status = "REGRESSION: test " test[key] " -> " $6; failed++ }
+    else if ($7 > median[key] + allowed) { status = "REGRESSION: slower"; failed++ }
+    else if ($7 < median[key] - allowed) { status = "faster" }
+    change = median[key] > 0 ? 100 * ($7 / median[key] - 1) : 0
+    printf "%-14s %-32s %4d %8s %12.6f %12.6f %+7.1f%%  %s\n", $1, $2, $3, $5, median[key], $7, change, status
+  }
+  BEGIN { printf "%-14s %-32s %4s %8s %12s %12s %8s  %s\n", "engine", "input", "k", "iters", "baseline", "now", "change", "status" }
+  END {
+    if (failed) { printf "\n%d regressions against the baseline\n", failed; exit 1 }
+    if (!matched) {
+      printf "\nNo run of the baseline is for %d threads, so no timing was checked: make a baseline on this\n", threads
+      printf "machine with make perfcheck-baseline, or run with the OMP_NUM_THREADS of the baseline\n"
+      exit 1
+    }
+    printf "\nNo regressions against the baseline\n"
+  }' "${baseline}" "${results}"